@@ -0,0 +1,100 @@
+// Interning table for addresses that don't fit in flow records.
+//
+// Flow records have room for IPv4 addresses only; IPv6 addresses are
+// interned here and flow records hold references to them instead (see
+// ADDR_REF in common.h). Addresses are numbered in order of interning
+// and never removed. IPv4 addresses are stored in IPv4-mapped form.
+//
+// Buckets are the same eight-byte tag and entry number pairs as in the
+// flow table, so the includer must include flow_table.c first.
+
+typedef struct {
+  u_char a[16];
+} addr_entry;
+
+typedef struct {
+  addr_entry  *addrs;   // by index
+  u_int32_t    n;
+  u_int32_t    cap;
+  flow_bucket *buckets;
+  u_int64_t    mask;
+} addr_table;
+
+static inline u_int64_t addr_hash(const u_char *a) {
+  u_int64_t x, y;
+  memcpy(&x,a,8);
+  memcpy(&y,a+8,8);
+  return fmix64(x ^ fmix64(y + 0x9e3779b97f4a7c15ULL));
+}
+
+static inline void addr_v4_mapped(u_char *a, u_int32_t ip) {
+  memset(a,0,10);
+  a[10] = a[11] = 0xff;
+  memcpy(a+12,&ip,4);
+}
+
+static void addr_table_init(addr_table *t) {
+  memset(t,0,sizeof(*t));
+  t->mask = (1ULL << FLOW_TABLE_MIN_BITS) - 1;
+  t->buckets = calloc(t->mask+1,sizeof(flow_bucket));
+  if (!t->buckets)
+    die("calloc: %s\n",errstr);
+}
+
+static void addr_table_free(addr_table *t) {
+  free(t->addrs);
+  free(t->buckets);
+  memset(t,0,sizeof(*t));
+}
+
+static flow_bucket *addr_table_probe(addr_table *t, const u_char *a, u_int64_t hash) {
+  u_int32_t tag = FLOW_TAG(hash);
+  u_int64_t i = hash & t->mask;
+  for (;; i = (i+1) & t->mask) {
+    flow_bucket *b = &t->buckets[i];
+    if (!b->slot ||
+        b->tag == tag && !memcmp(t->addrs[b->slot-1].a,a,16))
+      return b;
+  }
+}
+
+static void addr_table_grow(addr_table *t) {
+  free(t->buckets);
+  t->mask = 2*t->mask + 1;
+  t->buckets = calloc(t->mask+1,sizeof(flow_bucket));
+  if (!t->buckets)
+    die("calloc: %s\n",errstr);
+  u_int32_t i;
+  for (i = 0; i < t->n; i++) {
+    u_int64_t hash = addr_hash(t->addrs[i].a);
+    flow_bucket *b = addr_table_probe(t,t->addrs[i].a,hash);
+    b->tag = FLOW_TAG(hash);
+    b->slot = i+1;
+  }
+}
+
+// get the index of an address, adding it if it isn't present
+
+static u_int32_t addr_intern(addr_table *t, const u_char *a) {
+  u_int64_t hash = addr_hash(a);
+  flow_bucket *b = addr_table_probe(t,a,hash);
+  if (b->slot)
+    return b->slot-1;
+
+  if (t->n == MAX_ADDR_REFS)
+    die("Too many distinct addresses: %u.\n",t->n);
+  if (t->n == t->cap) {
+    t->cap = t->cap ? 2*t->cap : 1024;
+    if (!(t->addrs = realloc(t->addrs,t->cap*sizeof(addr_entry))))
+      die("realloc: %s\n",errstr);
+  }
+  memcpy(t->addrs[t->n].a,a,16);
+  t->n++;
+  if (4*t->n > 3*(t->mask+1)) {
+    addr_table_grow(t);
+  } else {
+    b->tag = FLOW_TAG(hash);
+    b->slot = t->n;
+  }
+  return t->n-1;
+}
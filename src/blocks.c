@@ -0,0 +1,335 @@
+// Block-compressed flow and packet files.
+//
+// A block-compressed file is a zstd file whose contents are a flow or
+// packet file with a file header: its first frame holds the header,
+// each following frame holds a block of records, and a skippable frame
+// at the end indexes the blocks. Anything that reads zstd files reads
+// it as the file it was made from -- open_arg decodes the frames in
+// parallel -- while tools that find the index can seek to the blocks
+// they need and decode only those.
+//
+// The index is an entry per block, then the number of blocks as a u64
+// and BLOCK_MAGIC. Entries are the offset of the block's frame in the
+// file, the number of its first record, its record count and frame
+// size, and, for packet files, the least and greatest flow index and
+// time of its packets; all in network byte-order.
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zstd.h>
+
+#include "common.h"
+
+#define BLOCK_MAGIC          "TTBLOCKS"
+#define BLOCK_ENTRY_SIZE     56
+#define BLOCK_SKIPPABLE      0x184d2a5b // zstd skippable frame magic
+#define BLOCK_TRAILER        16
+
+static inline void put_le32(u_char *p, u_int32_t x) {
+  p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24;
+}
+static inline u_int32_t get_le32(const u_char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (u_int32_t) p[3] << 24;
+}
+static inline void put_be64(u_char *p, u_int64_t x) {
+  x = GUINT64_TO_BE(x);
+  memcpy(p,&x,8);
+}
+static inline u_int64_t get_be64(const u_char *p) {
+  u_int64_t x;
+  memcpy(&x,p,8);
+  return GUINT64_FROM_BE(x);
+}
+
+// writing
+
+struct block_writer {
+  record_writer *out;
+  file_header    h;
+  size_t         record_size;
+  u_int32_t      records;   // per block
+  int            level;
+  u_int64_t      offset;    // bytes written so far
+  u_char        *buf;       // records of the block being gathered
+  u_int32_t      n;
+  u_char        *frame;
+  size_t         frame_cap;
+  block_entry   *index;
+  u_int64_t      n_blocks, cap;
+  u_int64_t      count;
+  ZSTD_CCtx     *cctx;
+};
+
+static void block_frame(block_writer *b, const void *data, size_t n) {
+  size_t r = ZSTD_compressCCtx(b->cctx,b->frame,b->frame_cap,data,n,b->level);
+  if (ZSTD_isError(r))
+    die("ZSTD_compress: %s\n",ZSTD_getErrorName(r));
+  writer_put(b->out,b->frame,r);
+  b->offset += r;
+}
+
+// a block writer writes the header frame right away; the header is
+// written as given, so its counts should be final
+
+block_writer *block_writer_open(record_writer *out, const file_header *h,
+                                u_int32_t records, int level) {
+  block_writer *b = calloc(1,sizeof(block_writer));
+  if (!b)
+    die("calloc: %s\n",errstr);
+  b->out = out;
+  b->h = *h;
+  b->record_size = h->type == FILE_FLOWS ?
+    sizeof(flow_record) : packet_record_size(h->version);
+  b->records = records;
+  b->level = level;
+  b->buf = malloc(records*b->record_size);
+  b->frame_cap = ZSTD_compressBound(records*b->record_size);
+  b->frame = malloc(b->frame_cap);
+  if (!b->buf || !b->frame)
+    die("malloc: %s\n",errstr);
+  if (!(b->cctx = ZSTD_createCCtx()))
+    die("ZSTD_createCCtx failed.\n");
+
+  char head[FILE_HEADER_SIZE];
+  file_header_encode(&b->h,head);
+  block_frame(b,head,sizeof(head));
+  return b;
+}
+
+static void block_flush(block_writer *b) {
+  if (!b->n)
+    return;
+  if (b->n_blocks == b->cap) {
+    b->cap = b->cap ? 2*b->cap : 1024;
+    if (!(b->index = realloc(b->index,b->cap*sizeof(block_entry))))
+      die("realloc: %s\n",errstr);
+  }
+  block_entry *e = &b->index[b->n_blocks++];
+  memset(e,0,sizeof(*e));
+  e->offset = b->offset;
+  e->first = b->count;
+  e->records = b->n;
+  if (b->h.type == FILE_FLOWS) {
+    e->min_flow = b->count;
+    e->max_flow = b->count + b->n - 1;
+  } else {
+    u_int32_t i;
+    for (i = 0; i < b->n; i++) {
+      packet_data p;
+      packet_decode(b->h.version,b->buf + i*b->record_size,&p);
+      if (!i || p.flow < e->min_flow) e->min_flow = p.flow;
+      if (!i || p.flow > e->max_flow) e->max_flow = p.flow;
+      if (!i || p.time < e->min_time) e->min_time = p.time;
+      if (!i || p.time > e->max_time) e->max_time = p.time;
+    }
+  }
+  block_frame(b,b->buf,b->n*b->record_size);
+  e->bytes = b->offset - e->offset;
+  b->count += b->n;
+  b->n = 0;
+}
+
+void block_put(block_writer *b, const void *record) {
+  memcpy(b->buf + b->n*b->record_size,record,b->record_size);
+  if (++b->n == b->records)
+    block_flush(b);
+}
+
+// write out the last block and the index; the record writer is left
+// open
+
+void block_writer_close(block_writer *b) {
+  block_flush(b);
+  size_t n = b->n_blocks*BLOCK_ENTRY_SIZE + BLOCK_TRAILER;
+  u_char *buf = malloc(8 + n), *p = buf + 8;
+  if (!buf)
+    die("malloc: %s\n",errstr);
+  put_le32(buf,BLOCK_SKIPPABLE);
+  put_le32(buf+4,n);
+  u_int64_t i;
+  for (i = 0; i < b->n_blocks; i++, p += BLOCK_ENTRY_SIZE) {
+    block_entry *e = &b->index[i];
+    put_be64(p,e->offset);
+    put_be64(p+8,e->first);
+    u_int32_t x = htonl(e->records), y = htonl(e->bytes);
+    memcpy(p+16,&x,4);
+    memcpy(p+20,&y,4);
+    put_be64(p+24,e->min_flow);
+    put_be64(p+32,e->max_flow);
+    put_be64(p+40,e->min_time);
+    put_be64(p+48,e->max_time);
+  }
+  put_be64(p,b->n_blocks);
+  memcpy(p+8,BLOCK_MAGIC,8);
+  writer_put(b->out,buf,8 + n);
+  free(buf);
+  ZSTD_freeCCtx(b->cctx);
+  free(b->index);
+  free(b->frame);
+  free(b->buf);
+  free(b);
+}
+
+// reading: the file is mapped, and blocks are decoded on demand into
+// a buffer holding the last one decoded
+
+block_file *block_open(const char *name) {
+  int fd = open(name,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",name,errstr);
+  struct stat fs;
+  if (fstat(fd,&fs) || !S_ISREG(fs.st_mode) || fs.st_size < 8 + BLOCK_TRAILER) {
+    close(fd);
+    return NULL;
+  }
+  u_char *map = mmap(0,fs.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  close(fd);
+  if (map == MAP_FAILED)
+    die("mmap(\"%s\"): %s\n",name,errstr);
+  size_t size = fs.st_size;
+  if (memcmp(map + size - 8,BLOCK_MAGIC,8)) {
+    munmap(map,size);
+    return NULL;
+  }
+
+  block_file *f = calloc(1,sizeof(block_file));
+  if (!f)
+    die("calloc: %s\n",errstr);
+  f->name = name;
+  f->map = map;
+  f->size = size;
+  f->n_blocks = get_be64(map + size - BLOCK_TRAILER);
+  size_t n = f->n_blocks*BLOCK_ENTRY_SIZE + BLOCK_TRAILER;
+  if (f->n_blocks > size / BLOCK_ENTRY_SIZE || size < 8 + n ||
+      get_le32(map + size - n - 8) != BLOCK_SKIPPABLE ||
+      get_le32(map + size - n - 4) != n)
+    die("%s: corrupt block index.\n",name);
+
+  // the header is the first frame
+  char head[FILE_HEADER_SIZE];
+  size_t r = ZSTD_findFrameCompressedSize(map,size);
+  if (!ZSTD_isError(r))
+    r = ZSTD_decompress(head,sizeof(head),map,r);
+  if (ZSTD_isError(r) || !file_header_parse(head,r,&f->h) ||
+      f->h.type == FILE_COLUMNS)
+    die("%s: bad block-compressed file header.\n",name);
+  f->record_size = f->h.type == FILE_FLOWS ?
+    sizeof(flow_record) : packet_record_size(f->h.version);
+
+  const u_char *p = map + size - n;
+  if (!(f->index = calloc(f->n_blocks + 1,sizeof(block_entry))))
+    die("calloc: %s\n",errstr);
+  u_int64_t i;
+  for (i = 0; i < f->n_blocks; i++, p += BLOCK_ENTRY_SIZE) {
+    block_entry *e = &f->index[i];
+    u_int32_t x, y;
+    e->offset = get_be64(p);
+    e->first = get_be64(p+8);
+    memcpy(&x,p+16,4);
+    memcpy(&y,p+20,4);
+    e->records = ntohl(x);
+    e->bytes = ntohl(y);
+    e->min_flow = get_be64(p+24);
+    e->max_flow = get_be64(p+32);
+    e->min_time = get_be64(p+40);
+    e->max_time = get_be64(p+48);
+    if (e->offset + e->bytes > size || e->first != f->count)
+      die("%s: corrupt block index.\n",name);
+    f->count += e->records;
+  }
+  f->cached = -1;
+  if (!(f->dctx = ZSTD_createDCtx()))
+    die("ZSTD_createDCtx failed.\n");
+  return f;
+}
+
+void block_close(block_file *f) {
+  ZSTD_freeDCtx(f->dctx);
+  munmap(f->map,f->size);
+  free(f->index);
+  free(f->data);
+  free(f);
+}
+
+// the records of a block, decoded
+
+const u_char *block_data(block_file *f, u_int64_t b) {
+  if (b == f->cached)
+    return f->data;
+  block_entry *e = &f->index[b];
+  size_t n = e->records * f->record_size;
+  if (n > f->cap) {
+    f->cap = n;
+    if (!(f->data = realloc(f->data,n)))
+      die("realloc: %s\n",errstr);
+  }
+  size_t r = ZSTD_decompressDCtx(f->dctx,f->data,n,f->map + e->offset,e->bytes);
+  if (ZSTD_isError(r) || r != n)
+    die("%s: corrupt block %llu.\n",f->name,(unsigned long long) b);
+  f->cached = b;
+  return f->data;
+}
+
+// the block holding a record
+
+u_int64_t block_of(block_file *f, u_int64_t record) {
+  u_int64_t lo = 0, hi = f->n_blocks;
+  while (hi - lo > 1) {
+    u_int64_t mid = (lo + hi) / 2;
+    if (f->index[mid].first <= record) lo = mid; else hi = mid;
+  }
+  return lo;
+}
+
+// a record by number
+
+const u_char *block_record(block_file *f, u_int64_t record) {
+  u_int64_t b = f->cached;
+  if (b >= f->n_blocks || record < f->index[b].first ||
+      record - f->index[b].first >= f->index[b].records)
+    b = block_of(f,record);
+  return block_data(f,b) + (record - f->index[b].first)*f->record_size;
+}
+
+// the first block that may hold a flow's packets in a file sorted by
+// flow: the first whose greatest flow index isn't less; n_blocks if
+// there's none
+
+u_int64_t block_find_flow(block_file *f, u_int64_t flow) {
+  u_int64_t lo = 0, hi = f->n_blocks;
+  while (lo < hi) {
+    u_int64_t mid = (lo + hi) / 2;
+    if (f->index[mid].max_flow < flow) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+// the first block that may hold packets at or after a time in a file
+// sorted by time; n_blocks if there's none
+
+u_int64_t block_find_time(block_file *f, u_int64_t time) {
+  u_int64_t lo = 0, hi = f->n_blocks;
+  while (lo < hi) {
+    u_int64_t mid = (lo + hi) / 2;
+    if (f->index[mid].max_time < time) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+// sequential reading from any record on
+
+void block_seek(block_file *f, u_int64_t record) {
+  f->block = block_of(f,record);
+  f->pos = record;
+}
+
+const u_char *block_next(block_file *f) {
+  if (f->pos >= f->count)
+    return NULL;
+  while (f->pos >= f->index[f->block].first + f->index[f->block].records)
+    f->block++;
+  block_entry *e = &f->index[f->block];
+  const u_char *data = block_data(f,f->block);
+  return data + (f->pos++ - e->first)*f->record_size;
+}
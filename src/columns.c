@@ -0,0 +1,226 @@
+// Columnar packet files, and reading packet files of any kind.
+//
+// A columnar packet file has a file header of type FILE_COLUMNS and
+// then blocks of up to COLUMN_BLOCK_RECORDS packets. Each block is a
+// 16-byte block header -- the number of packets and the byte lengths
+// of the flow, time and size columns, as u32s in network byte-order --
+// followed by the three columns:
+//
+//   flow  varints of the zigzagged differences between flow indices,
+//         the first from zero
+//   time  the first time as a u64, then varints of the zigzagged
+//         differences between times
+//   size  varints of sizes, zigzagged as signed numbers in files with
+//         signed sizes (FILE_DUPLEX)
+//
+// Varints are little-endian base 128, as in protocol buffers. Blocks
+// decode independently, and readers skip the columns they don't need
+// without decoding them.
+
+#include <sys/stat.h>
+
+#include "common.h"
+
+#define MAX_VARINT 10
+
+static inline u_int64_t zigzag(int64_t x) {
+  return (u_int64_t) x << 1 ^ (u_int64_t) (x >> 63);
+}
+static inline int64_t unzigzag(u_int64_t x) {
+  return (int64_t) (x >> 1) ^ -(int64_t) (x & 1);
+}
+
+static inline u_char *put_varint(u_char *p, u_int64_t x) {
+  while (x >= 0x80) {
+    *p++ = x | 0x80;
+    x >>= 7;
+  }
+  *p++ = x;
+  return p;
+}
+
+static inline u_int64_t get_varint(const u_char **p, const u_char *end) {
+  u_int64_t x = 0;
+  int shift;
+  for (shift = 0; *p < end && shift < 64; shift += 7) {
+    u_char b = *(*p)++;
+    x |= (u_int64_t) (b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return x;
+  }
+  die("Corrupt column data.\n");
+  return 0;
+}
+
+// writing: packets are gathered into a block, which is encoded and
+// written out when full
+
+struct column_writer {
+  record_writer *out;
+  int            duplex;
+  u_int32_t      n;
+  packet_data   *packets; // COLUMN_BLOCK_RECORDS of them
+  u_char        *buf[3];  // encoded columns
+};
+
+column_writer *column_writer_open(record_writer *out, int duplex) {
+  column_writer *c = calloc(1,sizeof(column_writer));
+  if (!c)
+    die("calloc: %s\n",errstr);
+  c->out = out;
+  c->duplex = duplex;
+  c->packets = malloc(COLUMN_BLOCK_RECORDS*sizeof(packet_data));
+  int i;
+  for (i = 0; i < 3; i++)
+    c->buf[i] = malloc(COLUMN_BLOCK_RECORDS*MAX_VARINT + 8);
+  if (!c->packets || !c->buf[0] || !c->buf[1] || !c->buf[2])
+    die("malloc: %s\n",errstr);
+  return c;
+}
+
+static void column_flush(column_writer *c) {
+  if (!c->n)
+    return;
+  u_char *f = c->buf[0], *t = c->buf[1], *z = c->buf[2];
+  u_int64_t flow = 0, time = c->packets[0].time;
+  u_int64_t base = GUINT64_TO_BE(time);
+  memcpy(t,&base,8);
+  t += 8;
+  u_int32_t i;
+  for (i = 0; i < c->n; i++) {
+    packet_data *p = &c->packets[i];
+    f = put_varint(f,zigzag(p->flow - flow));
+    if (i)
+      t = put_varint(t,zigzag(p->time - time));
+    z = put_varint(z,c->duplex ? zigzag((int16_t) p->size) : p->size);
+    flow = p->flow;
+    time = p->time;
+  }
+  u_int32_t head[4] = {
+    htonl(c->n),
+    htonl(f - c->buf[0]),
+    htonl(t - c->buf[1]),
+    htonl(z - c->buf[2]),
+  };
+  writer_put(c->out,head,sizeof(head));
+  writer_put(c->out,c->buf[0],f - c->buf[0]);
+  writer_put(c->out,c->buf[1],t - c->buf[1]);
+  writer_put(c->out,c->buf[2],z - c->buf[2]);
+  c->n = 0;
+}
+
+void column_write(column_writer *c, const packet_data *packet) {
+  c->packets[c->n++] = *packet;
+  if (c->n == COLUMN_BLOCK_RECORDS)
+    column_flush(c);
+}
+
+// write out the last block; the record writer is left open
+
+void column_writer_close(column_writer *c) {
+  column_flush(c);
+  free(c->packets);
+  free(c->buf[0]);
+  free(c->buf[1]);
+  free(c->buf[2]);
+  free(c);
+}
+
+// reading
+
+void packet_reader_init(packet_reader *r, FILE *file, const file_header *h,
+                        int version, int columns) {
+  if (h->size && h->type != FILE_PACKETS && h->type != FILE_COLUMNS)
+    die("Not a packet file.\n");
+  memset(r,0,sizeof(*r));
+  r->file = file;
+  r->version = h->size ? h->version : version;
+  r->columnar = h->size && h->type == FILE_COLUMNS;
+  r->duplex = h->flags & FILE_DUPLEX ? 1 : 0;
+  r->columns = columns;
+  struct stat fs;
+  r->seekable = !fstat(fileno(file),&fs) && S_ISREG(fs.st_mode);
+}
+
+// read or skip a column of a block
+
+static void column_load(packet_reader *r, int k, u_int32_t len) {
+  if (!(r->columns & 1 << k)) {
+    if (r->seekable) {
+      if (fseeko(r->file,len,SEEK_CUR))
+        die("fseek: %s\n",errstr);
+      return;
+    }
+    // streams are read through
+  }
+  if (len > r->cap[k]) {
+    r->cap[k] = len;
+    if (!(r->buf[k] = realloc(r->buf[k],len)))
+      die("realloc: %s\n",errstr);
+  }
+  if (len && fread(r->buf[k],len,1,r->file) != 1)
+    die("Truncated column block.\n");
+  r->pos[k] = r->buf[k];
+  r->end[k] = r->buf[k] + len;
+}
+
+static int column_block(packet_reader *r) {
+  u_int32_t head[4];
+  size_t n = fread(head,1,sizeof(head),r->file);
+  if (n < sizeof(head)) {
+    if (ferror(r->file))
+      die("fread: %s\n",errstr);
+    if (n)
+      die("Truncated column block.\n");
+    return 0;
+  }
+  r->left = ntohl(head[0]);
+  int k;
+  for (k = 0; k < 3; k++)
+    column_load(r,k,ntohl(head[k+1]));
+  r->flow = 0;
+  r->first = 1;
+  return 1;
+}
+
+// read the next packet; columns that weren't asked for are zero
+
+int packet_read(packet_reader *r, packet_data *packet) {
+  if (!r->columnar)
+    return read_packet_data(r->file,r->version,packet);
+  while (!r->left)
+    if (!column_block(r))
+      return 0;
+  r->left--;
+  memset(packet,0,sizeof(*packet));
+  if (r->columns & COLUMN_FLOW) {
+    r->flow += unzigzag(get_varint(&r->pos[0],r->end[0]));
+    packet->flow = r->flow;
+  }
+  if (r->columns & COLUMN_TIME) {
+    if (r->first) {
+      u_int64_t base;
+      if (r->end[1] - r->pos[1] < 8)
+        die("Corrupt column data.\n");
+      memcpy(&base,r->pos[1],8);
+      r->pos[1] += 8;
+      r->time = GUINT64_FROM_BE(base);
+    } else {
+      r->time += unzigzag(get_varint(&r->pos[1],r->end[1]));
+    }
+    packet->time = r->time;
+  }
+  if (r->columns & COLUMN_SIZE) {
+    u_int64_t z = get_varint(&r->pos[2],r->end[2]);
+    packet->size = r->duplex ? (u_int16_t) unzigzag(z) : z;
+  }
+  r->first = 0;
+  return 1;
+}
+
+void packet_reader_free(packet_reader *r) {
+  int k;
+  for (k = 0; k < 3; k++)
+    free(r->buf[k]);
+  memset(r,0,sizeof(*r));
+}
@@ -1,3 +1,6 @@
+#include <sys/stat.h>
+#include <time.h>
+
 #include "common.h"
 
 // error handling
@@ -27,6 +30,14 @@ void hton_flow(flow_record *flow) {
   flow->src_port = htons(flow->src_port);
   flow->dst_port = htons(flow->dst_port);
 }
+void reverse_flow(flow_record *flow) {
+  u_int32_t ip = flow->src_ip;
+  u_int16_t port = flow->src_port;
+  flow->src_ip = flow->dst_ip;
+  flow->dst_ip = ip;
+  flow->src_port = flow->dst_port;
+  flow->dst_port = port;
+}
 
 void ntoh_packet(packet_record *packet) {
   packet->flow = ntohl(packet->flow);
@@ -41,28 +52,369 @@ void hton_packet(packet_record *packet) {
   packet->size = htons(packet->size);
 }
 
-void write_flow(FILE *file, flow_record *flow) {
-  if (fwrite(flow,sizeof(flow_record),1,file) != 1)
-    die("fwrite: %s\n",errstr);
+void ntoh_packet_v2(packet_record_v2 *packet) {
+  packet->flow = GUINT64_FROM_BE(packet->flow);
+  packet->time = GUINT64_FROM_BE(packet->time);
+  packet->size = ntohs(packet->size);
+}
+void hton_packet_v2(packet_record_v2 *packet) {
+  packet->flow = GUINT64_TO_BE(packet->flow);
+  packet->time = GUINT64_TO_BE(packet->time);
+  packet->size = htons(packet->size);
+}
+
+void write_flow(record_writer *w, flow_record *flow) {
+  writer_put(w,flow,sizeof(flow_record));
 }
 int read_flow(FILE *file, flow_record *flow) {
   if (fread(flow,sizeof(flow_record),1,file) != 1)
     if (ferror(file))
-      die("fwrite: %s\n",errstr);
+      die("fread: %s\n",errstr);
   return feof(file) ? 0 : 1;
 }
 
-void write_packet(FILE *file, packet_record *packet) {
-  if (fwrite(packet,sizeof(packet_record),1,file) != 1)
-    die("fwrite: %s\n",errstr);
+void write_packet(record_writer *w, packet_record *packet) {
+  writer_put(w,packet,sizeof(packet_record));
 }
 int read_packet(FILE *file, packet_record *packet) {
   if (fread(packet,sizeof(packet_record),1,file) != 1)
     if (ferror(file))
-      die("fwrite: %s\n",errstr);
+      die("fread: %s\n",errstr);
+  return feof(file) ? 0 : 1;
+}
+
+void write_packet_v2(record_writer *w, packet_record_v2 *packet) {
+  writer_put(w,packet,sizeof(packet_record_v2));
+}
+int read_packet_v2(FILE *file, packet_record_v2 *packet) {
+  if (fread(packet,sizeof(packet_record_v2),1,file) != 1)
+    if (ferror(file))
+      die("fread: %s\n",errstr);
   return feof(file) ? 0 : 1;
 }
 
+// packet records of either version: version 1 times are converted
+// to nanoseconds and back, dropping sub-microsecond digits; flows and
+// times that don't fit in version 1 records are fatal
+
+size_t packet_record_size(int version) {
+  return version == 2 ? sizeof(packet_record_v2) : sizeof(packet_record);
+}
+
+void packet_decode(int version, const void *record, packet_data *packet) {
+  if (version == 2) {
+    packet_record_v2 r;
+    memcpy(&r,record,sizeof(r));
+    ntoh_packet_v2(&r);
+    packet->flow = r.flow;
+    packet->time = r.time;
+    packet->size = r.size;
+  } else {
+    packet_record r;
+    memcpy(&r,record,sizeof(r));
+    ntoh_packet(&r);
+    packet->flow = r.flow;
+    packet->time = r.sec*NSEC_PER_SEC + r.usec*1000ULL;
+    packet->size = r.size;
+  }
+}
+
+void packet_encode(int version, const packet_data *packet, void *record) {
+  if (version == 2) {
+    packet_record_v2 r = { packet->flow, packet->time, packet->size };
+    hton_packet_v2(&r);
+    memcpy(record,&r,sizeof(r));
+  } else {
+    if (packet->flow > (u_int32_t) -1)
+      die("Flow index too large for a version 1 packet: %llu.\n",
+        (unsigned long long) packet->flow);
+    if (packet->time / NSEC_PER_SEC > (u_int32_t) -1)
+      die("Time too late for a version 1 packet: %llu ns.\n",
+        (unsigned long long) packet->time);
+    packet_record r = {
+      packet->flow,
+      packet->time / NSEC_PER_SEC,
+      packet->time % NSEC_PER_SEC / 1000,
+      packet->size
+    };
+    hton_packet(&r);
+    memcpy(record,&r,sizeof(r));
+  }
+}
+
+void write_packet_data(record_writer *w, int version, const packet_data *packet) {
+  char record[sizeof(packet_record_v2)];
+  packet_encode(version,packet,record);
+  writer_put(w,record,packet_record_size(version));
+}
+int read_packet_data(FILE *file, int version, packet_data *packet) {
+  char record[sizeof(packet_record_v2)];
+  if (fread(record,packet_record_size(version),1,file) != 1) {
+    if (ferror(file))
+      die("fread: %s\n",errstr);
+    return 0;
+  }
+  packet_decode(version,record,packet);
+  return 1;
+}
+
+// file headers: 64 bytes laid out as
+//
+//    0  magic[8]         24  u64 count
+//    8  u8 header version 32  u64 min_time
+//    9  u8 record type    40  u64 max_time
+//   10  u8 record version 48  u64 max_flow
+//   11  u8 byte order     56  reserved
+//   12  u8 sort major, minor
+//   14  u16 header size
+//   16  u32 flags
+//   20  reserved
+//
+// all in network byte-order; readers skip header bytes past the ones
+// they know, so later versions can extend it
+
+void file_header_init(file_header *h, int type, int version) {
+  memset(h,0,sizeof(*h));
+  h->type = type;
+  h->version = version;
+  h->size = FILE_HEADER_SIZE;
+}
+
+// account for a packet written after a header; a header that says
+// packets are sorted by time stops saying so on one out of order
+
+void file_header_add(file_header *h, const packet_data *packet) {
+  if (!(h->flags & FILE_TIMES)) {
+    h->min_time = h->max_time = packet->time;
+    h->max_flow = packet->flow;
+    h->flags |= FILE_TIMES | FILE_MAX_FLOW;
+  } else {
+    if (packet->time < h->max_time) {
+      if (h->sort_major == SORT_TIME)
+        h->sort_major = h->sort_minor = SORT_NONE;
+    } else {
+      h->max_time = packet->time;
+    }
+    if (packet->time < h->min_time)
+      h->min_time = packet->time;
+    if (packet->flow > h->max_flow)
+      h->max_flow = packet->flow;
+  }
+  h->count++;
+}
+
+static inline void put16(char *p, u_int16_t x) { x = htons(x); memcpy(p,&x,2); }
+static inline void put32(char *p, u_int32_t x) { x = htonl(x); memcpy(p,&x,4); }
+static inline void put64(char *p, u_int64_t x) { x = GUINT64_TO_BE(x); memcpy(p,&x,8); }
+
+static inline u_int16_t get16(const char *p) { u_int16_t x; memcpy(&x,p,2); return ntohs(x); }
+static inline u_int32_t get32(const char *p) { u_int32_t x; memcpy(&x,p,4); return ntohl(x); }
+static inline u_int64_t get64(const char *p) { u_int64_t x; memcpy(&x,p,8); return GUINT64_FROM_BE(x); }
+
+void file_header_encode(const file_header *h, char *buf) {
+  memset(buf,0,FILE_HEADER_SIZE);
+  memcpy(buf,FILE_MAGIC,8);
+  buf[8]  = FILE_HEADER_VERSION;
+  buf[9]  = h->type;
+  buf[10] = h->version;
+  buf[11] = FILE_BIG_ENDIAN;
+  buf[12] = h->sort_major;
+  buf[13] = h->sort_minor;
+  put16(buf+14,h->size);
+  put32(buf+16,h->flags);
+  put64(buf+24,h->count);
+  put64(buf+32,h->min_time);
+  put64(buf+40,h->max_time);
+  put64(buf+48,h->max_flow);
+}
+
+// parse the header at the start of n bytes of a file, returning its
+// size; files without a header get a version 1 one of size zero
+
+size_t file_header_parse(const void *data, size_t n, file_header *h) {
+  const char *buf = data;
+  file_header_init(h,0,1);
+  h->size = 0;
+  if (n < 8 || memcmp(buf,FILE_MAGIC,8))
+    return 0;
+  if (n < FILE_HEADER_SIZE)
+    die("Truncated file header.\n");
+  if (buf[11] != FILE_BIG_ENDIAN)
+    die("Unsupported record byte-order in file header: `%c'.\n",buf[11]);
+  h->type       = buf[9];
+  h->version    = buf[10];
+  h->sort_major = buf[12];
+  h->sort_minor = buf[13];
+  h->size       = get16(buf+14);
+  h->flags      = get32(buf+16);
+  h->count      = get64(buf+24);
+  h->min_time   = get64(buf+32);
+  h->max_time   = get64(buf+40);
+  h->max_flow   = get64(buf+48);
+  if (h->size < FILE_HEADER_SIZE)
+    die("Bad file header size: %u.\n",h->size);
+  if (h->type < FILE_FLOWS || h->type > FILE_FLOW_KEYS)
+    die("Unknown record type in file header: %u.\n",h->type);
+  if (h->version != 1 && (h->type != FILE_PACKETS || h->version != 2))
+    die("Unknown record version in file header: %u.\n",h->version);
+  return h->size;
+}
+
+// read the header of a stream if it has one; the stream is left at
+// its first record either way
+
+int read_file_header(FILE *file, file_header *h) {
+  char buf[FILE_HEADER_SIZE];
+  int c = getc(file), i;
+  file_header_init(h,0,1);
+  h->size = 0;
+  if (c == EOF)
+    return 0;
+  buf[0] = c;
+  for (i = 1; i < 8 && buf[i-1] == FILE_MAGIC[i-1]; i++) {
+    if ((c = getc(file)) == EOF)
+      break;
+    buf[i] = c;
+  }
+  if (i < 8 || memcmp(buf,FILE_MAGIC,8)) {
+    // not a header after all: put back what was read
+    while (i--)
+      if (ungetc((u_char) buf[i],file) == EOF)
+        die("Can't tell whether the input has a file header.\n");
+    return 0;
+  }
+  if (fread(buf+8,FILE_HEADER_SIZE-8,1,file) != 1)
+    die("Truncated file header.\n");
+  file_header_parse(buf,FILE_HEADER_SIZE,h);
+  for (i = FILE_HEADER_SIZE; i < h->size; i++)
+    if (getc(file) == EOF)
+      die("Truncated file header.\n");
+  return 1;
+}
+
+void write_file_header(record_writer *w, const file_header *h) {
+  char buf[FILE_HEADER_SIZE];
+  file_header_encode(h,buf);
+  writer_put(w,buf,sizeof(buf));
+}
+
+// replace the header of a finished file, once its counts are known
+
+void rewrite_file_header(const char *path, const file_header *h) {
+  char buf[FILE_HEADER_SIZE];
+  file_header_encode(h,buf);
+  int fd = open(path,O_WRONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",path,errstr);
+  if (pwrite(fd,buf,sizeof(buf),0) != sizeof(buf))
+    die("pwrite(\"%s\"): %s\n",path,errstr);
+  if (close(fd))
+    die("close(\"%s\"): %s\n",path,errstr);
+}
+
+// block-buffered record writer: records are gathered in a large
+// aligned buffer which is handed to write(2) when full, instead of
+// going through stdio one record at a time. With O_DIRECT, writes
+// bypass the page cache; the final partial block is written without
+// it when the writer is closed.
+
+record_writer *writer_fd(int fd) {
+  record_writer *w = calloc(1,sizeof(record_writer));
+  if (!w)
+    die("calloc: %s\n",errstr);
+  if (posix_memalign((void **) &w->buf,WRITER_ALIGN,WRITER_BUFFER_SIZE))
+    die("posix_memalign: %s\n",errstr);
+  w->fd = fd;
+  return w;
+}
+
+static record_writer *writer_open_flags(const char *path, int flags, int direct) {
+  int fd = -1;
+#ifdef O_DIRECT
+  if (direct) {
+    fd = open(path,flags | O_DIRECT,0666);
+    if (fd < 0 && errno == EINVAL)
+      warn("Warning: %s: O_DIRECT not supported; writing normally.\n",path);
+  }
+#else
+  if (direct)
+    warn("Warning: O_DIRECT not supported; writing normally.\n");
+#endif
+  if (fd < 0) {
+    direct = 0;
+    fd = open(path,flags,0666);
+  }
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",path,errstr);
+  fcntl(fd,F_SETFD,FD_CLOEXEC);
+  record_writer *w = writer_fd(fd);
+  w->direct = direct;
+  return w;
+}
+
+record_writer *writer_open(const char *path, int direct) {
+  return writer_open_flags(path,O_WRONLY|O_CREAT|O_TRUNC,direct);
+}
+
+// reopen an output file to append records after its first size bytes,
+// dropping any beyond them; under O_DIRECT, the partial block at the
+// end is read back into the buffer so that writes stay aligned
+
+record_writer *writer_append(const char *path, int direct, u_int64_t size) {
+  record_writer *w = writer_open_flags(path,O_RDWR,direct);
+  struct stat fs;
+  if (fstat(w->fd,&fs))
+    die("fstat(\"%s\"): %s\n",path,errstr);
+  if (fs.st_size < size)
+    die("%s: file is shorter than expected (%llu < %llu bytes).\n",
+      path,(unsigned long long) fs.st_size,(unsigned long long) size);
+  if (ftruncate(w->fd,size))
+    die("ftruncate(\"%s\"): %s\n",path,errstr);
+  off_t start = w->direct ? size & ~(u_int64_t) (WRITER_ALIGN-1) : size;
+  if (start < size) {
+    if (pread(w->fd,w->buf,WRITER_ALIGN,start) != size - start)
+      die("pread(\"%s\"): %s\n",path,errstr);
+    w->used = size - start;
+  }
+  if (lseek(w->fd,start,SEEK_SET) < 0)
+    die("lseek(\"%s\"): %s\n",path,errstr);
+  return w;
+}
+
+static void write_all(int fd, const char *buf, size_t n) {
+  while (n) {
+    ssize_t r = write(fd,buf,n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) die("write: %s\n",errstr);
+    buf += r;
+    n -= r;
+  }
+}
+
+// write out buffered records; under O_DIRECT, a trailing partial
+// block stays buffered until the writer is closed
+
+void writer_flush(record_writer *w) {
+  size_t n = w->direct ? w->used & ~(size_t) (WRITER_ALIGN-1) : w->used;
+  write_all(w->fd,w->buf,n);
+  memmove(w->buf,w->buf + n,w->used - n);
+  w->used -= n;
+}
+
+void writer_close(record_writer *w) {
+  writer_flush(w);
+#ifdef O_DIRECT
+  if (w->used) {
+    fcntl(w->fd,F_SETFL,fcntl(w->fd,F_GETFL) & ~O_DIRECT);
+    write_all(w->fd,w->buf,w->used);
+  }
+#endif
+  if (close(w->fd))
+    die("close: %s\n",errstr);
+  free(w->buf);
+  free(w);
+}
+
 // unescape a C-style quoted string
 
 void c_unescape(char* s) {
@@ -123,39 +475,6 @@ static char *suffix(const char *file, const char sep) {
   return suf ? suf : "";
 }
 
-// fork a process and read its output via returned file descriptor
-
-FILE *cmd_read(const char *arg, ...) {
-  int fd[2],pid;
-  if (pipe(fd)) die("pipe: %s\n",errstr);
-  if (pid = fork()) {
-    FILE *rf;
-    if (close(fd[1])) die("close(%u): %s\n",fd[1],errstr);
-    if (!(rf = fdopen(fd[0],"r"))) die("fdopen: %s\n",errstr);
-    return rf;
-  }
-  if (pid < 0) die("fork(): %s\n",errstr);
-  if (close(0)) die("close(0): %s\n",errstr);
-  if (close(fd[0])) die("close(%u): %s\n",fd[0],errstr);
-  if (dup2(fd[1],1) < 0) die("dup2(%u,1): %s\n",fd[1],errstr);
-
-  va_list var;
-  va_start(var,arg);
-  char *args[256];
-  args[0] = (char *) arg;
-  int i;
-  for (i = 1; i <= sizeof(args); i++) {
-    args[i] = va_arg(var, char *);
-    if (!args[i]) break;
-  }
-  if (args[i])
-    die("Too many command-line arguments: %s\n",arg);
-  execvp(arg,args);
-  va_end(var);
-
-  die("exec(%s,...): %s\n",arg,errstr);
-}
-
 void file_cloexec(FILE *file) {
   int x,fd = fileno(file);
   x = fcntl(fd,F_GETFD,0);
@@ -164,19 +483,31 @@ void file_cloexec(FILE *file) {
   if (x < 0) die("fcntl(%u,F_GETFD,%u): %s",fd,x|FD_CLOEXEC,errstr);
 }
 
+// open a file argument for reading: stdin for "-", decompressing in
+// process for compressed files (see decompress.c)
+
+static const char *compressed_suffixes[] = {
+  ".gz", ".bgz", ".bz2", ".xz", ".zst", NULL
+};
+
+int compressed_arg(const char *arg) {
+  const char **suf;
+  for (suf = compressed_suffixes; *suf; suf++)
+    if (!strcmp(suffix(arg,'.'),*suf))
+      return 1;
+  return 0;
+}
+
 FILE *open_arg(const char *arg) {
   FILE *file;
-  if (!arg || !strcmp(arg,"-")) {
+  if (!arg || !strcmp(arg,"-"))
     return stdin;
-  } else if (!strcmp(suffix(arg,'.'),".gz")) {
-      file = cmd_read("gzcat","-f",arg,NULL);
-  } else if (!strcmp(suffix(arg,'.'),".bz2")) {
-      file = cmd_read("bzcat","-f",arg,NULL);
-  } else {
-      if (!(file = fopen(arg,"r")))
-          die("fopen(\"%s\",\"r\"): %s\n",arg,errstr);
-      file_cloexec(file);
-  }
+  if (compressed_arg(arg))
+    return decompress_open(arg);
+  if (!(file = fopen(arg,"r")))
+      die("fopen(\"%s\",\"r\"): %s\n",arg,errstr);
+  file_cloexec(file);
+  setvbuf(file,NULL,_IOFBF,IO_BUFFER_SIZE);
   return file;
 }
 
@@ -198,3 +529,11 @@ char *get_line(FILE *fh, char **pbuffer, size_t *plen) {
 #endif
   die("ERROR: get_line badness.\n");
 }
+
+// seconds on a clock that only goes forward, for timing
+
+double monotonic_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
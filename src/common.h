@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <math.h>
 #include <pcap.h>
 #include <glib.h>
@@ -17,11 +18,13 @@
 #include "tcp.h"
 
 #define ETHERTYPE_IP    0x0008
+#define ETHERTYPE_IPV6  0xdd86
 #define ETHERTYPE_8021Q 0x0081
 
-#define IP_PROTO_ICMP  1
-#define IP_PROTO_TCP   6
-#define IP_PROTO_UDP  17
+#define IP_PROTO_ICMP    1
+#define IP_PROTO_TCP     6
+#define IP_PROTO_UDP    17
+#define IP_PROTO_ICMPV6 58
 
 #define TCP_MAX_SKIP ((1<<16)-1)
 
@@ -61,24 +64,340 @@ struct packet_record {
   u_int16_t size;
 } __attribute__((packed));
 
+// version 2 packet records have 64-bit flow indices and times in
+// nanoseconds since the epoch, which last until the year 2554
+
+struct packet_record_v2 {
+  u_int64_t flow;
+  u_int64_t time;
+  u_int16_t size;
+} __attribute__((packed));
+
+#define NSEC_PER_SEC 1000000000ULL
+
+// addresses that don't fit in flow records (IPv6, and IPv4 addresses
+// in 240.0.0.0/4) are stored in an address file, a packed array of
+// 16-byte addresses; flow records refer to them by index with
+// 240.0.0.0/4 addresses whose low 28 bits are the index
+
+#define ADDR_REF_MASK      0xf0000000
+#define MAX_ADDR_REFS      (1 << 28)
+#define IS_ADDR_REF(ip)    ((ntohl(ip) & ADDR_REF_MASK) == ADDR_REF_MASK)
+#define ADDR_REF(index)    htonl(ADDR_REF_MASK | (index))
+#define ADDR_REF_INDEX(ip) (ntohl(ip) & ~ADDR_REF_MASK)
+
 typedef struct flow_record flow_record;
 typedef struct packet_record packet_record;
+typedef struct packet_record_v2 packet_record_v2;
+
+// a packet in host byte-order, whichever version its record is
+
+typedef struct {
+  u_int64_t flow;
+  u_int64_t time; // nanoseconds since the epoch
+  u_int16_t size;
+} packet_data;
 
 void ntoh_flow(flow_record *flow);
 void hton_flow(flow_record *flow);
+void reverse_flow(flow_record *flow);
 void ntoh_packet(packet_record *packet);
 void hton_packet(packet_record *packet);
+void ntoh_packet_v2(packet_record_v2 *packet);
+void hton_packet_v2(packet_record_v2 *packet);
+
+// block-buffered output of binary records
+
+#define WRITER_BUFFER_SIZE (4 << 20)
+#define WRITER_ALIGN       4096
 
-void write_flow(FILE *file, flow_record *flow);
+typedef struct {
+  int    fd;
+  int    direct; // O_DIRECT: only whole aligned blocks are written
+  char  *buf;
+  size_t used;
+} record_writer;
+
+record_writer *writer_open(const char *path, int direct);
+record_writer *writer_append(const char *path, int direct, u_int64_t size);
+record_writer *writer_fd(int fd);
+void writer_flush(record_writer *w);
+void writer_close(record_writer *w);
+
+static inline void writer_put(record_writer *w, const void *data, size_t n) {
+  if (WRITER_BUFFER_SIZE - w->used < n)
+    writer_flush(w);
+  memcpy(w->buf + w->used,data,n);
+  w->used += n;
+}
+
+void write_flow(record_writer *w, flow_record *flow);
 int   read_flow(FILE *file, flow_record *flow);
 
-void write_packet(FILE *file, packet_record *packet);
+void write_packet(record_writer *w, packet_record *packet);
 int   read_packet(FILE *file, packet_record *packet);
 
+void write_packet_v2(record_writer *w, packet_record_v2 *packet);
+int   read_packet_v2(FILE *file, packet_record_v2 *packet);
+
+// packet records of either version (1 or 2) as packet data
+
+size_t packet_record_size(int version);
+void packet_decode(int version, const void *record, packet_data *packet);
+void packet_encode(int version, const packet_data *packet, void *record);
+void write_packet_data(record_writer *w, int version, const packet_data *packet);
+int   read_packet_data(FILE *file, int version, packet_data *packet);
+
+// optional file headers: flow and packet files may start with a
+// header describing their records, in network byte-order, for tools
+// to check or skip work with; files without one are version 1 records
+
+#define FILE_MAGIC          "\x89TTREC\r\n"
+#define FILE_HEADER_SIZE    64
+#define FILE_HEADER_VERSION 1
+
+#define FILE_FLOWS   1 // record types
+#define FILE_PACKETS 2
+#define FILE_COLUMNS 3 // packets in columns (see columns.c)
+#define FILE_FLOW_OFFSETS 4 // sidecar indexes (see offsets.c)
+#define FILE_TIME_OFFSETS 5
+#define FILE_FLOW_KEYS    6 // flow file index (see flowindex)
+
+#define FILE_BIG_ENDIAN 'B'
+
+#define SORT_NONE 0 // sort keys, major then minor
+#define SORT_FLOW 1
+#define SORT_TIME 2
+#define SORT_SIZE 3
+
+#define FILE_COUNT    0x01 // header flags: count is known
+#define FILE_TIMES    0x02 // min_time and max_time are known
+#define FILE_MAX_FLOW 0x04 // max_flow is known
+#define FILE_DUPLEX   0x08 // packet sizes are signed (see parse -D)
+
+typedef struct {
+  u_int8_t  type;
+  u_int8_t  version;    // of the records
+  u_int8_t  sort_major; // SORT_NONE if unknown
+  u_int8_t  sort_minor;
+  u_int32_t flags;
+  u_int64_t count;      // of records
+  u_int64_t min_time;   // nanoseconds since the epoch
+  u_int64_t max_time;
+  u_int64_t max_flow;   // largest flow index
+  u_int32_t size;       // bytes in the file before the first record
+} file_header;
+
+void file_header_init(file_header *h, int type, int version);
+void file_header_add(file_header *h, const packet_data *packet);
+void file_header_encode(const file_header *h, char *buf);
+size_t file_header_parse(const void *data, size_t n, file_header *h);
+int read_file_header(FILE *file, file_header *h);
+void write_file_header(record_writer *w, const file_header *h);
+void rewrite_file_header(const char *path, const file_header *h);
+
 // other utility functions
 
 void c_unescape(char* s);
 void file_cloexec(FILE *file);
-FILE *cmd_read(const char *arg, ...);
+int compressed_arg(const char *arg);
 FILE *open_arg(const char *arg);
 char *get_line(FILE *, char **, size_t *);
+double monotonic_time(void);
+
+// columnar packet files (columns.c), and reading packets from files
+// of any kind: row records of either version, or columns
+
+#define COLUMN_BLOCK_RECORDS 65536
+
+#define COLUMN_FLOW 1 // columns to read
+#define COLUMN_TIME 2
+#define COLUMN_SIZE 4
+#define COLUMN_ALL  7
+
+typedef struct column_writer column_writer;
+
+column_writer *column_writer_open(record_writer *out, int duplex);
+void column_write(column_writer *c, const packet_data *packet);
+void column_writer_close(column_writer *c);
+
+typedef struct {
+  FILE      *file;
+  int        version;  // of row records
+  int        columnar;
+  int        duplex;
+  int        columns;  // wanted
+  int        seekable;
+  u_int32_t  left;     // packets left in the block
+  int        first;
+  u_int64_t  flow, time;
+  u_char    *buf[3];
+  const u_char *pos[3], *end[3];
+  u_int32_t  cap[3];
+} packet_reader;
+
+void packet_reader_init(packet_reader *r, FILE *file, const file_header *h,
+                        int version, int columns);
+int packet_read(packet_reader *r, packet_data *packet);
+void packet_reader_free(packet_reader *r);
+
+// block-compressed flow and packet files (blocks.c): zstd files that
+// decode to a file with a header, indexed for random access
+
+#define BLOCK_RECORDS 65536 // default records per block
+
+typedef struct {
+  u_int64_t offset;   // of the block's frame
+  u_int64_t first;    // record number of its first record
+  u_int32_t records;
+  u_int32_t bytes;    // compressed
+  u_int64_t min_flow, max_flow;
+  u_int64_t min_time, max_time; // packet files only
+} block_entry;
+
+typedef struct block_writer block_writer;
+
+block_writer *block_writer_open(record_writer *out, const file_header *h,
+                                u_int32_t records, int level);
+void block_put(block_writer *b, const void *record);
+void block_writer_close(block_writer *b);
+
+typedef struct {
+  const char  *name;
+  u_char      *map;
+  size_t       size;
+  file_header  h;
+  size_t       record_size;
+  u_int64_t    count;     // of records
+  u_int64_t    n_blocks;
+  block_entry *index;
+  u_int64_t    cached;    // block decoded into data
+  u_char      *data;
+  size_t       cap;
+  u_int64_t    block;     // reading position
+  u_int64_t    pos;
+  void        *dctx;
+} block_file;
+
+block_file *block_open(const char *name); // NULL if not block-compressed
+void block_close(block_file *f);
+const u_char *block_data(block_file *f, u_int64_t b);
+u_int64_t block_of(block_file *f, u_int64_t record);
+const u_char *block_record(block_file *f, u_int64_t record);
+u_int64_t block_find_flow(block_file *f, u_int64_t flow);
+u_int64_t block_find_time(block_file *f, u_int64_t time);
+void block_seek(block_file *f, u_int64_t record);
+const u_char *block_next(block_file *f);
+
+// random access to the records of flow and packet files, plain or
+// block-compressed, and sidecar indexes of their offsets (offsets.c)
+
+typedef struct {
+  file_header  h;      // h.size is zero if the file has none
+  block_file  *blocks; // or, for plain files:
+  char        *map;
+  size_t       size;
+  const char  *records;
+  u_int64_t    bytes;  // of records
+} record_file;
+
+record_file *record_file_open(const char *name); // NULL if it can't be
+u_int64_t record_count(record_file *f, size_t record_size);
+void record_file_close(record_file *f);
+
+static inline const void *record_get(record_file *f, u_int64_t i, size_t size) {
+  return f->blocks ? (const void *) block_record(f->blocks,i) : f->records + i*size;
+}
+
+typedef struct {
+  char            *map;
+  size_t           size;
+  u_int64_t        flows;
+  const u_int64_t *first; // flows + 1 record numbers, network byte-order
+} flow_offsets;
+
+void write_flow_offsets(const char *path, const char *packets,
+                        u_int64_t n, int version);
+void write_flow_offset_table(const char *path, const u_int64_t *first,
+                             u_int64_t flows);
+flow_offsets *flow_offsets_open(const char *path, u_int64_t records);
+void flow_offsets_close(flow_offsets *o);
+
+// the packet records of a flow: none if it's past the last one
+
+static inline void flow_offsets_get(const flow_offsets *o, u_int64_t flow,
+                                    u_int64_t *first, u_int64_t *count) {
+  if (flow >= o->flows) {
+    *first = *count = 0;
+    return;
+  }
+  *first = GUINT64_FROM_BE(o->first[flow]);
+  *count = GUINT64_FROM_BE(o->first[flow+1]) - *first;
+}
+
+// time offset indexes sample every TIME_OFFSETS_STRIDE-th record of a
+// packet file sorted by time
+
+#define TIME_OFFSETS_STRIDE 4096
+
+typedef struct {
+  char            *map;
+  size_t           size;
+  u_int64_t        entries;
+  const u_int64_t *entry; // time and record number pairs, network byte-order
+} time_offsets;
+
+void write_time_offsets(const char *path, const char *packets,
+                        u_int64_t n, int version);
+time_offsets *time_offsets_open(const char *path, u_int64_t records);
+void time_offsets_find(const time_offsets *o, u_int64_t time,
+                       u_int64_t *lo, u_int64_t *hi);
+void time_offsets_close(time_offsets *o);
+
+// flow key indexes (see flowindex and flowquery): after a header of
+// type FILE_FLOW_KEYS, whose count is the number of flows, a posting
+// list section for each key below -- the number m of its distinct
+// values, the values as u32s padded to eight bytes, m+1 offsets into
+// the flow list, and the flow list: the indices of the flows with each
+// value in turn, in order -- then a hash table of 5-tuples: its number
+// of slots, a power of two, and the slots, each a flow record, three
+// zero bytes and the flow index plus one, or zero if it's empty; all in
+// network byte-order
+
+#define FLOW_KEY_PROTO    0
+#define FLOW_KEY_SRC_IP   1
+#define FLOW_KEY_DST_IP   2
+#define FLOW_KEY_SRC_PORT 3
+#define FLOW_KEY_DST_PORT 4
+#define FLOW_KEYS         5
+
+#define FLOW_KEY_SLOT 24 // bytes
+
+static inline u_int32_t flow_key(const flow_record *flow, int key) {
+  switch (key) {
+    case FLOW_KEY_PROTO:    return flow->proto;
+    case FLOW_KEY_SRC_IP:   return ntohl(flow->src_ip);
+    case FLOW_KEY_DST_IP:   return ntohl(flow->dst_ip);
+    case FLOW_KEY_SRC_PORT: return ntohs(flow->src_port);
+    default:                return ntohs(flow->dst_port);
+  }
+}
+
+// FNV-1a of a flow record, as stored
+
+static inline u_int64_t flow_key_hash(const flow_record *flow) {
+  const u_char *p = (const u_char *) flow;
+  u_int64_t h = 0xcbf29ce484222325ULL;
+  int i;
+  for (i = 0; i < sizeof(flow_record); i++)
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// in-process decompression (decompress.c)
+
+#define IO_BUFFER_SIZE (1 << 20)
+
+extern int decompress_threads; // zero means one per processor
+FILE *decompress_open(const char *name);
+void decompress_totals(u_int64_t *bytes, double *seconds);
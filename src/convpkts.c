@@ -0,0 +1,134 @@
+const char *usage =
+  "Usage:\n"
+  "  convpkts [options] <packet files>\n"
+  "\n"
+  "  Converts packet files between version 1 records (32-bit flow\n"
+  "  indices, seconds and microseconds), version 2 records (64-bit\n"
+  "  flow indices, nanoseconds since the epoch) and columns, writing\n"
+  "  the converted packets to stdout.\n"
+  "\n"
+  "Options:\n"
+  "  -2, --v2       Convert version 1 records to version 2 (default)\n"
+  "  -1, --v1       Convert version 2 records to version 1\n"
+  "  -c, --columns  Convert records to columns (see below)\n"
+  "  -D             Packet sizes are signed (see parse -D)\n"
+  "\n"
+  "Notes:\n"
+  "  - Converting to version 1 drops sub-microsecond digits of times,\n"
+  "    and fails for flow indices or times too large to fit.\n"
+  "  - Converting to version 2 and back gives the original file.\n"
+  "  - Files with headers (see parse -H) give their own version, and\n"
+  "    the output has a header too: all of it for a single file, and\n"
+  "    just the kind of records for several. Files without headers are\n"
+  "    taken to have version 1 records with -c.\n"
+  "  - Columnar files store flow indices, times and sizes separately in\n"
+  "    blocks of 65536 packets, as varints of differences between flows\n"
+  "    and times and of sizes, so tools that only need some of them read\n"
+  "    less. They always have a header. Converting them to version 2\n"
+  "    records gives back the records they were made from.\n"
+;
+
+#include <ctype.h>
+
+#include "common.h"
+
+int from = 1;
+int to = 2;
+int columns = 0;
+int duplex = 0;
+
+void parse_opts(int argc, char **argv) {
+
+  static struct option longopts[] = {
+    { "v1",      no_argument, 0, '1' },
+    { "v2",      no_argument, 0, '2' },
+    { "columns", no_argument, 0, 'c' },
+    { "help",    no_argument, 0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc,argv,"12cDh",longopts,0)) != -1) {
+    switch (c) {
+
+      case '1':
+        from = 2;
+        to = 1;
+        break;
+      case '2':
+        from = 1;
+        to = 2;
+        break;
+      case 'c':
+        from = 1;
+        columns = 1;
+        break;
+      case 'D':
+        duplex = 1;
+        break;
+
+      case 'h':
+        printf("%s",usage);
+        exit(0);
+
+      case '?':
+        if (isprint(optopt))
+          die("Unknown option `-%c'.\n",optopt);
+        else
+          die("Strange option `\\x%x'.\n",optopt);
+
+      default:
+        die("ERROR: getopt badness.\n");
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  int i;
+  parse_opts(argc,argv);
+  record_writer *out = writer_fd(fileno(stdout));
+  column_writer *cols = NULL;
+  if (optind == argc) argc++;
+  for (i = optind; i < argc; i++) {
+    FILE *file = open_arg(argv[i]);
+    file_header h;
+    if (read_file_header(file,&h)) {
+      if (h.type == FILE_FLOWS)
+        die("%s: not a packet file.\n",argv[i]);
+      if (h.flags & FILE_DUPLEX)
+        duplex = 1;
+    }
+    if (i == optind && (h.size || columns)) {
+      // a single file keeps its whole header
+      file_header oh = h;
+      if (!h.size || argc - optind > 1)
+        file_header_init(&oh,0,0);
+      oh.type = columns ? FILE_COLUMNS : FILE_PACKETS;
+      oh.version = columns ? 1 : to;
+      oh.size = FILE_HEADER_SIZE;
+      if (duplex)
+        oh.flags |= FILE_DUPLEX;
+      if (!columns && to == 1) {
+        oh.min_time -= oh.min_time % 1000;
+        oh.max_time -= oh.max_time % 1000;
+      }
+      write_file_header(out,&oh);
+      if (columns)
+        cols = column_writer_open(out,duplex);
+    }
+    packet_reader r;
+    packet_reader_init(&r,file,&h,from,COLUMN_ALL);
+    packet_data packet;
+    while (packet_read(&r,&packet))
+      if (cols)
+        column_write(cols,&packet);
+      else
+        write_packet_data(out,to,&packet);
+    packet_reader_free(&r);
+    fclose(file);
+  }
+  if (cols)
+    column_writer_close(cols);
+  writer_close(out);
+  return 0;
+}
@@ -0,0 +1,543 @@
+// In-process decompression for open_arg.
+//
+// Compressed inputs are decoded inside the reading process, behind an
+// ordinary stdio stream with a large buffer, instead of being piped in
+// from a forked gzcat or bzcat. gzip, bzip2, xz and zstd data are
+// recognized by their magic numbers. Files made of independently
+// compressed pieces -- BGZF files and zstd files of several frames --
+// are mapped into memory and decoded by a pool of threads, which hand
+// the decoded pieces back to the reader in order.
+
+#define _GNU_SOURCE // fopencookie
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
+#include <zstd.h>
+
+#include "common.h"
+
+#define PIECE_BYTES (1 << 18)    // compressed bytes per parallel piece
+#define PIECES_PER_THREAD 2      // decoded pieces buffered per thread
+
+int decompress_threads = 0;
+
+// totals over all streams of bytes decoded and of time readers spent
+// waiting for them, updated once per buffer refill
+
+static GMutex totals_lock;
+static u_int64_t total_bytes = 0;
+static double total_seconds = 0;
+
+void decompress_totals(u_int64_t *bytes, double *seconds) {
+  g_mutex_lock(&totals_lock);
+  *bytes = total_bytes;
+  *seconds = total_seconds;
+  g_mutex_unlock(&totals_lock);
+}
+
+enum { CODEC_NONE, CODEC_GZIP, CODEC_BZIP2, CODEC_XZ, CODEC_ZSTD, CODEC_BGZF };
+
+static const char *codec_names[] = { "raw", "gzip", "bzip2", "xz", "zstd", "BGZF" };
+
+typedef struct {
+  u_char *data;
+  size_t len;
+  int ready;
+} piece;
+
+typedef struct {
+  const char *name;
+  int codec;
+  int done;
+
+  // streaming decoders
+  int fd;
+  u_char *in;
+  size_t in_pos, in_len;
+  int in_eof;
+  z_stream z;
+  bz_stream bz;
+  lzma_stream xz;
+  ZSTD_DStream *zstd;
+
+  // parallel decoding of a mapped file
+  const u_char *map;
+  size_t size;
+  size_t cursor;      // start of the next piece to be claimed
+  u_int64_t next;     // number of the next piece to be claimed
+  u_int64_t head;     // number of the piece being read
+  size_t head_pos;    // read position within it
+  piece *window;
+  int n_window;
+  GThread **threads;
+  int n_threads;
+  int stop;
+  GMutex lock;
+  GCond cond;
+} decoder;
+
+static inline u_int32_t le32(const u_char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (u_int32_t) p[3] << 24;
+}
+
+// BGZF blocks are gzip members with their size in an extra field
+
+static int bgzf_header(const u_char *p) {
+  return p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && (p[3] & 4) &&
+         p[12] == 'B' && p[13] == 'C' && p[14] == 2 && p[15] == 0;
+}
+
+// size of the BGZF block at p, or zero if there isn't a whole one
+
+static size_t bgzf_block(const u_char *p, size_t avail) {
+  if (avail < 18 || !bgzf_header(p))
+    return 0;
+  size_t xlen = p[10] | p[11] << 8;
+  size_t size = (p[16] | p[17] << 8) + 1;
+  return 20 + xlen <= size && size <= avail ? size : 0;
+}
+
+static int sniff(const u_char *p, size_t n) {
+  if (n >= 18 && bgzf_header(p)) return CODEC_BGZF;
+  if (n >= 2 && p[0] == 0x1f && p[1] == 0x8b) return CODEC_GZIP;
+  if (n >= 3 && !memcmp(p,"BZh",3)) return CODEC_BZIP2;
+  if (n >= 6 && !memcmp(p,"\xfd" "7zXZ\0",6)) return CODEC_XZ;
+  if (n >= 4 && (le32(p) == 0xfd2fb528 || (le32(p) & ~0xf) == 0x184d2a50))
+    return CODEC_ZSTD;
+  return CODEC_NONE;
+}
+
+static void corrupt(decoder *d, const char *msg) {
+  die("%s: %s: %s\n",d->name,codec_names[d->codec],msg);
+}
+
+// streaming decoding
+
+static size_t fill(decoder *d) {
+  if (d->in_pos < d->in_len) return d->in_len - d->in_pos;
+  if (d->in_eof) return 0;
+  ssize_t r;
+  do r = read(d->fd,d->in,IO_BUFFER_SIZE); while (r < 0 && errno == EINTR);
+  if (r < 0) die("read(\"%s\"): %s\n",d->name,errstr);
+  d->in_pos = 0;
+  d->in_len = r;
+  d->in_eof = !r;
+  return r;
+}
+
+// start a new stream after the end of one: concatenated compressed
+// files decompress to the concatenation of their contents
+
+static int another(decoder *d, u_char magic) {
+  if (!fill(d)) return 0;
+  if (d->in[d->in_pos] == magic) return 1;
+  warn("%s: trailing garbage ignored.\n",d->name);
+  return 0;
+}
+
+static size_t stream_step(decoder *d, char *buf, size_t n) {
+  size_t avail = d->in_len - d->in_pos;
+  size_t left = n;
+  switch (d->codec) {
+    case CODEC_NONE: {
+      left = n - (avail < n ? avail : n);
+      memcpy(buf,d->in + d->in_pos,n - left);
+      d->in_pos += n - left;
+      if (!avail && d->in_eof) d->done = 1;
+      break;
+    }
+    case CODEC_GZIP:
+    case CODEC_BGZF: {
+      d->z.next_in   = d->in + d->in_pos;
+      d->z.avail_in  = avail;
+      d->z.next_out  = (Bytef *) buf;
+      d->z.avail_out = n;
+      int ret = inflate(&d->z,Z_NO_FLUSH);
+      d->in_pos = d->in_len - d->z.avail_in;
+      left = d->z.avail_out;
+      if (ret == Z_STREAM_END) {
+        if (another(d,0x1f))
+          inflateReset(&d->z);
+        else
+          d->done = 1;
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        corrupt(d,d->z.msg ? d->z.msg : "corrupt data");
+      }
+      break;
+    }
+    case CODEC_BZIP2: {
+      d->bz.next_in   = (char *) d->in + d->in_pos;
+      d->bz.avail_in  = avail;
+      d->bz.next_out  = buf;
+      d->bz.avail_out = n;
+      int ret = BZ2_bzDecompress(&d->bz);
+      d->in_pos = d->in_len - d->bz.avail_in;
+      left = d->bz.avail_out;
+      if (ret == BZ_STREAM_END) {
+        BZ2_bzDecompressEnd(&d->bz);
+        if (another(d,'B')) {
+          if (BZ2_bzDecompressInit(&d->bz,0,0) != BZ_OK)
+            corrupt(d,"can't initialize decoder");
+        } else {
+          d->done = 1;
+        }
+      } else if (ret != BZ_OK) {
+        corrupt(d,"corrupt data");
+      }
+      break;
+    }
+    case CODEC_XZ: {
+      d->xz.next_in   = d->in + d->in_pos;
+      d->xz.avail_in  = avail;
+      d->xz.next_out  = (u_char *) buf;
+      d->xz.avail_out = n;
+      // the decoder handles concatenated streams itself
+      lzma_ret ret = lzma_code(&d->xz,d->in_eof ? LZMA_FINISH : LZMA_RUN);
+      d->in_pos = d->in_len - d->xz.avail_in;
+      left = d->xz.avail_out;
+      if (ret == LZMA_STREAM_END)
+        d->done = 1;
+      else if (ret != LZMA_OK && ret != LZMA_BUF_ERROR)
+        corrupt(d,"corrupt data");
+      break;
+    }
+    case CODEC_ZSTD: {
+      // as does this one, for concatenated frames
+      ZSTD_inBuffer  in  = { d->in + d->in_pos, avail, 0 };
+      ZSTD_outBuffer out = { buf, n, 0 };
+      size_t ret = ZSTD_decompressStream(d->zstd,&out,&in);
+      if (ZSTD_isError(ret))
+        corrupt(d,ZSTD_getErrorName(ret));
+      d->in_pos += in.pos;
+      left = n - out.pos;
+      if (!ret && !fill(d)) d->done = 1;
+      break;
+    }
+  }
+  return n - left;
+}
+
+static size_t stream_read(decoder *d, char *buf, size_t n) {
+  size_t got = 0;
+  while (!got && !d->done) {
+    size_t avail = fill(d);
+    got = stream_step(d,buf,n);
+    if (!got && !d->done && !avail && d->in_eof)
+      corrupt(d,"unexpected end of file");
+  }
+  return got;
+}
+
+static void stream_init(decoder *d) {
+  switch (d->codec) {
+    case CODEC_GZIP:
+    case CODEC_BGZF:
+      if (inflateInit2(&d->z,15+16) != Z_OK)
+        corrupt(d,"can't initialize decoder");
+      break;
+    case CODEC_BZIP2:
+      if (BZ2_bzDecompressInit(&d->bz,0,0) != BZ_OK)
+        corrupt(d,"can't initialize decoder");
+      break;
+    case CODEC_XZ:
+      if (lzma_stream_decoder(&d->xz,UINT64_MAX,LZMA_CONCATENATED) != LZMA_OK)
+        corrupt(d,"can't initialize decoder");
+      break;
+    case CODEC_ZSTD:
+      if (!(d->zstd = ZSTD_createDStream()))
+        corrupt(d,"can't initialize decoder");
+      ZSTD_initDStream(d->zstd);
+      break;
+  }
+}
+
+static void stream_free(decoder *d) {
+  switch (d->codec) {
+    case CODEC_GZIP:
+    case CODEC_BGZF:
+      inflateEnd(&d->z);
+      break;
+    case CODEC_BZIP2:
+      if (!d->done) BZ2_bzDecompressEnd(&d->bz);
+      break;
+    case CODEC_XZ:
+      lzma_end(&d->xz);
+      break;
+    case CODEC_ZSTD:
+      ZSTD_freeDStream(d->zstd);
+      break;
+  }
+  free(d->in);
+  close(d->fd);
+}
+
+// parallel decoding: pieces are runs of whole BGZF blocks or zstd
+// frames, claimed in file order by worker threads and decoded into
+// a window of buffers that the reader drains in the same order
+
+static size_t piece_end(decoder *d, size_t pos) {
+  size_t start = pos;
+  while (pos < d->size && pos - start < PIECE_BYTES) {
+    size_t n;
+    if (d->codec == CODEC_BGZF) {
+      n = bgzf_block(d->map + pos,d->size - pos);
+    } else {
+      n = ZSTD_findFrameCompressedSize(d->map + pos,d->size - pos);
+      if (ZSTD_isError(n)) n = 0;
+    }
+    if (!n) corrupt(d,"truncated or corrupt data");
+    pos += n;
+  }
+  return pos;
+}
+
+static void piece_grow(piece *p, size_t *cap, size_t need) {
+  if (need <= *cap) return;
+  while (*cap < need) *cap *= 2;
+  if (!(p->data = realloc(p->data,*cap)))
+    die("realloc: %s\n",errstr);
+}
+
+static void decode_bgzf(decoder *d, z_stream *z, size_t pos, size_t end, piece *p) {
+  size_t cap = 4*(end - pos) + 1;
+  if (!(p->data = malloc(cap)))
+    die("malloc: %s\n",errstr);
+  while (pos < end) {
+    size_t size = bgzf_block(d->map + pos,end - pos);
+    size_t isize = le32(d->map + pos + size - 4);
+    piece_grow(p,&cap,p->len + isize);
+    inflateReset(z);
+    z->next_in   = (Bytef *) d->map + pos;
+    z->avail_in  = size;
+    z->next_out  = p->data + p->len;
+    z->avail_out = isize;
+    if (inflate(z,Z_FINISH) != Z_STREAM_END || z->avail_out)
+      corrupt(d,z->msg ? z->msg : "corrupt block");
+    p->len += isize;
+    pos += size;
+  }
+}
+
+static void decode_zstd(decoder *d, ZSTD_DStream *zs, size_t pos, size_t end, piece *p) {
+  size_t cap = 4*(end - pos) + 1;
+  if (!(p->data = malloc(cap)))
+    die("malloc: %s\n",errstr);
+  ZSTD_initDStream(zs);
+  ZSTD_inBuffer in = { d->map + pos, end - pos, 0 };
+  for (;;) {
+    ZSTD_outBuffer out = { p->data + p->len, cap - p->len, 0 };
+    size_t ret = ZSTD_decompressStream(zs,&out,&in);
+    if (ZSTD_isError(ret))
+      corrupt(d,ZSTD_getErrorName(ret));
+    p->len += out.pos;
+    if (!ret && in.pos == in.size) break;
+    if (p->len == cap)
+      piece_grow(p,&cap,cap+1);
+    else if (in.pos == in.size)
+      corrupt(d,"truncated frame");
+  }
+}
+
+static gpointer decode_worker(gpointer arg) {
+  decoder *d = arg;
+  z_stream z;
+  ZSTD_DStream *zs = NULL;
+  if (d->codec == CODEC_BGZF) {
+    memset(&z,0,sizeof(z));
+    if (inflateInit2(&z,15+16) != Z_OK)
+      corrupt(d,"can't initialize decoder");
+  } else {
+    if (!(zs = ZSTD_createDStream()))
+      corrupt(d,"can't initialize decoder");
+  }
+
+  g_mutex_lock(&d->lock);
+  for (;;) {
+    while (!d->stop && d->cursor < d->size && d->next >= d->head + d->n_window)
+      g_cond_wait(&d->cond,&d->lock);
+    if (d->stop || d->cursor >= d->size) break;
+    u_int64_t n = d->next++;
+    size_t pos = d->cursor;
+    size_t end = d->cursor = piece_end(d,pos);
+    g_mutex_unlock(&d->lock);
+
+    piece p = { NULL, 0, 1 };
+    if (d->codec == CODEC_BGZF)
+      decode_bgzf(d,&z,pos,end,&p);
+    else
+      decode_zstd(d,zs,pos,end,&p);
+
+    g_mutex_lock(&d->lock);
+    d->window[n % d->n_window] = p;
+    g_cond_broadcast(&d->cond);
+  }
+  g_mutex_unlock(&d->lock);
+
+  if (d->codec == CODEC_BGZF)
+    inflateEnd(&z);
+  else
+    ZSTD_freeDStream(zs);
+  return NULL;
+}
+
+static size_t parallel_read(decoder *d, char *buf, size_t n) {
+  for (;;) {
+    piece *p = &d->window[d->head % d->n_window];
+    g_mutex_lock(&d->lock);
+    while (!p->ready && !(d->head == d->next && d->cursor >= d->size))
+      g_cond_wait(&d->cond,&d->lock);
+    g_mutex_unlock(&d->lock);
+    if (!p->ready) return 0;
+
+    size_t m = p->len - d->head_pos;
+    if (m > n) m = n;
+    memcpy(buf,p->data + d->head_pos,m);
+    d->head_pos += m;
+    if (d->head_pos == p->len) {
+      free(p->data);
+      g_mutex_lock(&d->lock);
+      memset(p,0,sizeof(*p));
+      d->head++;
+      d->head_pos = 0;
+      g_cond_broadcast(&d->cond);
+      g_mutex_unlock(&d->lock);
+    }
+    if (m) return m;
+  }
+}
+
+static int parallel_init(decoder *d, int threads) {
+  struct stat fs;
+  if (fstat(d->fd,&fs) || !S_ISREG(fs.st_mode))
+    return 0;
+  void *map = mmap(0,fs.st_size,PROT_READ,MAP_PRIVATE,d->fd,0);
+  if (map == MAP_FAILED)
+    return 0;
+  d->map = map;
+  d->size = fs.st_size;
+  if (d->codec == CODEC_ZSTD) {
+    // a file of one frame can only be decoded serially
+    size_t n = ZSTD_findFrameCompressedSize(d->map,d->size);
+    if (ZSTD_isError(n) || n >= d->size) {
+      munmap(map,fs.st_size);
+      d->map = NULL;
+      return 0;
+    }
+  }
+#ifdef POSIX_MADV_SEQUENTIAL
+  posix_madvise(map,fs.st_size,POSIX_MADV_SEQUENTIAL);
+#endif
+
+  int i;
+  g_mutex_init(&d->lock);
+  g_cond_init(&d->cond);
+  d->n_threads = threads;
+  d->n_window = PIECES_PER_THREAD * threads;
+  d->window = calloc(d->n_window,sizeof(piece));
+  d->threads = calloc(threads,sizeof(GThread *));
+  if (!d->window || !d->threads)
+    die("calloc: %s\n",errstr);
+  for (i = 0; i < threads; i++)
+    d->threads[i] = g_thread_new("decompress",decode_worker,d);
+  return 1;
+}
+
+static void parallel_free(decoder *d) {
+  int i;
+  g_mutex_lock(&d->lock);
+  d->stop = 1;
+  g_cond_broadcast(&d->cond);
+  g_mutex_unlock(&d->lock);
+  for (i = 0; i < d->n_threads; i++)
+    g_thread_join(d->threads[i]);
+  for (i = 0; i < d->n_window; i++)
+    free(d->window[i].data);
+  free(d->window);
+  free(d->threads);
+  g_mutex_clear(&d->lock);
+  g_cond_clear(&d->cond);
+  munmap((void *) d->map,d->size);
+  close(d->fd);
+}
+
+// stdio stream glue
+
+static size_t decoder_read(decoder *d, char *buf, size_t n) {
+  double start = monotonic_time();
+  size_t r = d->map ? parallel_read(d,buf,n) : stream_read(d,buf,n);
+  double end = monotonic_time();
+  g_mutex_lock(&totals_lock);
+  total_bytes += r;
+  total_seconds += end - start;
+  g_mutex_unlock(&totals_lock);
+  return r;
+}
+
+static int decoder_close(void *cookie) {
+  decoder *d = cookie;
+  if (d->map)
+    parallel_free(d);
+  else
+    stream_free(d);
+  free(d);
+  return 0;
+}
+
+#ifdef __GLIBC__
+static ssize_t decoder_read_cookie(void *cookie, char *buf, size_t n) {
+  return decoder_read(cookie,buf,n);
+}
+#else
+static int decoder_read_cookie(void *cookie, char *buf, int n) {
+  return decoder_read(cookie,buf,n);
+}
+#endif
+
+// open a possibly compressed file for reading, decompressing it if
+// its contents are in a known format and reading it as is otherwise
+
+FILE *decompress_open(const char *name) {
+  int fd = open(name,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",name,errstr);
+  fcntl(fd,F_SETFD,FD_CLOEXEC);
+
+  decoder *d = calloc(1,sizeof(decoder));
+  if (!d || !(d->in = malloc(IO_BUFFER_SIZE)))
+    die("malloc: %s\n",errstr);
+  d->name = name;
+  d->fd = fd;
+  while (d->in_len < 18 && !d->in_eof) {
+    ssize_t r = read(fd,d->in + d->in_len,IO_BUFFER_SIZE - d->in_len);
+    if (r < 0 && errno == EINTR) continue;
+    if (r < 0) die("read(\"%s\"): %s\n",name,errstr);
+    d->in_len += r;
+    d->in_eof = !r;
+  }
+  d->codec = sniff(d->in,d->in_len);
+
+  int threads = decompress_threads ? decompress_threads : g_get_num_processors();
+  if ((d->codec == CODEC_BGZF || d->codec == CODEC_ZSTD) &&
+      threads > 1 && parallel_init(d,threads)) {
+    free(d->in);
+    d->in = NULL;
+  } else {
+    stream_init(d);
+  }
+
+  FILE *file;
+#ifdef __GLIBC__
+  cookie_io_functions_t io = { decoder_read_cookie, NULL, NULL, decoder_close };
+  file = fopencookie(d,"r",io);
+#else
+  file = funopen(d,decoder_read_cookie,NULL,NULL,decoder_close);
+#endif
+  if (!file)
+    die("fopencookie(\"%s\"): %s\n",name,errstr);
+  setvbuf(file,NULL,_IOFBF,IO_BUFFER_SIZE);
+  return file;
+}
@@ -10,11 +10,23 @@ const char *usage =
   "Options:\n"
   "  -Z [<integer>]  Output sizes of first N packets.\n"
   "  -V [<integer>]  Output intervals between first N packets.\n"
+  "  -D              Packet sizes are signed (see parse -D).\n"
+  "  -2, --v2        Packet files have version 2 records.\n"
+  "                  (Files with headers say so themselves.)\n"
   "\n"
   "  -c              CSV output (default).\n"
   "  -t              Tab-delimited output.\n"
   "  -d <string>     Custom-delimited output.\n"
   "\n"
+  "  -X <file>       Flow offset index of the packet file (see\n"
+  "                  sortpkts -x): only the first N packets of\n"
+  "                  each flow are read.\n"
+  "  -L <file>       Only output flows in this list (needs -X).\n"
+  "\n"
+  "Notes:\n"
+  "  - With -X, the packet file may be block-compressed (see zpack),\n"
+  "    and only its blocks holding packets to output are decompressed.\n"
+  "  - Flow lists are white-space text, as for unpack -L.\n"
 ;
 
 #include "common.h"
@@ -22,6 +34,11 @@ const char *usage =
 int sizes = 0;
 int intervals = 0;
 int packets = 0;
+int duplex = 0;
+int version = 1;
+
+char *flow_index = NULL;
+char *flow_list = NULL;
 
 char *const comma = ",";
 char *const tab = "\t";
@@ -35,15 +52,19 @@ void parse_opts(int argc, char **argv) {
   static struct option longopts[] = {
     { "sizes",     optional_argument, 0, 'Z' },
     { "intervals", optional_argument, 0, 'V' },
+    { "duplex",    no_argument,       0, 'D' },
+    { "v2",        no_argument,       0, '2' },
     { "csv",       no_argument,       0, 'c' },
     { "tab",       no_argument,       0, 't' },
     { "delimiter", required_argument, 0, 'd' },
+    { "offsets",   required_argument, 0, 'X' },
+    { "list",      required_argument, 0, 'L' },
     { "help",      no_argument,       0, 'h' },
     { 0, 0, 0, 0 }
   };
 
   int c;
-  while ((c = getopt_long(argc,argv,"Z::V::ctd:h",longopts,0)) != -1) {
+  while ((c = getopt_long(argc,argv,"Z::V::D2ctd:X:L:h",longopts,0)) != -1) {
     switch (c) {
 
       case 'Z':
@@ -56,6 +77,12 @@ void parse_opts(int argc, char **argv) {
         if (optarg)
           packets = atoi(optarg);
         break;
+      case 'D':
+        duplex = 1;
+        break;
+      case '2':
+        version = 2;
+        break;
 
       case 'c':
         delimiter = comma;
@@ -66,6 +93,12 @@ void parse_opts(int argc, char **argv) {
       case 'd':
         delimiter = optarg;
         break;
+      case 'X':
+        flow_index = optarg;
+        break;
+      case 'L':
+        flow_list = optarg;
+        break;
 
       case 'h':
         printf("%s",usage);
@@ -86,46 +119,120 @@ void parse_opts(int argc, char **argv) {
     die("You can enumerate sizes or intervals, not both.\n");
   if (!sizes && !intervals)
     die("You must choose to enumerate sizes or intervals.\n");
+  if (flow_list && !flow_index)
+    die("Flow lists need a flow offset index (-X).\n");
+  if (flow_index && argc - optind != 1)
+    die("A flow offset index goes with a single packet file.\n");
+}
+
+int packet_no;
+long long last_flow;
+u_int64_t last_time;
+
+// output a packet's value, starting a new line for a new flow
+
+void enumerate(const packet_data *packet, int new_flow) {
+  if (new_flow) packet_no = 0;
+  packet_no++;
+  if (!packets || packet_no <= packets) {
+    if (sizes) {
+      if (last_flow >= 0)
+        printf("%s", new_flow ? "\n" : delimiter);
+      printf(duplex ? "%hd" : "%hu",packet->size);
+    } else if (intervals) {
+      if (new_flow) {
+        if (last_flow >= 0) putchar('\n');
+      } else {
+        if (packet_no > 2) printf("%s", delimiter);
+        printf("%0.7f", (int64_t) (packet->time - last_time) * 1e-9);
+      }
+      last_time = packet->time;
+    }
+  }
+  last_flow = packet->flow;
+}
+
+// with a flow offset index, only the packets output are read
+
+void indexed(const char *name) {
+  record_file *f = record_file_open(name);
+  if (!f)
+    die("%s: -X needs a plain or block-compressed file.\n",name);
+  if (f->h.size) {
+    if (f->h.type != FILE_PACKETS)
+      die("%s: -X needs packet records.\n",name);
+    version = f->h.version;
+    duplex = f->h.flags & FILE_DUPLEX ? 1 : 0;
+  }
+  size_t size = packet_record_size(version);
+  flow_offsets *o = flow_offsets_open(flow_index,record_count(f,size));
+  FILE *list = flow_list ? open_arg(flow_list) : NULL;
+  u_int64_t index = 0, first, count, k;
+  packet_data packet;
+  last_flow = -1;
+  for (;; index++) {
+    if (list) {
+      unsigned long long x;
+      int r = fscanf(list,"%llu",&x);
+      if (r == EOF) break;
+      if (r != 1)
+        die("Bad flow index encountered.\n");
+      index = x;
+    } else if (index >= o->flows) {
+      break;
+    }
+    flow_offsets_get(o,index,&first,&count);
+    if (packets && count > packets)
+      count = packets;
+    for (k = first; k < first + count; k++) {
+      packet_decode(version,record_get(f,k,size),&packet);
+      enumerate(&packet,k == first);
+    }
+  }
+  putchar('\n');
+  if (list)
+    fclose(list);
+  flow_offsets_close(o);
+  record_file_close(f);
 }
 
 int main(int argc, char **argv) {
   int i;
   parse_opts(argc,argv);
+  if (flow_index) {
+    indexed(argv[optind]);
+    return 0;
+  }
+  int opt_version = version, opt_duplex = duplex;
   if (optind == argc) argc++;
   for (i = optind; i < argc; i++) {
     FILE *file = open_arg(argv[i]);
 
-    int packet_no;
-    packet_record packet;
-    long long last_flow = -1;
-    double last_time = -INFINITY;
-
-    while (read_packet(file,&packet)) {
-      ntoh_packet(&packet);
-      if (packet.flow != last_flow) packet_no = 0;
-      packet_no++;
-      if (!packets || packet_no <= packets) {
-        if (sizes) {
-          if (last_flow >= 0)
-            printf("%s", packet.flow != last_flow ? "\n" : delimiter);
-          printf("%hu",packet.size);
-        } else if (intervals) {
-          double time = packet.sec + packet.usec*1e-6;
-          if (packet.flow != last_flow) {
-            if (last_flow >= 0) putchar('\n');
-          } else {
-            if (packet_no > 2) printf("%s", delimiter);
-            printf("%0.7f", time - last_time);
-          }
-          last_time = time;
-        }
-      }
-      last_flow = packet.flow;
+    // file headers override -2 and -D
+    file_header h;
+    version = opt_version;
+    duplex = opt_duplex;
+    if (read_file_header(file,&h)) {
+      if (h.type == FILE_FLOWS)
+        die("%s: not a packet file.\n",argv[i]);
+      if (h.sort_major != SORT_NONE && h.sort_major != SORT_FLOW)
+        warn("Warning: %s is not sorted by flow.\n",argv[i]);
+      version = h.version;
+      duplex = h.flags & FILE_DUPLEX ? 1 : 0;
     }
+
+    packet_data packet;
+    last_flow = -1;
+
+    packet_reader r;
+    packet_reader_init(&r,file,&h,version,
+      COLUMN_FLOW | (sizes ? COLUMN_SIZE : COLUMN_TIME));
+    while (packet_read(&r,&packet))
+      enumerate(&packet,packet.flow != last_flow);
     putchar('\n');
 
+    packet_reader_free(&r);
     fclose(file);
-    wait(NULL);
   }
   return 0;
 }
@@ -0,0 +1,253 @@
+// Open-addressing hash table from flow records to flow data.
+//
+// Buckets are eight bytes: a 32-bit hash tag and the number of the
+// entry they refer to. Entries hold the packed flow record and its
+// flow data inline and live in a slab (see slab.c), so adding a flow
+// never calls malloc and an entry never moves once created: pointers
+// to entries stay valid while the table grows.
+//
+// Growing is incremental. When the load limit is reached, a bucket
+// array of twice the size is allocated and the old buckets are moved
+// over a few at a time on every insert; lookups consult both arrays
+// until the move is done. There is never a long rehashing stall.
+//
+// The includer must define the flow_data type and include slab.c.
+
+#define FLOW_TABLE_MIN_BITS  10
+#define FLOW_TABLE_MIGRATE   16 // old buckets moved per insert
+#define FLOW_TOMBSTONE       0xffffffff
+
+typedef struct flow_entry {
+  flow_record key;
+  flow_data   data;
+} flow_entry;
+
+typedef struct {
+  u_int32_t tag;  // high half of the flow hash
+  u_int32_t slot; // one-based entry number, zero if empty
+} flow_bucket;   // (flows migrated or removed during migration leave tombstones)
+
+typedef struct {
+  flow_bucket *buckets;
+  u_int64_t    mask;
+  flow_bucket *old;       // buckets being migrated, if any
+  u_int64_t    old_mask;
+  u_int64_t    migrated;  // old buckets migrated so far
+
+  slab         entries;
+  u_int64_t    count;
+
+  // statistics
+  u_int64_t lookups;
+  u_int64_t probes;
+  u_int64_t max_probes;
+  u_int64_t resizes;
+} flow_table;
+
+// strong 64-bit hash of the packed 13-byte flow record
+
+static inline u_int64_t fmix64(u_int64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+static inline u_int64_t flow_hash(const flow_record *f) {
+  u_int64_t a = 0, b = 0;
+  memcpy(&a,f,8);
+  memcpy(&b,(const char *)f+8,sizeof(flow_record)-8);
+  return fmix64(a ^ fmix64(b + 0x9e3779b97f4a7c15ULL));
+}
+
+static inline int flow_equal(const flow_record *x, const flow_record *y) {
+  return !memcmp(x,y,sizeof(flow_record));
+}
+
+#define FLOW_TAG(hash) ((u_int32_t) ((hash) >> 32))
+
+static inline flow_entry *flow_table_entry(flow_table *t, u_int32_t slot) {
+  return (flow_entry *) slab_ptr(&t->entries,slot);
+}
+
+static void flow_table_init(flow_table *t) {
+  memset(t,0,sizeof(*t));
+  t->mask = (1ULL << FLOW_TABLE_MIN_BITS) - 1;
+  t->buckets = calloc(t->mask+1,sizeof(flow_bucket));
+  if (!t->buckets)
+    die("calloc: %s\n",errstr);
+  slab_init(&t->entries,sizeof(flow_entry));
+}
+
+// release all entries and buckets in bulk
+
+static void flow_table_free(flow_table *t) {
+  slab_reset(&t->entries);
+  free(t->buckets);
+  free(t->old);
+  memset(t,0,sizeof(*t));
+}
+
+// find the bucket holding a flow, or the empty bucket ending its probe
+
+static inline flow_bucket *flow_table_probe(
+  flow_table *t, flow_bucket *buckets, u_int64_t mask,
+  const flow_record *key, u_int64_t hash
+) {
+  u_int32_t tag = FLOW_TAG(hash);
+  u_int64_t i = hash & mask, n = 1;
+  for (;; i = (i+1) & mask, n++) {
+    flow_bucket *b = &buckets[i];
+    if (!b->slot ||
+        b->tag == tag && b->slot != FLOW_TOMBSTONE &&
+        flow_equal(&flow_table_entry(t,b->slot)->key,key)) {
+      t->lookups++;
+      t->probes += n;
+      if (n > t->max_probes) t->max_probes = n;
+      return b;
+    }
+  }
+}
+
+// place an existing entry into an empty bucket of the current array
+
+static inline void flow_table_place(flow_table *t, u_int32_t tag,
+                                    u_int32_t slot, u_int64_t hash) {
+  u_int64_t i = hash & t->mask;
+  while (t->buckets[i].slot)
+    i = (i+1) & t->mask;
+  t->buckets[i].tag  = tag;
+  t->buckets[i].slot = slot;
+}
+
+static void flow_table_migrate(flow_table *t, u_int64_t n) {
+  for (; n && t->migrated <= t->old_mask; n--) {
+    flow_bucket *b = &t->old[t->migrated++];
+    if (!b->slot || b->slot == FLOW_TOMBSTONE) continue;
+    flow_entry *e = flow_table_entry(t,b->slot);
+    flow_table_place(t,b->tag,b->slot,flow_hash(&e->key));
+    // moved flows must not be found here once removed from the new array
+    b->slot = FLOW_TOMBSTONE;
+  }
+  if (t->migrated > t->old_mask) {
+    free(t->old);
+    t->old = NULL;
+  }
+}
+
+static void flow_table_grow(flow_table *t) {
+  if (t->old) // only happens if inserts outpace migration
+    flow_table_migrate(t,t->old_mask+1);
+  t->old = t->buckets;
+  t->old_mask = t->mask;
+  t->migrated = 0;
+  t->mask = 2*t->mask + 1;
+  t->buckets = calloc(t->mask+1,sizeof(flow_bucket));
+  if (!t->buckets)
+    die("calloc: %s\n",errstr);
+  t->resizes++;
+}
+
+// look up a flow, adding it if it isn't present; the data of newly
+// added flows is uninitialized, which is indicated via *added
+
+static flow_entry *flow_table_get(flow_table *t, const flow_record *key,
+                                 u_int64_t hash, int *added) {
+  flow_bucket *b = flow_table_probe(t,t->buckets,t->mask,key,hash);
+  if (!b->slot && t->old) {
+    flow_bucket *o = flow_table_probe(t,t->old,t->old_mask,key,hash);
+    if (o->slot) b = o;
+  }
+  if (b->slot) {
+    *added = 0;
+    return flow_table_entry(t,b->slot);
+  }
+
+  // keep the load factor at or below 3/4
+  if (4*(t->count+1) > 3*(t->mask+1)) {
+    flow_table_grow(t);
+    b = flow_table_probe(t,t->buckets,t->mask,key,hash);
+  }
+  u_int32_t slot = slab_alloc(&t->entries);
+  flow_entry *e = flow_table_entry(t,slot);
+  t->count++;
+  e->key = *key;
+  b->tag = FLOW_TAG(hash);
+  b->slot = slot;
+  if (t->old)
+    flow_table_migrate(t,FLOW_TABLE_MIGRATE);
+
+  *added = 1;
+  return e;
+}
+
+// remove a flow, recycling its entry
+
+static void flow_table_remove(flow_table *t, const flow_record *key,
+                              u_int64_t hash) {
+  u_int32_t slot;
+  flow_bucket *b = flow_table_probe(t,t->buckets,t->mask,key,hash);
+  if (b->slot) {
+    slot = b->slot;
+    // backward-shift deletion: move later buckets of the probe run
+    // into the gap unless their home bucket lies after the gap
+    u_int64_t i = b - t->buckets, j = i;
+    for (;;) {
+      j = (j+1) & t->mask;
+      flow_bucket *c = &t->buckets[j];
+      if (!c->slot) break;
+      u_int64_t k = flow_hash(&flow_table_entry(t,c->slot)->key) & t->mask;
+      if (i <= j ? i < k && k <= j : i < k || k <= j) continue;
+      t->buckets[i] = *c;
+      i = j;
+    }
+    t->buckets[i].slot = 0;
+  } else if (t->old) {
+    // the migration cursor forbids shifting old buckets around
+    b = flow_table_probe(t,t->old,t->old_mask,key,hash);
+    if (!b->slot) return;
+    slot = b->slot;
+    b->slot = FLOW_TOMBSTONE;
+  } else {
+    return;
+  }
+  slab_free(&t->entries,slot);
+  t->count--;
+}
+
+// call a function on every entry, in no particular order
+
+static void flow_table_each(flow_table *t, void (*f)(flow_entry *, void *),
+                            void *arg) {
+  if (t->old) // so that there are no tombstones
+    flow_table_migrate(t,t->old_mask+1);
+  u_int64_t i;
+  for (i = 0; i <= t->mask; i++)
+    if (t->buckets[i].slot)
+      f(flow_table_entry(t,t->buckets[i].slot),arg);
+}
+
+// print combined statistics for an array of tables
+
+static void flow_table_stats(FILE *out, flow_table *t, int n) {
+  u_int64_t count = 0, buckets = 0, lookups = 0, probes = 0;
+  u_int64_t max_probes = 0, resizes = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    count   += t[i].count;
+    buckets += t[i].mask + 1;
+    lookups += t[i].lookups;
+    probes  += t[i].probes;
+    resizes += t[i].resizes;
+    if (t[i].max_probes > max_probes)
+      max_probes = t[i].max_probes;
+  }
+  fprintf(out,"flow table: %llu flows, %llu buckets, load factor %.3f, %llu resizes\n",
+    (unsigned long long) count, (unsigned long long) buckets,
+    buckets ? (double) count / buckets : 0.0, (unsigned long long) resizes);
+  fprintf(out,"flow table: %llu lookups, %.3f mean probes, %llu max probes\n",
+    (unsigned long long) lookups, lookups ? (double) probes / lookups : 0.0,
+    (unsigned long long) max_probes);
+}
@@ -0,0 +1,145 @@
+const char *usage =
+  "Usage:\n"
+  "  flowindex [<flow file>]\n"
+  "\n"
+  "  Indexes a flow file by 5-tuple, protocol, source and destination\n"
+  "  address and source and destination port, writing the index to\n"
+  "  stdout for flowquery to look flows up in.\n"
+  "\n"
+  "Notes:\n"
+  "  - The index is meant to be mapped rather than read: each key has\n"
+  "    posting lists of the flows with each of its values, and 5-tuples\n"
+  "    are found through a hash table.\n"
+  "  - Flows are numbered as in the flow file, and the flow file isn't\n"
+  "    needed to query the index.\n"
+  "  - Flows of addresses in the address file (see parse -a) are indexed\n"
+  "    by their 240.0.0.0/4 references.\n"
+;
+
+#include <ctype.h>
+
+#include "common.h"
+
+typedef struct {
+  u_int32_t key;
+  u_int64_t flow;
+} posting;
+
+static int posting_cmp(const void *a, const void *b) {
+  const posting *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->flow < y->flow ? -1 : x->flow > y->flow;
+}
+
+static inline void put32(record_writer *w, u_int32_t x) {
+  x = htonl(x);
+  writer_put(w,&x,4);
+}
+static inline void put64(record_writer *w, u_int64_t x) {
+  x = GUINT64_TO_BE(x);
+  writer_put(w,&x,8);
+}
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc,argv,"h")) != -1) {
+    switch (c) {
+      case 'h':
+        printf("%s",usage);
+        return 0;
+      case '?':
+        if (isprint(optopt))
+          die("Unknown option `-%c'.\n",optopt);
+        else
+          die("Strange option `\\x%x'.\n",optopt);
+      default:
+        die("ERROR: getopt badness.\n");
+    }
+  }
+  if (argc - optind > 1)
+    die("flowindex takes a single flow file.\n");
+
+  FILE *file = open_arg(argv[optind]);
+  file_header h;
+  if (read_file_header(file,&h) && h.type != FILE_FLOWS)
+    die("Not a flow file.\n");
+  u_int64_t n = 0, cap = 1 << 16, i;
+  flow_record *flows = malloc(cap*sizeof(flow_record));
+  if (!flows)
+    die("malloc: %s\n",errstr);
+  while (read_flow(file,&flows[n]))
+    if (++n == cap) {
+      cap *= 2;
+      if (!(flows = realloc(flows,cap*sizeof(flow_record))))
+        die("realloc: %s\n",errstr);
+    }
+  fclose(file);
+
+  record_writer *out = writer_fd(fileno(stdout));
+  file_header_init(&h,FILE_FLOW_KEYS,1);
+  h.count = n;
+  h.flags |= FILE_COUNT;
+  if (n) {
+    h.max_flow = n-1;
+    h.flags |= FILE_MAX_FLOW;
+  }
+  write_file_header(out,&h);
+
+  // posting lists, one key at a time
+  posting *p = malloc((n ? n : 1)*sizeof(posting));
+  if (!p)
+    die("malloc: %s\n",errstr);
+  int k;
+  for (k = 0; k < FLOW_KEYS; k++) {
+    for (i = 0; i < n; i++) {
+      p[i].key = flow_key(&flows[i],k);
+      p[i].flow = i;
+    }
+    qsort(p,n,sizeof(posting),posting_cmp);
+    u_int64_t m = 0;
+    for (i = 0; i < n; i++)
+      if (!i || p[i].key != p[i-1].key)
+        m++;
+    put64(out,m);
+    for (i = 0; i < n; i++)
+      if (!i || p[i].key != p[i-1].key)
+        put32(out,p[i].key);
+    if (m & 1)
+      put32(out,0);
+    for (i = 0; i < n; i++)
+      if (!i || p[i].key != p[i-1].key)
+        put64(out,i);
+    put64(out,n);
+    for (i = 0; i < n; i++)
+      put64(out,p[i].flow);
+  }
+  free(p);
+
+  // the 5-tuple hash table, at most half full
+  u_int64_t slots = 1;
+  while (slots < 2*n)
+    slots *= 2;
+  u_char *table = calloc(slots,FLOW_KEY_SLOT);
+  if (!table)
+    die("calloc: %s\n",errstr);
+  for (i = 0; i < n; i++) {
+    u_int64_t s = flow_key_hash(&flows[i]) & (slots-1), id;
+    u_char *slot;
+    for (;; s = (s+1) & (slots-1)) {
+      slot = table + s*FLOW_KEY_SLOT;
+      memcpy(&id,slot+16,8);
+      if (!id) break;
+    }
+    memcpy(slot,&flows[i],sizeof(flow_record));
+    id = GUINT64_TO_BE(i+1);
+    memcpy(slot+16,&id,8);
+  }
+  put64(out,slots);
+  for (i = 0; i < slots; i++)
+    writer_put(out,table + i*FLOW_KEY_SLOT,FLOW_KEY_SLOT);
+  free(table);
+  free(flows);
+  writer_close(out);
+  return 0;
+}
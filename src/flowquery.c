@@ -0,0 +1,301 @@
+const char *usage =
+  "Usage:\n"
+  "  flowquery <index file> <terms>\n"
+  "\n"
+  "  Looks up flows in a flow index (see flowindex), printing the\n"
+  "  indices of the flows matching all of the terms, in order and\n"
+  "  one per line, as unpack -L reads them.\n"
+  "\n"
+  "Terms:\n"
+  "  proto=<protocol>         Protocol number, or tcp, udp or icmp\n"
+  "  src=<address>[/<bits>]   Source address or prefix\n"
+  "  dst=<address>[/<bits>]   Destination address or prefix\n"
+  "  host=<address>[/<bits>]  Either address or prefix\n"
+  "  sport=<port>[-<port>]    Source port or range of ports\n"
+  "  dport=<port>[-<port>]    Destination port or range of ports\n"
+  "  port=<port>[-<port>]     Either port or range of ports\n"
+  "  tuple=<protocol>,<source address>,<source port>,\n"
+  "        <destination address>,<destination port>\n"
+  "                           Exact 5-tuple\n"
+  "\n"
+  "Notes:\n"
+  "  - Addresses are IPv4; flows of addresses in the address file (see\n"
+  "    parse -a) match their 240.0.0.0/4 references.\n"
+  "  - ICMP flows have their type and code as the destination port.\n"
+;
+
+#include <ctype.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+
+// the mapped index
+
+static u_int64_t flows;
+
+static struct {
+  u_int64_t        m;
+  const u_int32_t *values;
+  const u_int64_t *offsets;
+  const u_int64_t *flows;
+} lists[FLOW_KEYS];
+
+static u_int64_t slots;
+static const u_char *table;
+
+static void load(const char *path) {
+  int fd = open(path,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",path,errstr);
+  struct stat fs;
+  if (fstat(fd,&fs))
+    die("fstat(\"%s\"): %s\n",path,errstr);
+  const char *map = fs.st_size ?
+    mmap(0,fs.st_size,PROT_READ,MAP_PRIVATE,fd,0) : MAP_FAILED;
+  if (map == MAP_FAILED)
+    die("mmap(\"%s\"): %s\n",path,errstr);
+  close(fd);
+
+  file_header h;
+  if (!file_header_parse(map,fs.st_size,&h) || h.type != FILE_FLOW_KEYS)
+    die("%s: not a flow index.\n",path);
+  flows = h.count;
+  const char *p = map + h.size, *end = map + fs.st_size;
+  int k;
+  for (k = 0; k < FLOW_KEYS; k++) {
+    if (end - p < 8)
+      die("%s: truncated flow index.\n",path);
+    u_int64_t m = GUINT64_FROM_BE(*(const u_int64_t *) p);
+    p += 8;
+    if (m > flows || end - p < 4*(m + (m & 1)) + 8*(m + 1 + flows))
+      die("%s: truncated flow index.\n",path);
+    lists[k].m = m;
+    lists[k].values = (const u_int32_t *) p;
+    p += 4*(m + (m & 1));
+    lists[k].offsets = (const u_int64_t *) p;
+    p += 8*(m + 1);
+    lists[k].flows = (const u_int64_t *) p;
+    p += 8*flows;
+  }
+  if (end - p < 8)
+    die("%s: truncated flow index.\n",path);
+  slots = GUINT64_FROM_BE(*(const u_int64_t *) p);
+  table = (const u_char *) p + 8;
+  if (!slots || slots & (slots-1) || (end - p - 8) / FLOW_KEY_SLOT < slots)
+    die("%s: truncated flow index.\n",path);
+}
+
+// sets of flow indices
+
+typedef struct {
+  u_int64_t *v;
+  u_int64_t  n, cap;
+} set;
+
+static void set_add(set *s, u_int64_t flow) {
+  if (s->n == s->cap) {
+    s->cap = s->cap ? 2*s->cap : 1024;
+    if (!(s->v = realloc(s->v,s->cap*sizeof(u_int64_t))))
+      die("realloc: %s\n",errstr);
+  }
+  s->v[s->n++] = flow;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+  u_int64_t x = *(const u_int64_t *) a, y = *(const u_int64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void set_sort(set *s) {
+  qsort(s->v,s->n,sizeof(u_int64_t),u64_cmp);
+  u_int64_t i, j = 0;
+  for (i = 0; i < s->n; i++)
+    if (!j || s->v[i] != s->v[j-1])
+      s->v[j++] = s->v[i];
+  s->n = j;
+}
+
+// keep the flows of a that are also in b; both sorted
+
+static void set_intersect(set *a, const set *b) {
+  u_int64_t i = 0, j = 0, k = 0;
+  while (i < a->n && j < b->n) {
+    if (a->v[i] < b->v[j]) i++;
+    else if (a->v[i] > b->v[j]) j++;
+    else { a->v[k++] = a->v[i++]; j++; }
+  }
+  a->n = k;
+}
+
+// the flows whose key has a value in [lo,hi]
+
+static void lookup(set *s, int key, u_int32_t lo, u_int32_t hi) {
+  const u_int32_t *values = lists[key].values;
+  u_int64_t L = 0, R = lists[key].m, a, b;
+  while (L < R) {
+    u_int64_t M = (L + R) / 2;
+    if (ntohl(values[M]) < lo) L = M + 1; else R = M;
+  }
+  a = L;
+  for (R = lists[key].m; L < R; ) {
+    u_int64_t M = (L + R) / 2;
+    if (ntohl(values[M]) <= hi) L = M + 1; else R = M;
+  }
+  b = L;
+  u_int64_t i = GUINT64_FROM_BE(lists[key].offsets[a]);
+  u_int64_t e = GUINT64_FROM_BE(lists[key].offsets[b]);
+  for (; i < e; i++)
+    set_add(s,GUINT64_FROM_BE(lists[key].flows[i]));
+}
+
+static void tuple_lookup(set *s, const flow_record *flow) {
+  u_int64_t i = flow_key_hash(flow) & (slots-1), id;
+  for (;; i = (i+1) & (slots-1)) {
+    const u_char *slot = table + i*FLOW_KEY_SLOT;
+    memcpy(&id,slot+16,8);
+    if (!id) return;
+    if (!memcmp(slot,flow,sizeof(flow_record)))
+      set_add(s,GUINT64_FROM_BE(id) - 1);
+  }
+}
+
+// parsing terms
+
+static u_int8_t parse_proto(const char *arg) {
+  if (!strcmp(arg,"tcp"))  return IP_PROTO_TCP;
+  if (!strcmp(arg,"udp"))  return IP_PROTO_UDP;
+  if (!strcmp(arg,"icmp")) return IP_PROTO_ICMP;
+  char *end;
+  unsigned long x = strtoul(arg,&end,10);
+  if (end == arg || *end || x > 255)
+    die("Bad protocol: `%s'.\n",arg);
+  return x;
+}
+
+static u_int32_t parse_addr(const char *arg) {
+  struct in_addr a;
+  if (inet_pton(AF_INET,arg,&a) != 1)
+    die("Bad address: `%s'.\n",arg);
+  return a.s_addr;
+}
+
+static void parse_prefix(const char *arg, u_int32_t *lo, u_int32_t *hi) {
+  char buf[INET_ADDRSTRLEN];
+  const char *slash = strchr(arg,'/');
+  int bits = 32;
+  if (slash) {
+    char *end;
+    bits = strtol(slash+1,&end,10);
+    if (end == slash+1 || *end || bits < 0 || bits > 32)
+      die("Bad prefix length: `%s'.\n",arg);
+    if (slash - arg >= sizeof(buf))
+      die("Bad address: `%s'.\n",arg);
+    memcpy(buf,arg,slash - arg);
+    buf[slash - arg] = '\0';
+    arg = buf;
+  }
+  u_int32_t mask = bits ? ~0U << (32 - bits) : 0;
+  *lo = ntohl(parse_addr(arg)) & mask;
+  *hi = *lo | ~mask;
+}
+
+static u_int16_t parse_port(const char *arg, char **end) {
+  unsigned long x = strtoul(arg,end,10);
+  if (*end == arg || x > 65535)
+    die("Bad port: `%s'.\n",arg);
+  return x;
+}
+
+static void parse_ports(const char *arg, u_int32_t *lo, u_int32_t *hi) {
+  char *end;
+  *lo = *hi = parse_port(arg,&end);
+  if (*end == '-')
+    *hi = parse_port(end+1,&end);
+  if (*end || *hi < *lo)
+    die("Bad port range: `%s'.\n",arg);
+}
+
+static void parse_tuple(const char *arg, flow_record *flow) {
+  char *copy = strdup(arg), *field[5], *p = copy, *end;
+  int i;
+  for (i = 0; i < 5; i++) {
+    field[i] = strsep(&p,",");
+    if (!field[i] || (i < 4) != (p != NULL))
+      die("Bad 5-tuple: `%s'.\n",arg);
+  }
+  flow->proto = parse_proto(field[0]);
+  flow->src_ip = parse_addr(field[1]);
+  flow->src_port = htons(parse_port(field[2],&end));
+  if (*end) die("Bad port: `%s'.\n",field[2]);
+  flow->dst_ip = parse_addr(field[3]);
+  flow->dst_port = htons(parse_port(field[4],&end));
+  if (*end) die("Bad port: `%s'.\n",field[4]);
+  free(copy);
+}
+
+static void term(set *s, const char *arg) {
+  const char *eq = strchr(arg,'=');
+  if (!eq)
+    die("Bad term: `%s'.\n",arg);
+  int len = eq - arg;
+  const char *value = eq + 1;
+  u_int32_t lo, hi;
+  flow_record flow;
+
+#define is(name) (len == strlen(name) && !strncmp(arg,name,len))
+  if (is("proto")) {
+    lo = hi = parse_proto(value);
+    lookup(s,FLOW_KEY_PROTO,lo,hi);
+  } else if (is("src") || is("dst") || is("host")) {
+    parse_prefix(value,&lo,&hi);
+    if (!is("dst")) lookup(s,FLOW_KEY_SRC_IP,lo,hi);
+    if (!is("src")) lookup(s,FLOW_KEY_DST_IP,lo,hi);
+  } else if (is("sport") || is("dport") || is("port")) {
+    parse_ports(value,&lo,&hi);
+    if (!is("dport")) lookup(s,FLOW_KEY_SRC_PORT,lo,hi);
+    if (!is("sport")) lookup(s,FLOW_KEY_DST_PORT,lo,hi);
+  } else if (is("tuple")) {
+    parse_tuple(value,&flow);
+    tuple_lookup(s,&flow);
+  } else {
+    die("Unknown term: `%s'.\n",arg);
+  }
+#undef is
+  set_sort(s);
+}
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc,argv,"h")) != -1) {
+    switch (c) {
+      case 'h':
+        printf("%s",usage);
+        return 0;
+      case '?':
+        if (isprint(optopt))
+          die("Unknown option `-%c'.\n",optopt);
+        else
+          die("Strange option `\\x%x'.\n",optopt);
+      default:
+        die("ERROR: getopt badness.\n");
+    }
+  }
+  if (argc - optind < 2)
+    die("%s",usage);
+
+  load(argv[optind]);
+  set result = {0}, s = {0};
+  int i;
+  term(&result,argv[optind+1]);
+  for (i = optind+2; i < argc && result.n; i++) {
+    s.n = 0;
+    term(&s,argv[i]);
+    set_intersect(&result,&s);
+  }
+  u_int64_t j;
+  for (j = 0; j < result.n; j++)
+    printf("%llu\n",(unsigned long long) result.v[j]);
+  return 0;
+}
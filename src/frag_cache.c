@@ -0,0 +1,99 @@
+// Cache attributing IP fragments to the flows of their datagrams.
+//
+// Only the first fragment of a datagram has a transport header, so
+// the ports of a datagram are remembered, keyed on its addresses,
+// protocol and IP identification, when its first fragment is seen,
+// for the later fragments to be looked up with. Nothing is reassembled.
+//
+// The cache is a set-associative table of fixed size allocated on
+// first use, so memory stays bounded whatever the traffic: a new
+// datagram replaces the least recently seen entry of its set, and
+// entries not seen for FRAG_TIMEOUT seconds are ignored.
+
+#define FRAG_CACHE_SETS  16384
+#define FRAG_CACHE_WAYS  4
+#define FRAG_TIMEOUT     30 // seconds after which entries expire
+
+typedef struct {
+  u_int32_t src_ip, dst_ip;
+  u_int32_t id;
+  u_int32_t sec;   // when the datagram was last seen
+  u_int16_t src_port, dst_port;
+  u_int8_t  proto;
+  u_int8_t  used;
+} frag_entry;
+
+typedef struct {
+  frag_entry *entries;
+
+  // statistics
+  u_int64_t matched;
+  u_int64_t unmatched;
+} frag_cache;
+
+static inline int frag_match(frag_entry *e, flow_record *f, u_int32_t id) {
+  return e->used && e->id == id && e->proto == f->proto &&
+         e->src_ip == f->src_ip && e->dst_ip == f->dst_ip;
+}
+
+static frag_entry *frag_set(frag_cache *c, flow_record *f, u_int32_t id) {
+  if (!c->entries) {
+    c->entries = calloc(FRAG_CACHE_SETS*FRAG_CACHE_WAYS,sizeof(frag_entry));
+    if (!c->entries)
+      die("calloc: %s\n",errstr);
+  }
+  u_int64_t hash = fmix64(((u_int64_t) f->src_ip << 32 | f->dst_ip) ^
+                          ((u_int64_t) id << 8 | f->proto));
+  return &c->entries[(hash % FRAG_CACHE_SETS) * FRAG_CACHE_WAYS];
+}
+
+// remember the ports of a datagram from its first fragment
+
+static void frag_remember(frag_cache *c, flow_record *f, u_int32_t id, u_int32_t sec) {
+  frag_entry *set = frag_set(c,f,id), *e = NULL;
+  int i;
+  for (i = 0; i < FRAG_CACHE_WAYS; i++) {
+    frag_entry *w = &set[i];
+    // entries are only ever replaced, so ways fill up in order
+    if (!w->used || frag_match(w,f,id)) {
+      e = w;
+      break;
+    }
+    if (!e || w->sec < e->sec) // expired entries are the least recent
+      e = w;
+  }
+  e->src_ip   = f->src_ip;
+  e->dst_ip   = f->dst_ip;
+  e->id       = id;
+  e->proto    = f->proto;
+  e->src_port = f->src_port;
+  e->dst_port = f->dst_port;
+  e->sec      = sec;
+  e->used     = 1;
+}
+
+// set the ports of a later fragment; they are zero if the first
+// fragment hasn't been seen (or was forgotten)
+
+static void frag_lookup(frag_cache *c, flow_record *f, u_int32_t id, u_int32_t sec) {
+  frag_entry *set = frag_set(c,f,id);
+  int i;
+  for (i = 0; i < FRAG_CACHE_WAYS; i++) {
+    frag_entry *e = &set[i];
+    if (frag_match(e,f,id) && (int32_t) (sec - e->sec) <= FRAG_TIMEOUT) {
+      f->src_port = e->src_port;
+      f->dst_port = e->dst_port;
+      e->sec = sec;
+      c->matched++;
+      return;
+    }
+  }
+  f->src_port = 0;
+  f->dst_port = 0;
+  c->unmatched++;
+}
+
+static void frag_cache_free(frag_cache *c) {
+  free(c->entries);
+  c->entries = NULL;
+}
@@ -146,7 +146,6 @@ int main(int argc, char **argv) {
     if (print_dims)
       printf("%llu,%u,0\n",r,n);
     fclose(file);
-    wait(NULL);
   }
   return 0;
 }
@@ -0,0 +1,60 @@
+// Loser trees for k-way merging.
+//
+// Sources are numbered 0 to k-1 and compared by the caller's lt, which
+// should rank exhausted sources after all others. Internal nodes hold
+// the source that lost the match there, and node 0 the overall winner;
+// once the winner has moved on to its next item, replaying its path
+// from leaf to root takes one comparison per level.
+
+typedef struct {
+  int   k;
+  int  *node;
+  int (*lt)(void *ctx, int a, int b);
+  void *ctx;
+} loser_tree;
+
+void loser_tree_init(loser_tree *t, int k,
+                     int (*lt)(void *ctx, int a, int b), void *ctx) {
+  t->k = k;
+  t->lt = lt;
+  t->ctx = ctx;
+  t->node = malloc(k*sizeof(int));
+  int *win = malloc(2*k*sizeof(int)), i;
+  if (!t->node || !win)
+    die("malloc: %s\n",errstr);
+  for (i = 0; i < k; i++)
+    win[k+i] = i;
+  for (i = k-1; i > 0; i--) {
+    int a = win[2*i], b = win[2*i+1];
+    if (lt(ctx,b,a)) {
+      win[i] = b;
+      t->node[i] = a;
+    } else {
+      win[i] = a;
+      t->node[i] = b;
+    }
+  }
+  t->node[0] = k > 1 ? win[1] : 0;
+  free(win);
+}
+
+static inline int loser_tree_top(const loser_tree *t) {
+  return t->node[0];
+}
+
+// the winner has advanced: find the new one
+
+static inline void loser_tree_replay(loser_tree *t) {
+  int w = t->node[0], i;
+  for (i = (w + t->k) / 2; i > 0; i /= 2)
+    if (t->lt(t->ctx,t->node[i],w)) {
+      int x = t->node[i];
+      t->node[i] = w;
+      w = x;
+    }
+  t->node[0] = w;
+}
+
+void loser_tree_free(loser_tree *t) {
+  free(t->node);
+}
@@ -0,0 +1,499 @@
+const char *usage =
+  "Usage:\n"
+  "  merge [options] -p <packet file> <packet files>\n"
+  "  merge [options] -p <packet file> -f <flow file> \\\n"
+  "    <flow file> <packet file> [<flow file> <packet file> ...]\n"
+  "  merge [options] -p <packet file> -f <flow file> -a <address file> \\\n"
+  "    <address file> <flow file> <packet file> [...]\n"
+  "\n"
+  "  Merges packet files sorted by time into one packet file sorted by\n"
+  "  time. With -f, each input packet file follows its flow file, and\n"
+  "  the flow files are merged too: the first flows of a 5-tuple in\n"
+  "  each input become one, as do the second and so on, numbered in\n"
+  "  order of their first packets as parse numbers them, and packets\n"
+  "  are renumbered to match. Without -f, packets keep their flows, as\n"
+  "  for files split from one parse output.\n"
+  "\n"
+  "Options:\n"
+  "  -p <file>     Packet file to write\n"
+  "  -f <file>     Flow file to write\n"
+  "  -a <file>     Address file to write (see below)\n"
+  "  -H, --header  Start the outputs with file headers\n"
+  "  -D            Packet sizes are signed (see parse -D)\n"
+  "  -2, --v2      Packet files have version 2 records (see parse -2)\n"
+  "\n"
+  "Notes:\n"
+  "  - Inputs are read once, in order, and may be compressed; only flows\n"
+  "    are kept in memory.\n"
+  "  - Inputs with headers give their record version themselves. The\n"
+  "    output has version 2 records if any input does, and packets at\n"
+  "    the same time are taken from inputs in the order given.\n"
+  "  - Flows without packets come after all the others.\n"
+  "  - Flows an input splits (see parse -i) stay apart: only\n"
+  "    flows from different inputs are merged.\n"
+  "  - With signed sizes either end of a flow may come first in each\n"
+  "    input; packets of flows the other way round to their merged flow\n"
+  "    have their sizes negated.\n"
+  "  - Flows of addresses in an address file (see parse -a) refer to\n"
+  "    them by index, so flow files written with one need -a, with each\n"
+  "    input's address file before its flow file: the addresses are\n"
+  "    merged, and flows refer to them in the address file written.\n"
+  "    Without -f, inputs should share their address file.\n"
+;
+
+#include <ctype.h>
+
+#include "common.h"
+#include "losertree.c"
+
+#define NO_FLOW (~(u_int64_t) 0)
+
+const char *packet_file = NULL;
+const char *flow_file = NULL;
+const char *address_file = NULL;
+int headers = 0;
+int duplex = 0;
+int version = 1;
+
+void parse_opts(int argc, char **argv) {
+
+  static struct option longopts[] = {
+    { "addresses", required_argument, 0, 'a' },
+    { "header",    no_argument,       0, 'H' },
+    { "v2",        no_argument,       0, '2' },
+    { "help",      no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc,argv,"p:f:a:HD2h",longopts,0)) != -1) {
+    switch (c) {
+
+      case 'p':
+        packet_file = optarg;
+        break;
+      case 'f':
+        flow_file = optarg;
+        break;
+      case 'a':
+        address_file = optarg;
+        break;
+      case 'H':
+        headers = 1;
+        break;
+      case 'D':
+        duplex = 1;
+        break;
+      case '2':
+        version = 2;
+        break;
+
+      case 'h':
+        printf("%s",usage);
+        exit(0);
+
+      case '?':
+        if (isprint(optopt))
+          die("Unknown option `-%c'.\n",optopt);
+        else
+          die("Strange option `\\x%x'.\n",optopt);
+
+      default:
+        die("ERROR: getopt badness.\n");
+    }
+  }
+
+  if (!packet_file)
+    die("You must give a packet file to write (-p).\n");
+  if (optind == argc)
+    die("%s",usage);
+  if (address_file) {
+    if (!flow_file)
+      die("Address files are only merged with flow files (-f).\n");
+    if ((argc - optind) % 3)
+      die("Each flow file must follow its address file, and each packet "
+          "file its flow file.\n");
+  } else if (flow_file && (argc - optind) % 2)
+    die("Each packet file must follow its flow file.\n");
+}
+
+// inputs, and where the next packet is
+
+typedef struct {
+  const char    *name;
+  FILE          *file;
+  packet_reader  r;
+  packet_data    packet;
+  int            done;
+  u_int64_t      flows;
+  flow_record   *flow;  // the input's flows
+  u_int32_t     *nth;   // which of their 5-tuple's flows they are
+  u_int8_t      *flip;  // whether they're reversed from their key, then
+                        // from their merged flow, once known
+  u_int64_t     *remap; // and their merged flows, once known
+} input;
+
+static void next_packet(input *in) {
+  u_int64_t time = in->packet.time;
+  if (!(in->done = !packet_read(&in->r,&in->packet)) && in->packet.time < time)
+    die("%s: packets aren't sorted by time.\n",in->name);
+}
+
+static int input_lt(void *ctx, int a, int b) {
+  input *in = ctx;
+  if (in[a].done) return 0;
+  if (in[b].done) return 1;
+  if (in[a].packet.time != in[b].packet.time)
+    return in[a].packet.time < in[b].packet.time;
+  return a < b;
+}
+
+// addresses that flows refer to (see parse -a), interned across inputs:
+// loaded flows refer to them by provisional number, which is mapped to
+// an index in the address file written in order of first output, as
+// parse numbers them
+
+static u_char (*addrs)[16];   // by provisional number
+static u_int32_t *addr_out;   // their output indices plus one, or zero
+static u_int32_t n_addrs, addrs_cap, addr_index;
+static u_int32_t *addr_slots; // provisional numbers plus one: open
+static u_int64_t addr_slots_size; // addressing, at most half full
+static record_writer *addresses_out;
+
+static u_int32_t *addr_slot_find(const u_char *a) {
+  u_int64_t i = 0xcbf29ce484222325ULL;
+  int j;
+  for (j = 0; j < 16; j++)
+    i = (i ^ a[j]) * 0x100000001b3ULL;
+  for (i &= addr_slots_size-1;; i = (i+1) & (addr_slots_size-1))
+    if (!addr_slots[i] || !memcmp(addrs[addr_slots[i]-1],a,16))
+      return &addr_slots[i];
+}
+
+static u_int32_t addr_intern(const u_char *a) {
+  u_int32_t i;
+  if (2*(n_addrs+1) > addr_slots_size) {
+    free(addr_slots);
+    addr_slots_size = addr_slots_size ? 2*addr_slots_size : 1 << 16;
+    if (!(addr_slots = calloc(addr_slots_size,sizeof(u_int32_t))))
+      die("calloc: %s\n",errstr);
+    for (i = 0; i < n_addrs; i++)
+      *addr_slot_find(addrs[i]) = i+1;
+  }
+  u_int32_t *s = addr_slot_find(a);
+  if (*s)
+    return *s-1;
+  if (n_addrs == MAX_ADDR_REFS)
+    die("Too many distinct addresses: %u.\n",n_addrs);
+  if (n_addrs == addrs_cap) {
+    addrs_cap = addrs_cap ? 2*addrs_cap : 1024;
+    if (!(addrs = realloc(addrs,addrs_cap*sizeof(*addrs))) ||
+        !(addr_out = realloc(addr_out,addrs_cap*sizeof(u_int32_t))))
+      die("realloc: %s\n",errstr);
+  }
+  memcpy(addrs[n_addrs],a,16);
+  addr_out[n_addrs] = 0;
+  *s = ++n_addrs;
+  return n_addrs-1;
+}
+
+// intern an input's address file; returns the provisional numbers of
+// its addresses
+
+static u_int32_t *load_addresses(const char *name, u_int32_t *n) {
+  FILE *file = open_arg(name);
+  u_int32_t cap = 1024, *map = malloc(cap*sizeof(u_int32_t));
+  u_char a[16];
+  if (!map)
+    die("malloc: %s\n",errstr);
+  for (*n = 0; fread(a,sizeof(a),1,file) == 1; (*n)++) {
+    if (*n == cap) {
+      cap *= 2;
+      if (!(map = realloc(map,cap*sizeof(u_int32_t))))
+        die("realloc: %s\n",errstr);
+    }
+    map[*n] = addr_intern(a);
+  }
+  if (ferror(file))
+    die("fread: %s\n",errstr);
+  fclose(file);
+  return map;
+}
+
+static u_int32_t output_addr(u_int32_t ip) {
+  if (!address_file || !IS_ADDR_REF(ip))
+    return ip;
+  u_int32_t n = ADDR_REF_INDEX(ip);
+  if (!addr_out[n]) {
+    writer_put(addresses_out,addrs[n],sizeof(addrs[n]));
+    addr_out[n] = ++addr_index;
+  }
+  return ADDR_REF(addr_out[n]-1);
+}
+
+// merged flows by 5-tuple and which of its flows they are in their
+// inputs: open addressing, at most half full. With signed sizes flows
+// are keyed from their lower (address, port) end, as parse -D keys them.
+
+typedef struct {
+  flow_record flow;    // the key
+  u_int32_t   nth;
+  u_int8_t    flip;    // whether the merged flow is reversed from it
+  u_int64_t   id;      // plus one; zero if the slot is empty
+} flow_slot;
+
+typedef struct {
+  flow_slot *slot;
+  u_int64_t  size, used;
+} flow_slots;
+
+static flow_slot *flow_slot_find(flow_slots *t, const flow_record *key,
+                                 u_int32_t nth) {
+  u_int64_t i = (flow_key_hash(key) + nth) & (t->size-1);
+  for (;; i = (i+1) & (t->size-1))
+    if (!t->slot[i].id || (t->slot[i].nth == nth &&
+        !memcmp(&t->slot[i].flow,key,sizeof(flow_record))))
+      return &t->slot[i];
+}
+
+// make room for one more
+
+static void flow_slots_grow(flow_slots *t) {
+  if (2*(t->used+1) <= t->size)
+    return;
+  flow_slot *old = t->slot;
+  u_int64_t n = t->size, i;
+  t->size = t->size ? 2*t->size : 1 << 16;
+  if (!(t->slot = calloc(t->size,sizeof(flow_slot))))
+    die("calloc: %s\n",errstr);
+  for (i = 0; i < n; i++)
+    if (old[i].id)
+      *flow_slot_find(t,&old[i].flow,old[i].nth) = old[i];
+  free(old);
+}
+
+// a flow's key; returns whether it was reversed
+
+static int merge_key(const flow_record *flow, flow_record *key) {
+  *key = *flow;
+  if (!duplex)
+    return 0;
+  u_int32_t src = ntohl(key->src_ip), dst = ntohl(key->dst_ip);
+  if (src < dst || (src == dst && ntohs(key->src_port) <= ntohs(key->dst_port)))
+    return 0;
+  reverse_flow(key);
+  return 1;
+}
+
+static u_int32_t input_addr(u_int32_t ip, const u_int32_t *map, u_int32_t n,
+                            const char *name, u_int64_t flow) {
+  if (!IS_ADDR_REF(ip))
+    return ip;
+  if (ADDR_REF_INDEX(ip) >= n)
+    die("%s: flow %llu refers to address %u, but its address file has %u.\n",
+      name,(unsigned long long) flow,ADDR_REF_INDEX(ip),n);
+  return ADDR_REF(map[ADDR_REF_INDEX(ip)]);
+}
+
+// load an input's flows, with references into its address file, if
+// any, made provisional numbers
+
+static void load_flows(input *in, const char *address_name, const char *name) {
+  u_int32_t *map = NULL, n_map = 0;
+  if (address_name)
+    map = load_addresses(address_name,&n_map);
+  FILE *file = open_arg(name);
+  file_header h;
+  if (read_file_header(file,&h) && h.type != FILE_FLOWS)
+    die("%s: not a flow file.\n",name);
+  u_int64_t cap = 1 << 16, i;
+  if (!(in->flow = malloc(cap*sizeof(flow_record))))
+    die("malloc: %s\n",errstr);
+  while (read_flow(file,&in->flow[in->flows]))
+    if (++in->flows == cap) {
+      cap *= 2;
+      if (!(in->flow = realloc(in->flow,cap*sizeof(flow_record))))
+        die("realloc: %s\n",errstr);
+    }
+  fclose(file);
+  u_int64_t n = in->flows ? in->flows : 1;
+  in->nth = malloc(n*sizeof(u_int32_t));
+  in->flip = malloc(n);
+  in->remap = malloc(n*sizeof(u_int64_t));
+  if (!in->nth || !in->flip || !in->remap)
+    die("malloc: %s\n",errstr);
+  memset(in->remap,0xff,in->flows*sizeof(u_int64_t));
+
+  // count each key's flows, in the order parse numbered them
+  flow_slots seen = { NULL, 0, 0 };
+  flow_record key;
+  for (i = 0; i < in->flows; i++) {
+    if (map) {
+      in->flow[i].src_ip = input_addr(in->flow[i].src_ip,map,n_map,name,i);
+      in->flow[i].dst_ip = input_addr(in->flow[i].dst_ip,map,n_map,name,i);
+    }
+    in->flip[i] = merge_key(&in->flow[i],&key);
+    flow_slots_grow(&seen);
+    flow_slot *s = flow_slot_find(&seen,&key,0);
+    if (!s->id) {
+      s->flow = key;
+      seen.used++;
+    }
+    in->nth[i] = s->id++;
+  }
+  free(seen.slot);
+  free(map);
+}
+
+static flow_slots table;
+static u_int64_t merged_flows;
+static record_writer *flows_out;
+
+// the merged flow of an input's flow, which is written out when new
+
+static u_int64_t merged_flow(input *in, u_int64_t flow) {
+  if (flow >= in->flows)
+    die("%s: packet of flow %llu, which isn't in its flow file.\n",
+      in->name,(unsigned long long) flow);
+  if (in->remap[flow] != NO_FLOW)
+    return in->remap[flow];
+  flow_record key;
+  merge_key(&in->flow[flow],&key);
+  flow_slots_grow(&table);
+  flow_slot *s = flow_slot_find(&table,&key,in->nth[flow]);
+  if (!s->id) {
+    s->flow = key;
+    s->nth = in->nth[flow];
+    s->flip = in->flip[flow];
+    s->id = ++merged_flows;
+    table.used++;
+    flow_record out = in->flow[flow];
+    out.src_ip = output_addr(out.src_ip);
+    out.dst_ip = output_addr(out.dst_ip);
+    write_flow(flows_out,&out);
+  }
+  in->flip[flow] ^= s->flip;
+  return in->remap[flow] = s->id - 1;
+}
+
+int main(int argc, char **argv) {
+  parse_opts(argc,argv);
+
+  int group = address_file ? 3 : flow_file ? 2 : 1;
+  int k = (argc - optind) / group, i;
+  input *in = calloc(k,sizeof(input));
+  if (!in)
+    die("calloc: %s\n",errstr);
+  int out_version = version, out_duplex = -1;
+  for (i = 0; i < k; i++) {
+    in[i].name = argv[optind + group*i + group-1];
+    in[i].file = open_arg(in[i].name);
+    file_header h;
+    read_file_header(in[i].file,&h);
+    packet_reader_init(&in[i].r,in[i].file,&h,version,COLUMN_ALL);
+    if (h.size) {
+      if (out_duplex >= 0 && out_duplex != in[i].r.duplex)
+        die("%s: packet sizes are signed in some inputs but not others.\n",
+          in[i].name);
+      out_duplex = in[i].r.duplex;
+    }
+    if (in[i].r.version == 2 || (h.size && h.type == FILE_COLUMNS))
+      out_version = 2;
+    in[i].packet.time = 0;
+    next_packet(&in[i]);
+  }
+  if (out_duplex < 0)
+    out_duplex = duplex;
+
+  // flows are keyed once it's known whether sizes are signed
+  duplex = out_duplex;
+  if (flow_file)
+    for (i = 0; i < k; i++)
+      load_flows(&in[i],address_file ? argv[optind + 3*i] : NULL,
+        argv[optind + group*i + group-2]);
+
+  file_header ph, fh;
+  file_header_init(&ph,FILE_PACKETS,out_version);
+  ph.sort_major = SORT_TIME;
+  if (out_duplex)
+    ph.flags |= FILE_DUPLEX;
+  file_header_init(&fh,FILE_FLOWS,1);
+  record_writer *packets_out = writer_open(packet_file,0);
+  if (headers)
+    write_file_header(packets_out,&ph);
+  if (flow_file) {
+    flows_out = writer_open(flow_file,0);
+    if (headers)
+      write_file_header(flows_out,&fh);
+  }
+  if (address_file)
+    addresses_out = writer_open(address_file,0);
+
+  loser_tree t;
+  loser_tree_init(&t,k,input_lt,in);
+  u_int64_t count = 0, max_flow = 0;
+  for (;;) {
+    input *top = &in[loser_tree_top(&t)];
+    if (top->done)
+      break;
+    packet_data packet = top->packet;
+    if (flow_file) {
+      u_int64_t flow = packet.flow;
+      packet.flow = merged_flow(top,flow);
+      if (top->flip[flow])
+        packet.size = -packet.size;
+    }
+    if (!count++)
+      ph.min_time = packet.time;
+    ph.max_time = packet.time;
+    if (max_flow < packet.flow)
+      max_flow = packet.flow;
+    write_packet_data(packets_out,out_version,&packet);
+    next_packet(top);
+    loser_tree_replay(&t);
+  }
+  loser_tree_free(&t);
+
+  for (i = 0; i < k; i++) {
+    u_int64_t j;
+    for (j = 0; j < in[i].flows; j++)
+      merged_flow(&in[i],j);
+    packet_reader_free(&in[i].r);
+    fclose(in[i].file);
+    free(in[i].flow);
+    free(in[i].nth);
+    free(in[i].flip);
+    free(in[i].remap);
+  }
+  writer_close(packets_out);
+
+  if (headers) {
+    ph.count = count;
+    ph.flags |= FILE_COUNT;
+    if (count) {
+      ph.max_flow = max_flow;
+      ph.flags |= FILE_TIMES | FILE_MAX_FLOW;
+    }
+    rewrite_file_header(packet_file,&ph);
+  }
+  if (flow_file) {
+    writer_close(flows_out);
+    if (headers) {
+      fh.count = merged_flows;
+      fh.flags |= FILE_COUNT;
+      if (merged_flows) {
+        fh.max_flow = merged_flows - 1;
+        fh.flags |= FILE_MAX_FLOW;
+      }
+      rewrite_file_header(flow_file,&fh);
+    }
+  }
+  if (address_file)
+    writer_close(addresses_out);
+  free(table.slot);
+  free(addrs);
+  free(addr_out);
+  free(addr_slots);
+  free(in);
+  return 0;
+}
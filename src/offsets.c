@@ -0,0 +1,241 @@
+// Random access to records, and sidecar indexes of record offsets.
+//
+// A record file is a flow or packet file opened for reading records
+// by number: plain files are mapped, and block-compressed files (see
+// blocks.c) are read through their block index.
+//
+// A flow offset index belongs to a packet file sorted by flow. It has
+// a file header of type FILE_FLOW_OFFSETS whose count is the number of
+// flows, then for each flow the number of its first packet record,
+// and finally the number of records in the packet file, all as u64s
+// in network byte-order. A flow's packets are the records from its
+// entry up to the next one.
+//
+// A time offset index belongs to a packet file sorted by time. Its
+// header has type FILE_TIME_OFFSETS, and its entries are the time and
+// number of every TIME_OFFSETS_STRIDE-th packet record, from the first,
+// then the time of the last record and the number of records; again
+// u64s in network byte-order. The first packet at or after a time is
+// at most a stride past the last entry before it.
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "common.h"
+
+// record files
+
+// only plain and block-compressed files can be read by number; other
+// compressed files and streams have to be read through
+
+record_file *record_file_open(const char *name) {
+  if (!name || !strcmp(name,"-"))
+    return NULL;
+  block_file *blocks = block_open(name);
+  if (!blocks && compressed_arg(name))
+    return NULL;
+  record_file *f = calloc(1,sizeof(record_file));
+  if (!f)
+    die("calloc: %s\n",errstr);
+  if ((f->blocks = blocks)) {
+    f->h = f->blocks->h;
+    return f;
+  }
+  int fd = open(name,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",name,errstr);
+  struct stat fs;
+  if (fstat(fd,&fs))
+    die("fstat(\"%s\"): %s\n",name,errstr);
+  if (!S_ISREG(fs.st_mode)) {
+    close(fd);
+    free(f);
+    return NULL;
+  }
+  f->size = fs.st_size;
+  if (f->size) {
+    f->map = mmap(0,f->size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (f->map == MAP_FAILED)
+      die("mmap(\"%s\"): %s\n",name,errstr);
+  }
+  close(fd);
+  f->records = f->map + file_header_parse(f->map,f->size,&f->h);
+  f->bytes = f->size - f->h.size;
+  return f;
+}
+
+u_int64_t record_count(record_file *f, size_t record_size) {
+  return f->blocks ? f->blocks->count : f->bytes / record_size;
+}
+
+void record_file_close(record_file *f) {
+  if (f->blocks)
+    block_close(f->blocks);
+  else if (f->size)
+    munmap(f->map,f->size);
+  free(f);
+}
+
+// flow offset indexes
+
+static record_writer *flow_offsets_begin(const char *path, u_int64_t flows) {
+  file_header h;
+  file_header_init(&h,FILE_FLOW_OFFSETS,1);
+  h.sort_major = SORT_FLOW;
+  h.count = flows;
+  h.flags |= FILE_COUNT;
+  if (flows) {
+    h.max_flow = flows - 1;
+    h.flags |= FILE_MAX_FLOW;
+  }
+  record_writer *w = writer_open(path,0);
+  write_file_header(w,&h);
+  return w;
+}
+
+void write_flow_offsets(const char *path, const char *packets,
+                        u_int64_t n, int version) {
+  size_t size = packet_record_size(version);
+  packet_data packet;
+  packet.flow = 0;
+  if (n)
+    packet_decode(version,packets + (n-1)*size,&packet);
+
+  record_writer *w = flow_offsets_begin(path,n ? packet.flow + 1 : 0);
+  u_int64_t i, flow = 0, x;
+  for (i = 0; i < n; i++) {
+    packet_decode(version,packets + i*size,&packet);
+    if (packet.flow + 1 < flow)
+      die("%s: packets aren't sorted by flow.\n",path);
+    for (; flow <= packet.flow; flow++) {
+      x = GUINT64_TO_BE(i);
+      writer_put(w,&x,8);
+    }
+  }
+  x = GUINT64_TO_BE(n);
+  writer_put(w,&x,8);
+  writer_close(w);
+}
+
+// from the first record of each flow and the number of records, in
+// host byte-order, as a flow sort finds them
+
+void write_flow_offset_table(const char *path, const u_int64_t *first,
+                             u_int64_t flows) {
+  record_writer *w = flow_offsets_begin(path,flows);
+  u_int64_t i, x;
+  for (i = 0; i <= flows; i++) {
+    x = GUINT64_TO_BE(first[i]);
+    writer_put(w,&x,8);
+  }
+  writer_close(w);
+}
+
+// map an index file, checking its type
+
+static char *map_index(const char *path, int type, file_header *h, size_t *size) {
+  int fd = open(path,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",path,errstr);
+  struct stat fs;
+  if (fstat(fd,&fs))
+    die("fstat(\"%s\"): %s\n",path,errstr);
+  *size = fs.st_size;
+  char *map = *size ? mmap(0,*size,PROT_READ,MAP_PRIVATE,fd,0) : MAP_FAILED;
+  if (map == MAP_FAILED)
+    die("mmap(\"%s\"): %s\n",path,errstr);
+  close(fd);
+  if (!file_header_parse(map,*size,h) || h->type != type)
+    die("%s: not a %s offset index.\n",path,
+      type == FILE_FLOW_OFFSETS ? "flow" : "time");
+  return map;
+}
+
+flow_offsets *flow_offsets_open(const char *path, u_int64_t records) {
+  flow_offsets *o = calloc(1,sizeof(flow_offsets));
+  if (!o)
+    die("calloc: %s\n",errstr);
+  file_header h;
+  o->map = map_index(path,FILE_FLOW_OFFSETS,&h,&o->size);
+  o->flows = h.count;
+  o->first = (const u_int64_t *) (o->map + h.size);
+  if (o->size < h.size + 8*(o->flows + 1))
+    die("%s: truncated flow offset index.\n",path);
+  if (GUINT64_FROM_BE(o->first[o->flows]) != records)
+    die("%s: flow offset index doesn't match its packet file.\n",path);
+  return o;
+}
+
+void flow_offsets_close(flow_offsets *o) {
+  munmap(o->map,o->size);
+  free(o);
+}
+
+// time offset indexes
+
+static inline void put_entry(record_writer *w, u_int64_t time, u_int64_t record) {
+  u_int64_t x[2] = { GUINT64_TO_BE(time), GUINT64_TO_BE(record) };
+  writer_put(w,x,sizeof(x));
+}
+
+void write_time_offsets(const char *path, const char *packets,
+                        u_int64_t n, int version) {
+  size_t size = packet_record_size(version);
+  packet_data packet;
+  file_header h;
+  file_header_init(&h,FILE_TIME_OFFSETS,1);
+  h.sort_major = SORT_TIME;
+  h.count = (n + TIME_OFFSETS_STRIDE - 1) / TIME_OFFSETS_STRIDE + 1;
+  h.flags |= FILE_COUNT;
+  if (n) {
+    packet_decode(version,packets,&packet);
+    h.min_time = packet.time;
+    packet_decode(version,packets + (n-1)*size,&packet);
+    h.max_time = packet.time;
+    h.flags |= FILE_TIMES;
+  }
+
+  record_writer *w = writer_open(path,0);
+  write_file_header(w,&h);
+  u_int64_t i;
+  for (i = 0; i < n; i += TIME_OFFSETS_STRIDE) {
+    packet_decode(version,packets + i*size,&packet);
+    put_entry(w,packet.time,i);
+  }
+  put_entry(w,h.max_time,n);
+  writer_close(w);
+}
+
+time_offsets *time_offsets_open(const char *path, u_int64_t records) {
+  time_offsets *o = calloc(1,sizeof(time_offsets));
+  if (!o)
+    die("calloc: %s\n",errstr);
+  file_header h;
+  o->map = map_index(path,FILE_TIME_OFFSETS,&h,&o->size);
+  o->entries = h.count;
+  o->entry = (const u_int64_t *) (o->map + h.size);
+  if (!o->entries || o->size < h.size + 16*o->entries)
+    die("%s: truncated time offset index.\n",path);
+  if (GUINT64_FROM_BE(o->entry[2*o->entries-1]) != records)
+    die("%s: time offset index doesn't match its packet file.\n",path);
+  return o;
+}
+
+// the range of records [lo,hi] holding the first packet at or after a
+// time, or hi itself if there's none in the range
+
+void time_offsets_find(const time_offsets *o, u_int64_t time,
+                       u_int64_t *lo, u_int64_t *hi) {
+  u_int64_t L = 0, R = o->entries; // entries before L are before time
+  while (L < R) {
+    u_int64_t M = (L + R) / 2;
+    if (GUINT64_FROM_BE(o->entry[2*M]) < time) L = M + 1; else R = M;
+  }
+  *lo = L ? GUINT64_FROM_BE(o->entry[2*(L-1)+1]) : 0;
+  *hi = GUINT64_FROM_BE(o->entry[2*(L < o->entries ? L : L-1)+1]);
+}
+
+void time_offsets_close(time_offsets *o) {
+  munmap(o->map,o->size);
+  free(o);
+}
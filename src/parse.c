@@ -1,21 +1,40 @@
 const char *usage =
   "Usage:\n"
-  "  parse [options] -f <flow file> -p <packet file> <trace files>\n"
+  "  parse [options] -f <flow file> -p <packet file> [-a <address file>]\n"
+  "        <trace files>\n"
   "\n"
-  "  Parses PCAP trace files (plain, gzipped or bzipped, detected by\n"
-  "  extension) and reads the packet header data in them, producing\n"
-  "  a flow file and a packet file for the trace data it reads.\n"
+  "  Parses PCAP and PCAPNG trace files (plain or compressed with gzip,\n"
+  "  bzip2, xz or zstd, detected by extension) and reads the packet\n"
+  "  header data in them, producing a flow file and a packet file for\n"
+  "  the trace data it reads.\n"
   "\n"
   "Options:\n"
+  "  -a <file>     Address file for IPv6 addresses (see below)\n"
   "  -F <string>   BPF filter expression for trace files\n"
   "\n"
   "  -s <integer>  Minimum packet size (default: 1)\n"
   "  -i <float>    Maximum inter-packet interval (default: infinity)\n"
+  "  -E            Keep idle flows in memory (see below)\n"
   "\n"
   "  -P            Output raw packet sizes (default)\n"
   "  -I            Output IP payload sizes\n"
   "  -T            Output transport (TCP/UDP) payload size\n"
   "  -A            Output application data size\n"
+  "  -D            Output duplex flows with signed sizes (see below)\n"
+  "  -2, --v2      Output version 2 packet records (see below)\n"
+  "  -H, --header  Start the outputs with file headers (see below)\n"
+  "\n"
+  "  -j <integer>  Number of trace files to decode in parallel\n"
+  "                (default: 1; zero means one per processor)\n"
+  "  -v            Print flow table statistics when done\n"
+  "  -O            Write output files with O_DIRECT\n"
+  "  -W, --follow  Follow the last trace file as it grows (see below)\n"
+  "\n"
+  "  -C <file>     Save a checkpoint to resume from when done\n"
+  "  -R <file>     Resume from a checkpoint, appending to the outputs\n"
+  "\n"
+  "  -S <file>     Write statistics as JSON lines (- for stderr)\n"
+  "  -U <float>    Seconds between statistics lines (default: 10)\n"
   "\n"
   "Notes:\n"
   "  - Flow and packet outputs are packed arrays of fixed-size records.\n"
@@ -26,6 +45,11 @@ const char *usage =
   "      u_int16_t src_port, dst_port;\n"
   "    Flows are implicitly indexed by their order of appearance in the\n"
   "    flow files, starting at zero.\n"
+  "  - IPv6 packets are only parsed if an address file is given with -a.\n"
+  "    It is a packed array of 16-byte addresses, IPv4 ones in IPv4-mapped\n"
+  "    form. Flow records refer to IPv6 addresses, and with -a also to\n"
+  "    IPv4 addresses in 240.0.0.0/4, by index: the index is the low 28\n"
+  "    bits of an address in 240.0.0.0/4 in the flow record.\n"
   "  - Packet records are packed structs with these members:\n"
   "      u_int32_t flow, sec, usec;\n"
   "      u_int16_t size;\n"
@@ -33,43 +57,80 @@ const char *usage =
   "    file; the sec and usec numbers are the seconds and microseconds\n"
   "    since the epoch. The size is a number of bytes, with meaning that\n"
   "    depends on which of the flags [PITA] was given.\n"
+  "  - With -2, packet records are instead:\n"
+  "      u_int64_t flow, time;\n"
+  "      u_int16_t size;\n"
+  "    where time is in nanoseconds since the epoch. These have room for\n"
+  "    more than 2^32 flows and don't roll over in 2038; convpkts converts\n"
+  "    between the two versions.\n"
+  "  - With -H, flow and packet files start with a 64-byte header giving\n"
+  "    their record type and version, record count, sort order, time\n"
+  "    range and largest flow index, which other tools read to check or\n"
+  "    skip work. Counts are filled in when parse is done; until then,\n"
+  "    as while following, the header says they are unknown.\n"
+  "  - With -D, both directions of a flow have the same flow record and\n"
+  "    index. The direction of the first packet seen of a flow, output or\n"
+  "    not (see -s), is its forward direction, given by its flow record,\n"
+  "    which is written right away; sizes of packets going the other way\n"
+  "    are negative. Sizes are thus signed 16-bit numbers, and sizes over\n"
+  "    32767 are cut to that. Zero-sized packets (see -s) are\n"
+  "    indistinguishable by direction.\n"
   "  - Packets smaller than the minimum packet size are ignored.\n"
   "  - Intervals larger than the maximum interval force further packets\n"
   "    to be considered to belong to a new flow.\n"
+  "  - With a maximum interval, flows idle for longer are dropped from\n"
+  "    memory unless -E is given. This assumes that packets are in time\n"
+  "    order, which parse warns about if they are not.\n"
+  "  - Output is identical regardless of the number of jobs: flows are\n"
+  "    indexed in order of first appearance across the trace files.\n"
+  "  - Uncompressed trace files are mapped into memory and read in place.\n"
+  "  - Trace timestamps are read at nanosecond precision, which is used\n"
+  "    for packet intervals; version 1 packet records hold microseconds.\n"
+  "  - With --follow, the last trace file, which must be uncompressed,\n"
+  "    is parsed as it is written, and outputs are flushed whenever parse\n"
+  "    waits for more of it. Following stops on SIGINT or SIGTERM, after\n"
+  "    which parse finishes its outputs and exits; a second signal kills\n"
+  "    it. The -j option can't be used with --follow.\n"
+  "  - Fragments of IP datagrams after the first have no ports; they are\n"
+  "    attributed to the flow of their first fragment if it was seen\n"
+  "    earlier in the same trace file, and to a flow with zero ports\n"
+  "    otherwise. Sizes of fragments are those of their own data.\n"
+  "  - A checkpoint holds the flow table, so that parse -R can append\n"
+  "    the flows and packets of more traces to the outputs of the run\n"
+  "    that saved it (with -C) as if the traces had been parsed together.\n"
+  "    The -i, -D, -2, -H and [PITA] options and -a must be the same in\n"
+  "    both runs; the outputs are cut back to where the checkpoint left\n"
+  "    them.\n"
+  "  - Statistics lines count packets read, their bytes, packets output\n"
+  "    and new flows, with rates since the previous line (the last line,\n"
+  "    marked final, has rates for the whole run), and packets dropped\n"
+  "    by reason. Decode seconds are summed over decoding threads and\n"
+  "    include decompress seconds, the time spent waiting for data from\n"
+  "    compressed files.\n"
 ;
 
+#include <signal.h>
+
 #include "common.h"
 
 // flow data structures
 
 typedef struct {
-  u_int32_t index;
+  u_int64_t index;
   double    last_time;
-  u_int32_t last_seqno;
+  u_int32_t last_seqno[2];        // by direction relative to the key
+  u_int16_t pins;                 // pending -j batches referring to it
+  u_int8_t  parked;               // off the wheel until unpinned
+  u_int8_t  seen : 2;             // directions with packets output
+  u_int8_t  flipped : 1;          // forward direction is the key's reverse
+  struct flow_entry *wheel_next;  // next flow in its timer wheel slot
 } flow_data;
 
-// flow hashing functions
-
-guint flow_hashf(gconstpointer a) {
-  flow_record *f = (flow_record *) a;
-  guint32 h = f->proto;
-  h = (h<<5)-h + f->src_ip;
-  h = (h<<5)-h + f->src_port;
-  h = (h<<5)-h + f->dst_ip;
-  h = (h<<5)-h + f->dst_port;
-  return h;
-}        
-         
-gint flow_equal(gconstpointer a, gconstpointer b) {
-  flow_record *x = (flow_record *) a;
-  flow_record *y = (flow_record *) b;
-  return
-    x->proto     == y->proto    &&
-    x->src_ip    == y->src_ip   &&
-    x->src_port  == y->src_port &&
-    x->dst_ip    == y->dst_ip   &&
-    x->dst_port  == y->dst_port ;
-}
+#include "slab.c"
+#include "flow_table.c"
+#include "addr_table.c"
+#include "frag_cache.c"
+#include "trace.c"
 
 // macros for parsing packet data
 
@@ -116,11 +177,6 @@ gint flow_equal(gconstpointer a, gconstpointer b) {
 #define TCP_SYN(tcp) (tcp->th_flags & TH_SYN)
 #define TCP_FIN(tcp) (tcp->th_flags & TH_FIN)
 
-// macros for allocating and copying memory
-
-#define allocate(p) ((typeof(p)) malloc(sizeof(*p)))
-#define copy(x) ((typeof(x)*) memcpy(malloc(sizeof(x)),&(x),sizeof(x)))
-
 // packet size types
 
 #define SIZE_PACKET             1
@@ -128,6 +184,1139 @@ gint flow_equal(gconstpointer a, gconstpointer b) {
 #define SIZE_TRANSPORT_PAYLOAD  4
 #define SIZE_APPLICATION_DATA   8
 
+// option globals
+
+static char *filter = NULL;
+static u_int16_t min_size = 1;
+static double max_ival = INFINITY;
+static u_int8_t size_type = SIZE_PACKET;
+static int jobs = 1;
+static int verbose = 0;
+static int direct = 0;
+static int follow = 0;
+static int duplex = 0;
+static int packet_version = 1;
+static int headers = 0;
+static file_header packet_header;
+
+// output globals
+
+static record_writer *flows;
+static record_writer *packets;
+static record_writer *addresses; // only with -a
+static u_int64_t flow_index = 0;
+static u_int64_t packet_count = 0;
+
+// interned addresses: flow table keys refer to them by provisional
+// number, which is mapped to an address file index on output
+
+static addr_table addrs;
+static GMutex addr_lock;         // for addrs, with -j
+static u_int32_t *addr_out;      // one-based file index by number
+static u_int32_t addr_out_size = 0;
+static u_int32_t addr_index = 0;
+
+// hot path counters: decoding threads count into their own set (one
+// per batch with -j), which the main thread adds to the totals
+
+typedef struct {
+  u_int64_t packets;        // read from trace files
+  u_int64_t bytes;          // their original lengths
+  u_int64_t filtered;       // dropped by -F
+  u_int64_t not_ip;         // dropped: neither IPv4 nor IPv6
+  u_int64_t ipv6_ignored;   // dropped: IPv6 without -a
+  u_int64_t unknown_proto;  // dropped: no transport size for -T or -A
+  u_int64_t too_small;      // dropped by -s
+  u_int64_t clamped;        // duplex sizes cut to DUPLEX_MAX_SIZE
+  u_int64_t output;         // written to the packet file
+  u_int64_t new_flows;      // written to the flow file
+  u_int64_t frags_matched;
+  u_int64_t frags_unmatched;
+  double    seconds;        // spent reading and decoding trace files
+} parse_counters;
+
+static parse_counters counters;
+
+static void add_counters(parse_counters *c) {
+  counters.packets         += c->packets;
+  counters.bytes           += c->bytes;
+  counters.filtered        += c->filtered;
+  counters.not_ip          += c->not_ip;
+  counters.ipv6_ignored    += c->ipv6_ignored;
+  counters.frags_matched   += c->frags_matched;
+  counters.frags_unmatched += c->frags_unmatched;
+  counters.seconds         += c->seconds;
+}
+
+// decoded packet data: everything flow accounting needs to know
+
+#define PACKET_KEEP      1 // packet may be output (still subject to -s)
+#define PACKET_TCP_DATA  2 // size is TCP payload; apply app data logic
+#define PACKET_REVERSE   4 // duplex: flow key is the packet's reversed
+
+typedef struct {
+  flow_record flow;
+  u_int32_t sec, nsec;
+  u_int32_t seqno; // last byte sequence number of TCP payload
+  u_int16_t size;
+  u_int8_t  flags;
+} packet_info;
+
+// IPv6 extension headers that may come before the transport header
+
+#define IP6_HEADER_SIZE  40
+#define IP6_HOPOPTS      0
+#define IP6_ROUTING      43
+#define IP6_FRAGMENT     44
+#define IP6_AH           51
+#define IP6_DSTOPTS      60
+
+#define L4_U16_RAW(l4,off) (*((u_int16_t*)((l4)+(off))))
+
+// decode results
+
+#define DECODE_SKIP  0
+#define DECODE_OK    1
+#define DECODE_IPV6  2 // IPv6 packet, skipped since there is no address file
+
+// with an address file, 240.0.0.0/4 addresses collide with address
+// references, so they are interned like IPv6 addresses are
+
+static inline u_int32_t intern_ip4(addr_table *at, u_int32_t ip) {
+  if (!at || !IS_ADDR_REF(ip))
+    return ip;
+  u_char a[16];
+  addr_v4_mapped(a,ip);
+  return ADDR_REF(addr_intern(at,a));
+}
+
+// decode a captured packet, interning addresses into the given table
+// (IPv6 packets are only decoded if there is one) and attributing
+// fragments to flows with the given fragment cache
+
+static int decode(int datalink_type, struct pcap_pkthdr *info,
+                  const u_char *pkt, packet_info *pi,
+                  addr_table *at, frag_cache *fc) {
+  const u_char *l3;
+  switch (datalink_type) {
+    case DLT_RAW: {
+      l3 = pkt;
+      break;
+    }
+    case DLT_EN10MB: {
+      struct ether_header *eth = (struct ether_header *) pkt;
+      if (eth->ether_type == ETHERTYPE_8021Q) // VLAN frame
+        eth = (struct ether_header *) (pkt + 4);
+      if (eth->ether_type == ETHERTYPE_8021Q) // VLAN double tagging
+        eth = (struct ether_header *) (pkt + 8);
+      if (eth->ether_type != ETHERTYPE_IP &&
+          eth->ether_type != ETHERTYPE_IPV6) return DECODE_SKIP;
+      l3 = (u_char *) eth + sizeof(*eth);
+      break;
+    }
+    // NOTE: to support a new datalink type, just add a case
+    // here that correctly extracts the IP pointer from it.
+    default:
+      die("Trace unsupported data link type %d (%s: %s).\n",
+        datalink_type,
+        pcap_datalink_val_to_name(datalink_type),
+        pcap_datalink_val_to_description(datalink_type)
+      );
+  }
+
+  u_int8_t  proto;
+  u_int32_t hdr_size, ip_size;
+  int fragment = 0, later = 0; // later fragments have no transport header
+  u_int32_t frag_id = 0;
+  if (IP_V((struct ip *) l3) == 6) {
+    if (!at) return DECODE_IPV6;
+    proto = l3[6];
+    hdr_size = IP6_HEADER_SIZE;
+    ip_size = IP6_HEADER_SIZE + ntohs(*(u_int16_t *) (l3 + 4));
+    // skip extension headers, as far as they were captured
+    const u_char *end = pkt + info->caplen;
+    for (;;) {
+      const u_char *ext = l3 + hdr_size;
+      if (ext + 8 > end) break;
+      if (proto == IP6_HOPOPTS || proto == IP6_ROUTING || proto == IP6_DSTOPTS)
+        hdr_size += 8 * (ext[1] + 1);
+      else if (proto == IP6_FRAGMENT) {
+        fragment = 1;
+        later = (ext[2] << 8 | ext[3]) & 0xfff8;
+        memcpy(&frag_id,ext+4,sizeof(frag_id));
+        hdr_size += 8;
+      }
+      else if (proto == IP6_AH)
+        hdr_size += 4 * (ext[1] + 2);
+      else
+        break;
+      proto = ext[0];
+    }
+    pi->flow.src_ip = ADDR_REF(addr_intern(at,l3 + 8));
+    pi->flow.dst_ip = ADDR_REF(addr_intern(at,l3 + 24));
+  } else {
+    struct ip *ip = (struct ip *) l3;
+    proto = ip->ip_p;
+    hdr_size = IP4_HEADER_UNIT * IP_HL(ip);
+    ip_size = IP4_SIZE(ip);
+    fragment = ntohs(ip->ip_off) & (IP_MF|IP_OFFMASK);
+    later = ntohs(ip->ip_off) & IP_OFFMASK;
+    frag_id = ip->ip_id;
+    pi->flow.src_ip = intern_ip4(at,ip->ip_src.s_addr);
+    pi->flow.dst_ip = intern_ip4(at,ip->ip_dst.s_addr);
+  }
+  const u_char *l4 = l3 + hdr_size;
+  // IPv6 extension headers may claim more than was captured; transport
+  // headers are read (as far as TRACE_SLACK) only if they start within it
+  int no_l4 = !later && l4 + 4 > pkt + info->caplen;
+
+  pi->flow.proto = proto;
+  if (later) {
+    frag_lookup(fc,&pi->flow,frag_id,info->ts.tv_sec);
+  } else if (no_l4) {
+    pi->flow.src_port = 0;
+    pi->flow.dst_port = 0;
+  } else if (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) {
+    pi->flow.src_port = L4_U16_RAW(l4,0);
+    pi->flow.dst_port = L4_U16_RAW(l4,2);
+  } else {
+    pi->flow.src_port = L4_U16_RAW(l4,0); // ICMP type & code
+    pi->flow.dst_port = L4_U16_RAW(l4,0);
+  }
+  if (fragment && !later)
+    frag_remember(fc,&pi->flow,frag_id,info->ts.tv_sec);
+  pi->sec   = info->ts.tv_sec;
+  pi->nsec  = info->ts.tv_usec; // nanoseconds: see trace.c
+  pi->seqno = 0;
+  pi->flags = PACKET_KEEP;
+
+  switch (size_type) {
+    case SIZE_PACKET:
+      pi->size = ip_size;
+      break;
+    case SIZE_IP_PAYLOAD:
+      pi->size = ip_size - hdr_size;
+      break;
+    case SIZE_TRANSPORT_PAYLOAD:
+    case SIZE_APPLICATION_DATA:
+      switch (later ? -1 : proto) {
+        case -1: // all of a later fragment is transport payload
+          if (proto != IP_PROTO_ICMP && proto != IP_PROTO_ICMPV6 &&
+              proto != IP_PROTO_UDP && proto != IP_PROTO_TCP)
+            pi->flags &= ~PACKET_KEEP;
+          pi->size = ip_size - hdr_size;
+          break;
+        case IP_PROTO_ICMP:
+        case IP_PROTO_ICMPV6:
+          pi->size = ip_size - hdr_size - ICMP_HEADER_SIZE;
+          break;
+        case IP_PROTO_UDP:
+          if (no_l4) {
+            pi->size = ip_size > hdr_size ? ip_size - hdr_size : 0;
+            break;
+          }
+          pi->size = fragment ? // the UDP length is that of the datagram
+            ip_size - hdr_size - UDP_HEADER_SIZE :
+            ntohs(L4_U16_RAW(l4,4)) - UDP_HEADER_SIZE;
+          break;
+        case IP_PROTO_TCP: {
+          if (no_l4) {
+            pi->size = ip_size > hdr_size ? ip_size - hdr_size : 0;
+            break;
+          }
+          struct tcphdr *tcp = (struct tcphdr *) l4;
+          pi->size = ip_size - hdr_size - TCP_HEADER_UNIT * TH_OFF(tcp);
+          if (size_type == SIZE_APPLICATION_DATA) {
+            // TODO: verify correctness of TCP app data logic.
+            pi->seqno = ntohl(tcp->th_seq) + pi->size;
+            if (!(tcp->th_flags & (TH_SYN|TH_FIN|TH_RST))) pi->seqno--;
+            pi->flags |= PACKET_TCP_DATA;
+          }
+          break;
+        }
+        default:
+          pi->flags &= ~PACKET_KEEP; // ignore packet
+      }
+      break;
+  }
+  return DECODE_OK;
+}
+
+// duplex flows are keyed by their direction from the lower (address,
+// port) end to the higher one; returns whether the flow was reversed
+
+static int normalize_flow(flow_record *f) {
+  u_int32_t src = ntohl(f->src_ip), dst = ntohl(f->dst_ip);
+  if (src < dst || src == dst && ntohs(f->src_port) <= ntohs(f->dst_port))
+    return 0;
+  reverse_flow(f);
+  return 1;
+}
+
+// flow table: sharded by flow hash so that decoding threads can
+// resolve the flows they see concurrently; flow indices are only
+// ever assigned by the thread writing the output, in trace order.
+
+#define NO_INDEX ((u_int64_t) -1)
+#define FLOW_SHARDS 64
+
+static int flow_shards = 1;
+static flow_table *flow_tables;
+static GMutex *flow_locks;
+
+static void flow_tables_init() {
+  int i;
+  flow_shards = jobs > 1 ? FLOW_SHARDS : 1;
+  flow_tables = calloc(flow_shards,sizeof(*flow_tables));
+  flow_locks  = calloc(flow_shards,sizeof(*flow_locks));
+  for (i = 0; i < flow_shards; i++) {
+    flow_table_init(&flow_tables[i]);
+    g_mutex_init(&flow_locks[i]);
+  }
+}
+
+static flow_entry *resolve_flow(flow_record *flow) {
+  int added;
+  u_int64_t hash = flow_hash(flow);
+  int s = FLOW_TAG(hash) % flow_shards;
+  if (jobs > 1) g_mutex_lock(&flow_locks[s]);
+  flow_entry *e = flow_table_get(&flow_tables[s],flow,hash,&added);
+  if (added) {
+    e->data.index = NO_INDEX;
+    e->data.last_time = -INFINITY;
+    e->data.last_seqno[0] = e->data.last_seqno[1] = 0;
+    e->data.pins = 0;
+    e->data.parked = 0;
+    e->data.seen = 0;
+    e->data.flipped = 0;
+    e->data.wheel_next = NULL;
+  }
+  if (jobs > 1) {
+    e->data.pins++;
+    g_mutex_unlock(&flow_locks[s]);
+  }
+  return e;
+}
+
+// idle flow eviction: with a finite maximum interval, a flow that has
+// been idle for longer than it will get a new index on its next packet
+// anyway, so it can be dropped from the flow table without changing
+// the output. Flows are kept on a timing wheel and checked lazily when
+// their slot comes up: idle ones are evicted, others are rescheduled
+// for their current deadline. A deadline is never more than one
+// interval ahead, so a single wheel covers them all. Traces must be
+// in time order for eviction not to affect flow numbering, so parse
+// warns if packet times go backwards.
+
+#define WHEEL_SLOTS 256
+#define WHEEL_TICKS 64 // ticks per maximum interval
+
+static int keep_idle = 0;
+static int evicting = 0;
+static double wheel_tick;
+static double wheel_clock = -INFINITY;
+static long long wheel_now;
+static flow_entry *wheel[WHEEL_SLOTS];
+static u_int64_t evicted = 0;
+static double backwards = 0;
+
+static void wheel_schedule(flow_entry *e, double from) {
+  long long tick = (long long) floor((from + max_ival) / wheel_tick) + 1;
+  if (tick <= wheel_now)
+    tick = wheel_now + 1;
+  if (tick >= wheel_now + WHEEL_SLOTS)
+    tick = wheel_now + WHEEL_SLOTS - 1;
+  flow_entry **slot = &wheel[tick % WHEEL_SLOTS];
+  e->data.wheel_next = *slot;
+  *slot = e;
+}
+
+// flows referred to by pending -j batches can't be evicted; they are
+// parked off the wheel and reconsidered once no longer pinned
+
+static void wheel_evict(flow_entry *e) {
+  u_int64_t hash = flow_hash(&e->key);
+  int s = FLOW_TAG(hash) % flow_shards;
+  if (jobs > 1) g_mutex_lock(&flow_locks[s]);
+  if (e->data.pins) {
+    e->data.parked = 1;
+  } else {
+    flow_table_remove(&flow_tables[s],&e->key,hash);
+    evicted++;
+  }
+  if (jobs > 1) g_mutex_unlock(&flow_locks[s]);
+}
+
+static void unpin_flow(flow_entry *e) {
+  int s = FLOW_TAG(flow_hash(&e->key)) % flow_shards;
+  g_mutex_lock(&flow_locks[s]);
+  int parked = !--e->data.pins && e->data.parked;
+  e->data.parked = 0;
+  g_mutex_unlock(&flow_locks[s]);
+  if (parked) {
+    if (wheel_clock - e->data.last_time > max_ival)
+      wheel_evict(e);
+    else
+      wheel_schedule(e,e->data.last_time);
+  }
+}
+
+// advance the wheel to a packet's time, before resolving its flow
+
+static void wheel_advance(double time) {
+  if (time <= wheel_clock) {
+    if (wheel_clock - time > backwards)
+      backwards = wheel_clock - time;
+    return;
+  }
+  long long now = (long long) floor(time / wheel_tick);
+  if (wheel_clock == -INFINITY)
+    wheel_now = now;
+  wheel_clock = time;
+  if (now <= wheel_now)
+    return;
+
+  // collect due flows first: they may be rescheduled
+  flow_entry *due = NULL;
+  long long tick, last = now - wheel_now < WHEEL_SLOTS ? now : wheel_now + WHEEL_SLOTS;
+  for (tick = wheel_now + 1; tick <= last; tick++) {
+    flow_entry **slot = &wheel[tick % WHEEL_SLOTS];
+    while (*slot) {
+      flow_entry *e = *slot;
+      *slot = e->data.wheel_next;
+      e->data.wheel_next = due;
+      due = e;
+    }
+  }
+  wheel_now = now;
+  while (due) {
+    flow_entry *e = due;
+    due = e->data.wheel_next;
+    if (wheel_clock - e->data.last_time > max_ival)
+      wheel_evict(e);
+    else
+      wheel_schedule(e,e->data.last_time);
+  }
+}
+
+// output a flow record, numbering the addresses it refers to in
+// order of first output so that address files are deterministic
+
+static u_int32_t output_addr(u_int32_t ip) {
+  if (!addresses || !IS_ADDR_REF(ip))
+    return ip;
+  u_int32_t n = ADDR_REF_INDEX(ip);
+  if (n >= addr_out_size) {
+    u_int32_t size = addr_out_size ? addr_out_size : 1024;
+    while (size <= n) size *= 2;
+    if (!(addr_out = realloc(addr_out,size*sizeof(*addr_out))))
+      die("realloc: %s\n",errstr);
+    memset(addr_out+addr_out_size,0,(size-addr_out_size)*sizeof(*addr_out));
+    addr_out_size = size;
+  }
+  if (!addr_out[n]) {
+    if (jobs > 1) g_mutex_lock(&addr_lock);
+    writer_put(addresses,addrs.addrs[n].a,sizeof(addr_entry));
+    if (jobs > 1) g_mutex_unlock(&addr_lock);
+    addr_out[n] = ++addr_index;
+  }
+  return ADDR_REF(addr_out[n]-1);
+}
+
+static void output_flow(flow_record *flow, int flipped) {
+  flow_record out = *flow;
+  if (flipped)
+    reverse_flow(&out);
+  out.src_ip = output_addr(out.src_ip);
+  out.dst_ip = output_addr(out.dst_ip);
+  write_flow(flows,&out);
+}
+
+// assign flow indices and output a decoded packet; in duplex mode,
+// both directions of a flow share a flow table entry and index, and
+// the direction of a flow's first packet is output as its forward one
+
+#define DUPLEX_MAX_SIZE 32767
+
+static void account(flow_entry *e, packet_info *pi) {
+  flow_data *fd = &e->data;
+  int dir = pi->flags & PACKET_REVERSE ? 1 : 0;
+  double time = pi->sec + pi->nsec*1e-9;
+  double ival = fd->index != NO_INDEX ? time - fd->last_time : INFINITY;
+  if (fd->index == NO_INDEX || ival > max_ival) {
+    if (evicting && fd->index == NO_INDEX)
+      wheel_schedule(e,time);
+    fd->index = flow_index++;
+    fd->last_time = -INFINITY;
+    fd->last_seqno[0] = fd->last_seqno[1] = 0;
+    fd->seen = 0;
+    fd->flipped = dir; // first seen direction is forward
+    output_flow(&e->key,fd->flipped);
+    counters.new_flows++;
+  }
+  if (!(pi->flags & PACKET_KEEP)) {
+    counters.unknown_proto++;
+    return; // ignore packet
+  }
+
+  u_int16_t size = pi->size;
+  if (pi->flags & PACKET_TCP_DATA) {
+    u_int32_t last_byte_seqno = pi->seqno;
+    u_int32_t *last_seqno = &fd->last_seqno[dir];
+    if (!(fd->seen & (1 << dir))) {
+      *last_seqno = last_byte_seqno;
+    } else // regular follow-up packet
+    if (size + TCP_MAX_SKIP >= last_byte_seqno - *last_seqno) {
+      size = last_byte_seqno - *last_seqno;
+      *last_seqno = last_byte_seqno;
+    } else // possible seqno wrap-around
+    if (size + TCP_MAX_SKIP >= last_byte_seqno + abs(*last_seqno)) {
+      // FIXME: this seems questionable.
+      size = last_byte_seqno + abs(*last_seqno);
+      *last_seqno = last_byte_seqno;
+    } else { // out-of-order packet, no new data.
+      size = 0;
+    }
+  }
+  if (size < min_size) {
+    counters.too_small++;
+    return; // ignore packet
+  }
+
+  u_int32_t sec = pi->sec, nsec = pi->nsec;
+  if (nsec >= 1000000000) {
+    sec += nsec / 1000000000;
+    nsec = nsec % 1000000000;
+  }
+  if (duplex) { // sizes are signed by direction
+    if (size > DUPLEX_MAX_SIZE) {
+      size = DUPLEX_MAX_SIZE;
+      counters.clamped++;
+    }
+    if (dir != fd->flipped)
+      size = -size;
+  }
+  packet_data packet = {
+    fd->index, sec*NSEC_PER_SEC + nsec, size
+  };
+  write_packet_data(packets,packet_version,&packet);
+  if (headers)
+    file_header_add(&packet_header,&packet);
+  packet_count++;
+  counters.output++;
+
+  fd->last_time = time;
+  fd->seen |= 1 << dir;
+}
+
+// statistics reports: JSON objects, one per line, written every few
+// seconds while parsing and once more at the end. Rates are over the
+// time since the previous report, or the whole run for the last one.
+
+#define STATS_POLL_MASK 0xffff // packets between looks at the clock
+
+static FILE *stats = NULL;
+static double stats_interval = 10;
+static double stats_start;
+static double stats_next;
+static double stats_last_time;
+static parse_counters stats_last;
+
+static void report_stats(int final) {
+  double now = monotonic_time();
+  parse_counters none = {0}, *l = final ? &none : &stats_last;
+  double dt = now - (final ? stats_start : stats_last_time);
+  if (dt <= 0) dt = 1e-9;
+
+  u_int64_t count = 0, lookups = 0, probes = 0, max_probes = 0;
+  int s;
+  for (s = 0; s < flow_shards; s++) {
+    flow_table *t = &flow_tables[s];
+    if (jobs > 1) g_mutex_lock(&flow_locks[s]);
+    count   += t->count;
+    lookups += t->lookups;
+    probes  += t->probes;
+    if (t->max_probes > max_probes)
+      max_probes = t->max_probes;
+    if (jobs > 1) g_mutex_unlock(&flow_locks[s]);
+  }
+  u_int64_t decompressed;
+  double decompress_seconds;
+  decompress_totals(&decompressed,&decompress_seconds);
+
+  parse_counters *c = &counters;
+#define ull(x) ((unsigned long long) (x))
+  fprintf(stats,
+    "{\"final\":%s,\"elapsed\":%.3f,"
+    "\"packets\":%llu,\"bytes\":%llu,\"output\":%llu,\"new_flows\":%llu,"
+    "\"packets_per_sec\":%.1f,\"bytes_per_sec\":%.1f,\"new_flows_per_sec\":%.1f,"
+    "\"drops\":{\"filtered\":%llu,\"not_ip\":%llu,\"ipv6_ignored\":%llu,"
+      "\"unknown_proto\":%llu,\"too_small\":%llu},\"clamped\":%llu,"
+    "\"fragments\":{\"attributed\":%llu,\"unattributed\":%llu},"
+    "\"flow_table\":{\"flows\":%llu,\"lookups\":%llu,"
+      "\"mean_probes\":%.3f,\"max_probes\":%llu},"
+    "\"seconds\":{\"decode\":%.3f,\"decompress\":%.3f},"
+    "\"decompressed_bytes\":%llu}\n",
+    final ? "true" : "false", now - stats_start,
+    ull(c->packets), ull(c->bytes), ull(c->output), ull(c->new_flows),
+    (c->packets - l->packets) / dt, (c->bytes - l->bytes) / dt,
+    (c->new_flows - l->new_flows) / dt,
+    ull(c->filtered), ull(c->not_ip), ull(c->ipv6_ignored),
+    ull(c->unknown_proto), ull(c->too_small),
+    ull(c->clamped),
+    ull(c->frags_matched), ull(c->frags_unmatched),
+    ull(count), ull(lookups), lookups ? (double) probes / lookups : 0.0,
+    ull(max_probes),
+    c->seconds, decompress_seconds,
+    ull(decompressed)
+  );
+#undef ull
+  fflush(stats);
+  stats_last = counters;
+  stats_last_time = now;
+  stats_next = now + stats_interval;
+}
+
+static void stats_poll() {
+  if (stats && monotonic_time() >= stats_next)
+    report_stats(0);
+}
+
+// follow mode: outputs are flushed whenever parse waits for the
+// followed trace to grow, until a signal tells it to stop
+
+static volatile sig_atomic_t following = 1;
+
+static void stop_following(int sig) {
+  following = 0;
+  signal(sig,SIG_DFL);
+}
+
+static int follow_idle(void) {
+  if (addresses)
+    writer_flush(addresses);
+  writer_flush(flows);
+  writer_flush(packets);
+  stats_poll();
+  return following;
+}
+
+// decode a trace's packets into a set of counters
+
+static inline int decode_counted(trace *t, struct pcap_pkthdr *info,
+                                 const u_char *pkt, packet_info *pi,
+                                 addr_table *at, frag_cache *fc,
+                                 parse_counters *c) {
+  c->packets++;
+  c->bytes += info->len;
+  int r = decode(t->linktype,info,pkt,pi,at,fc);
+  if (r == DECODE_SKIP) c->not_ip++;
+  if (r == DECODE_IPV6) c->ipv6_ignored++;
+  return r == DECODE_OK;
+}
+
+// move what a trace and fragment cache counted since the last time,
+// and the time since then, into a set of counters
+
+static void trace_counted(trace *t, frag_cache *fc, double *since,
+                          parse_counters *c) {
+  double now = monotonic_time();
+  c->filtered += t->rejected;
+  c->frags_matched += fc->matched;
+  c->frags_unmatched += fc->unmatched;
+  c->seconds += now - *since;
+  t->rejected = fc->matched = fc->unmatched = 0;
+  *since = now;
+}
+
+// serially parse a trace file, following it if given an idle function
+
+static void parse_trace(const char *arg, trace_idle idle) {
+  double start = monotonic_time();
+  trace *t = trace_open(arg,filter,idle);
+  if (!t) return;
+  frag_cache frags = {0};
+  parse_counters c = {0};
+
+  const u_char *pkt;
+  struct pcap_pkthdr info;
+  while (pkt = trace_next(t,&info)) {
+    packet_info pi;
+    int ok = decode_counted(t,&info,pkt,&pi,addresses ? &addrs : NULL,&frags,&c);
+    if (stats && !(c.packets & STATS_POLL_MASK)) {
+      // keep the totals current for periodic reports
+      trace_counted(t,&frags,&start,&c);
+      add_counters(&c);
+      memset(&c,0,sizeof(c));
+      stats_poll();
+    }
+    if (!ok) continue;
+    if (duplex && normalize_flow(&pi.flow))
+      pi.flags |= PACKET_REVERSE;
+    if (evicting) wheel_advance(pi.sec + pi.nsec*1e-9);
+    account(resolve_flow(&pi.flow),&pi);
+  }
+  trace_counted(t,&frags,&start,&c);
+  add_counters(&c);
+  trace_close(t);
+  frag_cache_free(&frags);
+}
+
+// parallel parsing: worker threads decode trace files into batches of
+// at most BATCH_BLOCKS blocks of packets, which the main thread accounts
+// for in argument order, so output is identical to that of a serial
+// run. Only so many batches are in flight at once, however large the
+// trace files are.
+
+#define BATCH_BLOCK  65536
+#define BATCH_BLOCKS 16
+#define MAX_BATCHES  (2*jobs) // in flight, besides ones being decoded
+
+typedef struct {
+  u_int32_t flow; // local index of the flow within the batch
+  u_int32_t sec, nsec;
+  u_int32_t seqno;
+  u_int16_t size;
+  u_int8_t  flags;
+} batch_packet;
+
+typedef struct batch_block {
+  struct batch_block *next;
+  u_int32_t n;
+  batch_packet packets[BATCH_BLOCK];
+} batch_block;
+
+typedef struct batch {
+  struct batch *next; // of the same trace
+  int last;           // of its trace
+  arena mem; // holds everything below; released once output
+  u_int32_t n_flows, n_blocks;
+  flow_entry **flows; // shared flow table entries by local index
+  u_int8_t *flipped;  // whether shared keys are reversed local ones
+  batch_block *first, *last_block;
+  parse_counters counters;
+} batch;
+
+static char **traces;
+static int n_traces;
+static batch **batches, **batch_tails; // queued per trace
+static int next_trace = 0;
+static int done_trace = 0;
+static int batches_queued = 0;
+
+static GMutex batch_lock;
+static GCond batch_cond;
+
+// map a reference into a trace's own address table to the shared one
+
+static u_int32_t global_addr(addr_table *local, u_int32_t ip) {
+  if (!IS_ADDR_REF(ip))
+    return ip;
+  g_mutex_lock(&addr_lock);
+  u_int32_t n = addr_intern(&addrs,local->addrs[ADDR_REF_INDEX(ip)].a);
+  g_mutex_unlock(&addr_lock);
+  return ADDR_REF(n);
+}
+
+// resolve a batch's local flows against the shared flow table and queue
+// it for output; local entries are never freed, so slots follow local
+// index order. The batch at the head of the output always gets queued,
+// so that the main thread can make progress.
+
+static void queue_batch(int t, batch *b, flow_table *local,
+                        addr_table *local_addrs) {
+  u_int32_t f;
+  b->flows = arena_alloc(&b->mem,b->n_flows*sizeof(*b->flows));
+  b->flipped = arena_alloc(&b->mem,b->n_flows*sizeof(*b->flipped));
+  for (f = 0; f < b->n_flows; f++) {
+    flow_record *key = &flow_table_entry(local,f+1)->key;
+    b->flipped[f] = 0;
+    if (addresses) {
+      key->src_ip = global_addr(local_addrs,key->src_ip);
+      key->dst_ip = global_addr(local_addrs,key->dst_ip);
+      // the order of addresses may differ between numberings
+      if (duplex)
+        b->flipped[f] = normalize_flow(key);
+    }
+    b->flows[f] = resolve_flow(key);
+  }
+
+  g_mutex_lock(&batch_lock);
+  while (batches_queued >= MAX_BATCHES && !(t == done_trace && !batches[t]))
+    g_cond_wait(&batch_cond,&batch_lock);
+  if (batches[t])
+    batch_tails[t]->next = b;
+  else
+    batches[t] = b;
+  batch_tails[t] = b;
+  batches_queued++;
+  g_cond_broadcast(&batch_cond);
+  g_mutex_unlock(&batch_lock);
+}
+
+static void decode_trace(int i) {
+  double start = monotonic_time();
+  trace *t = trace_open(traces[i],filter,NULL);
+
+  batch *b = calloc(1,sizeof(batch));
+  flow_table local;
+  flow_table_init(&local);
+  addr_table local_addrs;
+  if (addresses)
+    addr_table_init(&local_addrs);
+  frag_cache frags = {0};
+
+  const u_char *pkt;
+  struct pcap_pkthdr info;
+  while (pkt = trace_next(t,&info)) {
+    packet_info pi;
+    if (!decode_counted(t,&info,pkt,&pi,addresses ? &local_addrs : NULL,
+                        &frags,&b->counters))
+      continue;
+    if (duplex && normalize_flow(&pi.flow))
+      pi.flags |= PACKET_REVERSE;
+
+    if (!b->last_block || b->last_block->n == BATCH_BLOCK) {
+      if (b->n_blocks == BATCH_BLOCKS) {
+        queue_batch(i,b,&local,addresses ? &local_addrs : NULL);
+        flow_table_free(&local);
+        flow_table_init(&local);
+        if (!(b = calloc(1,sizeof(batch))))
+          die("calloc: %s\n",errstr);
+      }
+      batch_block *block = arena_alloc(&b->mem,sizeof(batch_block));
+      block->next = NULL;
+      block->n = 0;
+      if (b->last_block)
+        b->last_block->next = block;
+      else
+        b->first = block;
+      b->last_block = block;
+      b->n_blocks++;
+    }
+
+    // local flow indices number the flows of this batch
+    int added;
+    flow_entry *le = flow_table_get(&local,&pi.flow,flow_hash(&pi.flow),&added);
+    if (added)
+      le->data.index = b->n_flows++;
+
+    batch_packet *bp = &b->last_block->packets[b->last_block->n++];
+    bp->flow  = le->data.index;
+    bp->sec   = pi.sec;
+    bp->nsec  = pi.nsec;
+    bp->seqno = pi.seqno;
+    bp->size  = pi.size;
+    bp->flags = pi.flags;
+  }
+  trace_counted(t,&frags,&start,&b->counters);
+  trace_close(t);
+  frag_cache_free(&frags);
+
+  b->last = 1;
+  queue_batch(i,b,&local,addresses ? &local_addrs : NULL);
+  flow_table_free(&local);
+  if (addresses)
+    addr_table_free(&local_addrs);
+}
+
+static gpointer decode_worker(gpointer unused) {
+  for (;;) {
+    g_mutex_lock(&batch_lock);
+    // don't get more than a few traces ahead of the output
+    while (next_trace < n_traces && next_trace >= done_trace + 2*jobs)
+      g_cond_wait(&batch_cond,&batch_lock);
+    int t = next_trace++;
+    g_mutex_unlock(&batch_lock);
+    if (t >= n_traces) return NULL;
+
+    fprintf(stderr,"parsing %s...\n",traces[t]);
+    decode_trace(t);
+  }
+}
+
+static void parse_traces_parallel() {
+  int i, last = 0;
+  batches = calloc(n_traces,sizeof(*batches));
+  batch_tails = calloc(n_traces,sizeof(*batch_tails));
+  GThread **threads = calloc(jobs,sizeof(*threads));
+  if (!batches || !batch_tails || !threads)
+    die("calloc: %s\n",errstr);
+  for (i = 0; i < jobs; i++)
+    threads[i] = g_thread_new("decode",decode_worker,NULL);
+
+  for (i = 0; i < n_traces; ) {
+    g_mutex_lock(&batch_lock);
+    while (!batches[i])
+      g_cond_wait(&batch_cond,&batch_lock);
+    batch *b = batches[i];
+    batches[i] = b->next;
+    batches_queued--;
+    g_cond_broadcast(&batch_cond);
+    g_mutex_unlock(&batch_lock);
+
+    batch_block *block;
+    for (block = b->first; block; block = block->next) {
+      u_int32_t j;
+      for (j = 0; j < block->n; j++) {
+        batch_packet *bp = &block->packets[j];
+        packet_info pi = {
+          .sec   = bp->sec,
+          .nsec  = bp->nsec,
+          .seqno = bp->seqno,
+          .size  = bp->size,
+          .flags = bp->flags,
+        };
+        if (b->flipped[bp->flow])
+          pi.flags ^= PACKET_REVERSE;
+        if (evicting) wheel_advance(pi.sec + pi.nsec*1e-9);
+        account(b->flows[bp->flow],&pi);
+        if (stats && !(j & STATS_POLL_MASK))
+          stats_poll();
+      }
+    }
+    u_int32_t f;
+    for (f = 0; f < b->n_flows; f++)
+      unpin_flow(b->flows[f]);
+    add_counters(&b->counters);
+    last = b->last;
+    arena_reset(&b->mem);
+    free(b);
+
+    if (last) {
+      g_mutex_lock(&batch_lock);
+      done_trace++;
+      g_cond_broadcast(&batch_cond);
+      g_mutex_unlock(&batch_lock);
+      i++;
+    }
+  }
+  for (i = 0; i < jobs; i++)
+    g_thread_join(threads[i]);
+  free(threads);
+  free(batches);
+  free(batch_tails);
+}
+
+// file headers of the outputs: counts are only known when done
+
+static void update_headers(const char *flow_file, const char *packet_file, int done) {
+  file_header flow_header;
+  file_header_init(&flow_header,FILE_FLOWS,1);
+  packet_header.flags &= ~FILE_COUNT;
+  if (done) {
+    flow_header.count = flow_index;
+    flow_header.max_flow = flow_index-1;
+    flow_header.flags = FILE_COUNT | (flow_index ? FILE_MAX_FLOW : 0);
+    packet_header.flags |= FILE_COUNT;
+  }
+  rewrite_file_header(flow_file,&flow_header);
+  rewrite_file_header(packet_file,&packet_header);
+}
+
+// checkpoints: the state needed to parse more traces later, appending
+// to the same outputs as if all traces had been parsed in one run. A
+// checkpoint file is a header of big-endian 64-bit fields followed by
+// a record for every flow in the flow table, in flow index order, with
+// flow keys as in the flow file.
+
+#define CHECKPOINT_MAGIC "ttckpt04"
+
+typedef struct {
+  char      magic[8];
+  u_int64_t size_type;
+  u_int64_t max_ival;   // bits of a double
+  u_int64_t addresses;  // whether there is an address file
+  u_int64_t duplex;
+  u_int64_t version;    // of packet records
+  u_int64_t headers;    // whether the outputs have file headers
+  u_int64_t flows;      // records in the outputs
+  u_int64_t packets;
+  u_int64_t addrs;
+  u_int64_t clock;      // bits of a double: time of the wheel clock
+  u_int64_t n_flows;    // flow records that follow
+  char      packet_header[FILE_HEADER_SIZE]; // as it will be written
+} checkpoint_header;
+
+struct checkpoint_flow {
+  flow_record key;
+  u_int64_t   index;
+  u_int32_t   last_seqno[2];
+  u_int64_t   last_time; // bits of a double
+  u_int8_t    seen;
+  u_int8_t    flipped;
+} __attribute__((packed));
+
+static inline u_int64_t double_bits(double x) {
+  u_int64_t b;
+  memcpy(&b,&x,sizeof(b));
+  return GUINT64_TO_BE(b);
+}
+
+static inline double bits_double(u_int64_t b) {
+  double x;
+  b = GUINT64_FROM_BE(b);
+  memcpy(&x,&b,sizeof(x));
+  return x;
+}
+
+static void collect_flow(flow_entry *e, void *arg) {
+  flow_entry ***p = arg;
+  if (e->data.index != NO_INDEX)
+    *(*p)++ = e;
+}
+
+static int by_index(const void *x, const void *y) {
+  u_int64_t a = (*(flow_entry **) x)->data.index;
+  u_int64_t b = (*(flow_entry **) y)->data.index;
+  return a < b ? -1 : a > b;
+}
+
+// flow table keys refer to addresses by provisional number
+
+static inline u_int32_t checkpoint_addr(u_int32_t ip) {
+  return addresses && IS_ADDR_REF(ip) ?
+    ADDR_REF(addr_out[ADDR_REF_INDEX(ip)]-1) : ip;
+}
+
+static void save_checkpoint(const char *path) {
+  int s;
+  u_int64_t n = 0, i;
+  for (s = 0; s < flow_shards; s++)
+    n += flow_tables[s].count;
+  flow_entry **entries = malloc(n*sizeof(*entries)), **p = entries;
+  if (n && !entries)
+    die("malloc: %s\n",errstr);
+  for (s = 0; s < flow_shards; s++)
+    flow_table_each(&flow_tables[s],collect_flow,&p);
+  n = p - entries;
+  qsort(entries,n,sizeof(*entries),by_index);
+
+  checkpoint_header h = {
+    CHECKPOINT_MAGIC,
+    GUINT64_TO_BE((u_int64_t) size_type),
+    double_bits(max_ival),
+    GUINT64_TO_BE((u_int64_t) (addresses != NULL)),
+    GUINT64_TO_BE((u_int64_t) duplex),
+    GUINT64_TO_BE((u_int64_t) packet_version),
+    GUINT64_TO_BE((u_int64_t) headers),
+    GUINT64_TO_BE((u_int64_t) flow_index),
+    GUINT64_TO_BE(packet_count),
+    GUINT64_TO_BE((u_int64_t) addr_index),
+    double_bits(wheel_clock),
+    GUINT64_TO_BE(n),
+  };
+  file_header_encode(&packet_header,h.packet_header);
+  // write a new file and rename it, so a crash leaves the old one
+  char *tmp = malloc(strlen(path)+5);
+  sprintf(tmp,"%s.tmp",path);
+  record_writer *w = writer_open(tmp,0);
+  writer_put(w,&h,sizeof(h));
+  for (i = 0; i < n; i++) {
+    flow_entry *e = entries[i];
+    struct checkpoint_flow f = {
+      e->key,
+      GUINT64_TO_BE(e->data.index),
+      { htonl(e->data.last_seqno[0]), htonl(e->data.last_seqno[1]) },
+      double_bits(e->data.last_time),
+      e->data.seen,
+      e->data.flipped,
+    };
+    f.key.src_ip = checkpoint_addr(f.key.src_ip);
+    f.key.dst_ip = checkpoint_addr(f.key.dst_ip);
+    writer_put(w,&f,sizeof(f));
+  }
+  writer_close(w);
+  if (rename(tmp,path))
+    die("rename(\"%s\",\"%s\"): %s\n",tmp,path,errstr);
+  free(tmp);
+  free(entries);
+}
+
+// load a checkpoint, reopening the outputs to append to them
+
+static void load_checkpoint(const char *path, const char *flow_file,
+                            const char *packet_file, const char *address_file) {
+  FILE *file = fopen(path,"r");
+  if (!file)
+    die("fopen(\"%s\"): %s\n",path,errstr);
+  checkpoint_header h;
+  if (fread(&h,sizeof(h),1,file) != 1 ||
+      memcmp(h.magic,CHECKPOINT_MAGIC,sizeof(h.magic)))
+    die("%s: not a checkpoint file.\n",path);
+  if (GUINT64_FROM_BE(h.size_type) != size_type ||
+      h.max_ival != double_bits(max_ival))
+    die("%s: checkpoint was made with different -i or [PITA] options.\n",path);
+  if (GUINT64_FROM_BE(h.version) != packet_version)
+    die("%s: checkpoint was made with version %llu packet records.\n",
+      path,(unsigned long long) GUINT64_FROM_BE(h.version));
+  if (GUINT64_FROM_BE(h.headers) != headers)
+    die("%s: checkpoint was made %s -H.\n",path,headers ? "without" : "with");
+  if (GUINT64_FROM_BE(h.duplex) != duplex)
+    die("%s: checkpoint was made %s -D.\n",path,duplex ? "without" : "with");
+  if (GUINT64_FROM_BE(h.addresses) != (address_file != NULL))
+    die("%s: checkpoint was made %s an address file.\n",path,
+      address_file ? "without" : "with");
+
+  flow_index = GUINT64_FROM_BE(h.flows);
+  packet_count = GUINT64_FROM_BE(h.packets);
+  size_t header_size = headers ? FILE_HEADER_SIZE : 0;
+  flows = writer_append(flow_file,direct,
+    header_size + flow_index*sizeof(flow_record));
+  packets = writer_append(packet_file,direct,
+    header_size + packet_count*packet_record_size(packet_version));
+  file_header_parse(h.packet_header,FILE_HEADER_SIZE,&packet_header);
+  if (headers)
+    update_headers(flow_file,packet_file,0);
+
+  // addresses are numbered as in the address file
+  if (address_file) {
+    u_int32_t n = GUINT64_FROM_BE(h.addrs), i;
+    FILE *af = fopen(address_file,"r");
+    if (!af)
+      die("fopen(\"%s\"): %s\n",address_file,errstr);
+    addr_table_init(&addrs);
+    addr_out_size = MAX(n,1);
+    if (!(addr_out = calloc(addr_out_size,sizeof(*addr_out))))
+      die("calloc: %s\n",errstr);
+    for (i = 0; i < n; i++) {
+      u_char a[16];
+      if (fread(a,sizeof(a),1,af) != 1)
+        die("%s: file is shorter than expected.\n",address_file);
+      addr_intern(&addrs,a);
+      addr_out[i] = i+1;
+    }
+    fclose(af);
+    addr_index = n;
+    addresses = writer_append(address_file,direct,n*sizeof(addr_entry));
+  }
+
+  double clock = bits_double(h.clock);
+  if (evicting && isfinite(clock)) {
+    wheel_clock = clock;
+    wheel_now = (long long) floor(clock / wheel_tick);
+  }
+  u_int64_t n = GUINT64_FROM_BE(h.n_flows), i;
+  for (i = 0; i < n; i++) {
+    struct checkpoint_flow f;
+    if (fread(&f,sizeof(f),1,file) != 1)
+      die("%s: truncated checkpoint file.\n",path);
+    // duplex keys are ordered by address numbers, which may change
+    int r = duplex && normalize_flow(&f.key);
+    flow_entry *e = resolve_flow(&f.key);
+    e->data.index = GUINT64_FROM_BE(f.index);
+    e->data.last_seqno[r] = ntohl(f.last_seqno[0]);
+    e->data.last_seqno[!r] = ntohl(f.last_seqno[1]);
+    e->data.last_time = bits_double(f.last_time);
+    e->data.seen = r ? (f.seen & 1) << 1 | (f.seen & 2) >> 1 : f.seen;
+    e->data.flipped = f.flipped ^ r;
+    e->data.pins = 0; // no batches yet
+    if (evicting && isfinite(clock))
+      wheel_schedule(e,e->data.last_time);
+  }
+  fclose(file);
+}
+
 // main processing loop
 
 int main(int argc, char ** argv) {
@@ -135,15 +1324,41 @@ int main(int argc, char ** argv) {
   // option variables
   char *flow_file = NULL;
   char *packet_file = NULL;
+  char *address_file = NULL;
+  char *checkpoint_file = NULL;
+  char *resume_file = NULL;
+  char *stats_file = NULL;
 
-  char *filter = NULL;
-  u_int16_t min_size = 1;
-  double max_ival = INFINITY;
-  u_int8_t size_type = SIZE_PACKET;
+  static struct option longopts[] = {
+    { "flows",          required_argument, 0, 'f' },
+    { "packets",        required_argument, 0, 'p' },
+    { "addresses",      required_argument, 0, 'a' },
+    { "filter",         required_argument, 0, 'F' },
+    { "min-size",       required_argument, 0, 's' },
+    { "max-interval",   required_argument, 0, 'i' },
+    { "keep-idle",      no_argument,       0, 'E' },
+    { "packet-size",    no_argument,       0, 'P' },
+    { "ip-payload",     no_argument,       0, 'I' },
+    { "transport-size", no_argument,       0, 'T' },
+    { "app-data",       no_argument,       0, 'A' },
+    { "jobs",           required_argument, 0, 'j' },
+    { "verbose",        no_argument,       0, 'v' },
+    { "direct",         no_argument,       0, 'O' },
+    { "follow",         no_argument,       0, 'W' },
+    { "duplex",         no_argument,       0, 'D' },
+    { "v2",             no_argument,       0, '2' },
+    { "header",         no_argument,       0, 'H' },
+    { "checkpoint",     required_argument, 0, 'C' },
+    { "resume",         required_argument, 0, 'R' },
+    { "stats",          required_argument, 0, 'S' },
+    { "stats-interval", required_argument, 0, 'U' },
+    { "help",           no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
 
   // parse options, leave arguments
   int i;
-  while ((i = getopt(argc,argv,"f:p:F:s:i:PITAh")) != -1) {
+  while ((i = getopt_long(argc,argv,"f:p:a:F:s:i:EPITAD2Hj:vOWC:R:S:U:h",longopts,0)) != -1) {
     switch (i) {
       case 'f':
         flow_file = optarg;
@@ -151,6 +1366,9 @@ int main(int argc, char ** argv) {
       case 'p':
         packet_file = optarg;
         break;
+      case 'a':
+        address_file = optarg;
+        break;
 
       case 'F':
         filter = optarg;
@@ -176,6 +1394,51 @@ int main(int argc, char ** argv) {
         size_type = SIZE_APPLICATION_DATA;
         break;
 
+      case 'j':
+        jobs = atoi(optarg);
+        if (jobs < 0)
+          die("Number of jobs must be non-negative.\n");
+        if (!jobs)
+          jobs = g_get_num_processors();
+        break;
+
+      case 'E':
+        keep_idle = 1;
+        break;
+
+      case 'v':
+        verbose = 1;
+        break;
+      case 'O':
+        direct = 1;
+        break;
+      case 'W':
+        follow = 1;
+        break;
+      case 'D':
+        duplex = 1;
+        break;
+      case '2':
+        packet_version = 2;
+        break;
+      case 'H':
+        headers = 1;
+        break;
+      case 'C':
+        checkpoint_file = optarg;
+        break;
+      case 'R':
+        resume_file = optarg;
+        break;
+      case 'S':
+        stats_file = optarg;
+        break;
+      case 'U':
+        stats_interval = atof(optarg);
+        if (!(stats_interval > 0))
+          die("Statistics interval must be positive.\n");
+        break;
+
       case 'h':
         printf("%s",usage);
         return 0;
@@ -192,169 +1455,100 @@ int main(int argc, char ** argv) {
     die("Please specify a flow file using -f <file>.\n");
   if (!packet_file)
     die("Please specify a packet file using -p <file>.\n");
-  
-  // open flow & packet files for writing
-  
-  FILE *flows = fopen(flow_file,"w");
-  if (!flows)
-      die("fopen(\"%s\",\"r\"): %s\n",flow_file,errstr);
-  file_cloexec(flows);
-
-  FILE *packets = fopen(packet_file,"w");
-  if (!packets)
-      die("fopen(\"%s\",\"r\"): %s\n",packet_file,errstr);
-  file_cloexec(packets);
-
-  // process each argument as a trace file
-
-  u_int32_t flow_index = 0;
-  GHashTable *flow_hash = g_hash_table_new(flow_hashf,flow_equal);
+  if (follow && jobs > 1)
+    die("You cannot use -j with --follow.\n");
+  if (stats_file) {
+    stats = strcmp(stats_file,"-") ? fopen(stats_file,"w") : stderr;
+    if (!stats)
+      die("fopen(\"%s\"): %s\n",stats_file,errstr);
+  }
+  stats_start = stats_last_time = monotonic_time();
+  stats_next = stats_start + stats_interval;
 
   if (optind == argc) argc++;
-  for (i = optind; i < argc; i++) {
-    fprintf(stderr,"parsing %s...\n",argv[i]);
-    FILE *file = open_arg(argv[i]);
-
-    char error[PCAP_ERRBUF_SIZE];
-    pcap_t *pcap = pcap_fopen_offline(file,error);
-    if (filter) {
-      int ret;
-      struct bpf_program fp;
-      ret = pcap_compile(
-        pcap,   // the pcap "object"
-        &fp,    // filter program
-        filter, // the program argument
-        1,      // do optimization
-        0       // netmask (unused)
-      );
-      if (ret == -1) die("pcap_compile: %s\n",pcap_geterr(pcap));
-      ret = pcap_setfilter(pcap,&fp);
-      if (ret == -1) die("pcap_setfilter: %s\n",pcap_geterr(pcap));
-      pcap_freecode(&fp);
-    }
+  traces = argv + optind;
+  n_traces = argc - optind;
+  if (jobs > n_traces)
+    jobs = n_traces;
+  if (jobs > 1) // share the processors among the jobs
+    decompress_threads = MAX(1,g_get_num_processors() / jobs);
+  flow_tables_init();
+  if (!keep_idle && isfinite(max_ival) && max_ival > 0) {
+    evicting = 1;
+    wheel_tick = max_ival / WHEEL_TICKS;
+  }
 
-    if (pcap) {
-      const u_char *pkt;
-      struct pcap_pkthdr info;
-      int datalink_type = pcap_datalink(pcap);
-      while (pkt = pcap_next(pcap,&info)) {
-        struct ip *ip;
-        switch (datalink_type) {
-          case DLT_RAW: {
-            ip = (struct ip *) pkt;
-            break;
-          }
-          case DLT_EN10MB: {
-            struct ether_header *eth = (struct ether_header *) pkt;
-            if (eth->ether_type == ETHERTYPE_8021Q) // VLAN frame
-              eth = (struct ether_header *) (pkt + 4);
-            if (eth->ether_type == ETHERTYPE_8021Q) // VLAN double tagging
-              eth = (struct ether_header *) (pkt + 8);
-            if (eth->ether_type != ETHERTYPE_IP) continue;
-            ip = (struct ip *) (eth + sizeof(*eth));
-            break;
-          }
-          // NOTE: to support a new datalink type, just add a case
-          // here that correctly extracts the IP pointer from it.
-          default:
-            die("Trace unsupported data link type %d (%s: %s).\n",
-              datalink_type,
-              pcap_datalink_val_to_name(datalink_type),
-              pcap_datalink_val_to_description(datalink_type)
-            );
-        }
-        
-        flow_record flow;
-        flow.proto  = ip->ip_p;
-        flow.src_ip = ip->ip_src.s_addr;
-        flow.dst_ip = ip->ip_dst.s_addr;
-        if (HAS_PORT(ip)) {
-          flow.src_port = SRC_PORT_RAW(ip);
-          flow.dst_port = DST_PORT_RAW(ip);
-        } else {
-          flow.src_port = ICMP_TYCO_RAW(ip); // ICMP_IDNO_RAW(ip);
-          flow.dst_port = ICMP_TYCO_RAW(ip);
-        }
+  // open flow & packet files for writing, or appending
 
-        flow_data *fd = g_hash_table_lookup(flow_hash,&flow);
-        double time = info.ts.tv_sec + info.ts.tv_usec*1e-6;
-        double ival = fd ? time - fd->last_time : INFINITY;
-        if (!fd || ival > max_ival) {
-          if (!fd) fd = allocate(fd);
-          fd->index = flow_index++;
-          fd->last_time = -INFINITY;
-          fd->last_seqno = 0;
-          if (ival == INFINITY)
-            g_hash_table_insert(flow_hash,copy(flow),fd);
-          write_flow(flows,&flow);
-        }
+  // packets are in time order unless traces aren't
+  file_header_init(&packet_header,FILE_PACKETS,packet_version);
+  packet_header.sort_major = SORT_TIME;
+  if (duplex)
+    packet_header.flags |= FILE_DUPLEX;
 
-        u_int16_t size;
-        switch (size_type) {
-          case SIZE_PACKET:
-            size = IP4_SIZE(ip);
-            break;
-          case SIZE_IP_PAYLOAD:
-            size = IP4_SIZE(ip) - IP4_HEADER_UNIT * IP_HL(ip);
-            break;
-          case SIZE_TRANSPORT_PAYLOAD:
-          case SIZE_APPLICATION_DATA:
-            switch (ip->ip_p) {
-              case IP_PROTO_ICMP:
-                size = IP4_SIZE(ip) - IP4_HEADER_UNIT * IP_HL(ip) - ICMP_HEADER_SIZE;
-                break;
-              case IP_PROTO_UDP:
-                size = UDP_SIZE(ip) - UDP_HEADER_SIZE;
-                break;
-              case IP_PROTO_TCP: {
-                struct tcphdr *tcp = (struct tcphdr *) (ip + IP4_HEADER_UNIT * IP_HL(ip));
-                size = IP4_SIZE(ip) - IP4_HEADER_UNIT * (IP_HL(ip) + TH_OFF(tcp));
-                if (size_type == SIZE_APPLICATION_DATA) {
-                  // TODO: verify correctness of TCP app data logic.
-                  u_int32_t last_byte_seqno = ntohl(tcp->th_seq) + size;
-                  if (!(tcp->th_flags & (TH_SYN|TH_FIN|TH_RST))) last_byte_seqno--;
-                  if (fd->last_time < 0) {
-                    fd->last_seqno = last_byte_seqno;
-                  } else // regular follow-up packet
-                  if (size + TCP_MAX_SKIP >= last_byte_seqno - fd->last_seqno) {
-                    size = last_byte_seqno - fd->last_seqno;
-                    fd->last_seqno = last_byte_seqno;
-                  } else // possible seqno wrap-around
-                  if (size + TCP_MAX_SKIP >= last_byte_seqno + abs(fd->last_seqno)) {
-                    // FIXME: this seems questionable.
-                    size = last_byte_seqno + abs(fd->last_seqno);
-                    fd->last_seqno = last_byte_seqno;
-                  } else { // out-of-order packet, no new data.
-                    size = 0;
-                  }
-                }
-                break;
-              }
-              default:
-                continue; // ignore packet
-            }
-            break;
-        }
-        if (size < min_size)
-          continue; // ignore packet
+  if (resume_file) {
+    load_checkpoint(resume_file,flow_file,packet_file,address_file);
+  } else {
+    flows = writer_open(flow_file,direct);
+    packets = writer_open(packet_file,direct);
+    if (headers) {
+      // placeholders until the counts are known
+      file_header flow_header;
+      file_header_init(&flow_header,FILE_FLOWS,1);
+      write_file_header(flows,&flow_header);
+      write_file_header(packets,&packet_header);
+    }
+    if (address_file) {
+      addresses = writer_open(address_file,direct);
+      addr_table_init(&addrs);
+    }
+  }
 
-        packet_record packet = {
-          fd->index, info.ts.tv_sec, info.ts.tv_usec, size
-        };
-        if (packet.usec >= 1000000) {
-          packet.sec += packet.usec / 1000000;
-          packet.usec = packet.usec % 1000000;
-        }
-        hton_packet(&packet);
-        write_packet(packets,&packet);
+  // process each argument as a trace file
 
-        fd->last_time = time;
-      }
-    } else {
-        die("pcap: %s\n",error);
+  if (jobs > 1) {
+    parse_traces_parallel();
+  } else {
+    if (follow) {
+      signal(SIGINT,stop_following);
+      signal(SIGTERM,stop_following);
+    }
+    for (i = 0; i < n_traces && following; i++) {
+      fprintf(stderr,"%s %s...\n",
+        follow && i == n_traces-1 ? "following" : "parsing",traces[i]);
+      parse_trace(traces[i],follow && i == n_traces-1 ? follow_idle : NULL);
     }
-    fclose(file);
-    wait(NULL);
+  }
+  if (evicting && backwards > 0)
+    warn("Warning: packet times went backwards by up to %g seconds;\n"
+         "  flow numbering may differ from parse -E.\n",backwards);
+  if (counters.clamped)
+    warn("Warning: %llu packet sizes over %d cut to fit duplex records.\n",
+      (unsigned long long) counters.clamped,DUPLEX_MAX_SIZE);
+  if (counters.ipv6_ignored)
+    warn("Warning: %llu IPv6 packets ignored; use -a to include them.\n",
+      (unsigned long long) counters.ipv6_ignored);
+  if (verbose) {
+    flow_table_stats(stderr,flow_tables,flow_shards);
+    fprintf(stderr,"fragments: %llu attributed to flows, %llu unattributed\n",
+      (unsigned long long) counters.frags_matched,
+      (unsigned long long) counters.frags_unmatched);
+    if (evicting)
+      fprintf(stderr,"flow table: %llu idle flows evicted\n",
+        (unsigned long long) evicted);
+  }
+  writer_close(flows);
+  writer_close(packets);
+  if (addresses)
+    writer_close(addresses);
+  if (headers)
+    update_headers(flow_file,packet_file,1);
+  if (checkpoint_file)
+    save_checkpoint(checkpoint_file);
+  if (stats) {
+    report_stats(1);
+    if (stats != stderr)
+      fclose(stats);
   }
   return 0;
 }
@@ -236,7 +236,6 @@ int main(int argc, char **argv) {
       }
     }
     fclose(file);
-    wait(NULL);
   }
   return 0;
 }
@@ -0,0 +1,109 @@
+// Parallel LSD radix sorting of fixed-size records.
+//
+// Records are sorted one byte at a time, least significant first. The
+// byte positions are the sort key's digits: packet records are in
+// network byte-order, so each field's bytes are its digits as they
+// stand, and only the top byte of a signed field needs its sign bit
+// flipped. Each pass counts its digit in every thread's share of the
+// records, turns the counts into where each thread's records go, and
+// scatters them stably into the other buffer; digits that are the same
+// in every record are skipped.
+
+#define RADIX_MIN_SHARE (1 << 16) // fewest records per thread
+
+typedef struct {
+  const char *src;
+  char       *dst;
+  size_t      size;
+  size_t      lo, hi;
+  int         pos;
+  u_char      flip;
+  size_t      count[256]; // per digit, then where the next one goes
+} radix_share;
+
+static gpointer radix_count(gpointer arg) {
+  radix_share *s = arg;
+  memset(s->count,0,sizeof(s->count));
+  const u_char *p = (const u_char *) s->src + s->lo*s->size + s->pos;
+  size_t i;
+  for (i = s->lo; i < s->hi; i++, p += s->size)
+    s->count[*p ^ s->flip]++;
+  return NULL;
+}
+
+static gpointer radix_scatter(gpointer arg) {
+  radix_share *s = arg;
+  const char *p = s->src + s->lo*s->size;
+  size_t i;
+  for (i = s->lo; i < s->hi; i++, p += s->size) {
+    u_char d = p[s->pos] ^ s->flip;
+    memcpy(s->dst + s->count[d]++ * s->size,p,s->size);
+  }
+  return NULL;
+}
+
+static void radix_run(GThreadFunc f, radix_share *shares, int threads) {
+  if (threads == 1) {
+    f(shares);
+    return;
+  }
+  GThread *t[threads];
+  int k;
+  for (k = 0; k < threads; k++)
+    t[k] = g_thread_new("sort",f,&shares[k]);
+  for (k = 0; k < threads; k++)
+    g_thread_join(t[k]);
+}
+
+// sort n records of the given size by digits at positions pos, most
+// significant first, with the bits in flip flipped; returns zero if
+// there isn't memory for a second buffer
+
+int radix_sort(char *records, size_t n, size_t size, const int *pos,
+               const u_char *flip, int digits, int threads) {
+  char *buf = malloc(n*size);
+  if (!buf && n)
+    return 0;
+  if (threads > n / RADIX_MIN_SHARE)
+    threads = n / RADIX_MIN_SHARE;
+  if (threads < 1)
+    threads = 1;
+  radix_share shares[threads];
+  char *src = records, *dst = buf;
+  int j, k, d;
+  for (j = digits - 1; j >= 0; j--) {
+    for (k = 0; k < threads; k++) {
+      shares[k].src  = src;
+      shares[k].dst  = dst;
+      shares[k].size = size;
+      shares[k].lo   = n * k / threads;
+      shares[k].hi   = n * (k+1) / threads;
+      shares[k].pos  = pos[j];
+      shares[k].flip = flip[j];
+    }
+    radix_run(radix_count,shares,threads);
+    size_t at = 0;
+    for (d = 0; d < 256; d++) {
+      size_t total = 0;
+      for (k = 0; k < threads; k++)
+        total += shares[k].count[d];
+      if (total == n)
+        break;
+      for (k = 0; k < threads; k++) {
+        size_t c = shares[k].count[d];
+        shares[k].count[d] = at;
+        at += c;
+      }
+    }
+    if (d < 256)
+      continue; // one digit throughout
+    radix_run(radix_scatter,shares,threads);
+    char *t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != records)
+    memcpy(records,src,n*size);
+  free(buf);
+  return 1;
+}
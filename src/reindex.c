@@ -3,6 +3,8 @@ const char *usage =
   "  reindex <packet file>\n"
   "\n"
   "  Sequentially reindex flows reference by packet file.\n"
+  "  Packet files without headers (see parse -H) must have\n"
+  "  version 1 records.\n"
   "\n"
 ;
 
@@ -27,10 +29,9 @@ int main(int argc, char ** argv) {
       die("fopen(\"%s\",\"r\"): %s\n",argv[i],errstr);
     struct stat fs;
     fstat(fileno(file),&fs);
-    u_int32_t n = fs.st_size / sizeof(packet_record);
-    if (n > 0) {
+    if (fs.st_size > 0) {
 
-      packet_record *packets = mmap(
+      char *map = mmap(
         0,
         fs.st_size,
         PROT_READ | PROT_WRITE,
@@ -39,20 +40,37 @@ int main(int argc, char ** argv) {
         0
       );
 
-      u_int32_t index = 0;
-      u_int32_t index_n = htonl(index);
-      u_int32_t last_flow = packets[0].flow;
-      u_int32_t j;
+      // headerless files are version 1 records
+      file_header h;
+      char *packets = map + file_header_parse(map,fs.st_size,&h);
+      if (h.size && h.type != FILE_PACKETS)
+        die("%s: not a packet file.\n",argv[i]);
+      size_t size = packet_record_size(h.version);
+      u_int64_t n = (fs.st_size - h.size) / size;
+      if (n > 0) {
+        packet_data packet;
+        packet_decode(h.version,packets,&packet);
+        u_int64_t index = 0;
+        u_int64_t last_flow = packet.flow;
+        u_int64_t j;
 
-      for (j = 0; j < n; j++) {
-        if (last_flow != packets[j].flow) {
-          last_flow = packets[j].flow;
-          index_n = htonl(++index);
+        for (j = 0; j < n; j++) {
+          packet_decode(h.version,packets + j*size,&packet);
+          if (last_flow != packet.flow) {
+            last_flow = packet.flow;
+            ++index;
+          }
+          packet.flow = index;
+          packet_encode(h.version,&packet,packets + j*size);
+        }
+        if (h.size) {
+          h.max_flow = index;
+          h.flags |= FILE_MAX_FLOW;
+          file_header_encode(&h,map);
         }
-        packets[j].flow = index_n;
       }
 
-      munmap(packets,fs.st_size);
+      munmap(map,fs.st_size);
       fclose(file);
 
       if (parallel) {
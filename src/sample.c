@@ -111,7 +111,6 @@ int main(int argc, char **argv) {
       }
     }
     fclose(values);
-    wait(NULL);
   }
 
   return 0;
@@ -0,0 +1,130 @@
+// Slab and arena allocators for parse's per-flow and per-trace state.
+//
+// Memory is mapped directly in large pages (huge pages, where the
+// kernel supports them) instead of coming from malloc one object at a
+// time. A slab hands out fixed-size slots named by one-based 32-bit
+// numbers and recycles the slots of freed objects; an arena is a bump
+// allocator. Neither returns memory piecemeal: both release all their
+// pages in bulk when reset, e.g. at trace file or checkpoint boundaries.
+
+#include <sys/mman.h>
+
+#define SLAB_PAGE_BYTES (2 << 20)
+
+#ifndef MAP_ANON
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+
+static void *page_alloc(size_t bytes) {
+  void *p = mmap(0,bytes,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
+  if (p == MAP_FAILED)
+    die("mmap(%zu): %s\n",bytes,errstr);
+#ifdef MADV_HUGEPAGE
+  madvise(p,bytes,MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+static void page_free(void *p, size_t bytes) {
+  if (munmap(p,bytes))
+    die("munmap: %s\n",errstr);
+}
+
+// slab of fixed-size objects
+
+typedef struct {
+  size_t     size;      // object size, at least four bytes
+  u_int32_t  bits;      // log2 of objects per page
+  char     **pages;
+  u_int32_t  n_pages;
+  u_int32_t  used;      // slots ever handed out
+  u_int32_t  free_list; // last freed slot, zero if none
+  u_int64_t  live;      // slots currently in use
+} slab;
+
+static void slab_init(slab *s, size_t size) {
+  memset(s,0,sizeof(*s));
+  s->size = size < sizeof(u_int32_t) ? sizeof(u_int32_t) : size;
+  while ((2UL << s->bits) * s->size <= SLAB_PAGE_BYTES)
+    s->bits++;
+}
+
+static inline void *slab_ptr(slab *s, u_int32_t slot) {
+  slot--;
+  return s->pages[slot >> s->bits] + (slot & ((1UL << s->bits)-1)) * s->size;
+}
+
+static u_int32_t slab_alloc(slab *s) {
+  u_int32_t slot = s->free_list;
+  if (slot) {
+    s->free_list = *(u_int32_t *) slab_ptr(s,slot);
+  } else {
+    if (s->used == 0xffffffff)
+      die("Slab exhausted: too many objects.\n");
+    if (s->used >> s->bits == s->n_pages) {
+      s->pages = realloc(s->pages,(s->n_pages+1)*sizeof(*s->pages));
+      if (!s->pages)
+        die("realloc: %s\n",errstr);
+      s->pages[s->n_pages++] = page_alloc(s->size << s->bits);
+    }
+    slot = ++s->used;
+  }
+  s->live++;
+  return slot;
+}
+
+static void slab_free(slab *s, u_int32_t slot) {
+  *(u_int32_t *) slab_ptr(s,slot) = s->free_list;
+  s->free_list = slot;
+  s->live--;
+}
+
+static void slab_reset(slab *s) {
+  u_int32_t i;
+  for (i = 0; i < s->n_pages; i++)
+    page_free(s->pages[i],s->size << s->bits);
+  free(s->pages);
+  slab_init(s,s->size);
+}
+
+// arena of variable-sized allocations
+
+typedef struct arena_chunk {
+  struct arena_chunk *next;
+  size_t size;
+  size_t used;
+} arena_chunk;
+
+typedef struct {
+  arena_chunk *chunks;
+} arena;
+
+#define ARENA_ALIGN 16
+#define ARENA_HEADER \
+  ((sizeof(arena_chunk) + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1))
+
+static void *arena_alloc(arena *a, size_t bytes) {
+  bytes = (bytes + ARENA_ALIGN-1) & ~(size_t) (ARENA_ALIGN-1);
+  arena_chunk *c = a->chunks;
+  if (!c || c->used + bytes > c->size) {
+    size_t size = SLAB_PAGE_BYTES;
+    while (size < ARENA_HEADER + bytes)
+      size *= 2;
+    c = page_alloc(size);
+    c->next = a->chunks;
+    c->size = size;
+    c->used = ARENA_HEADER;
+    a->chunks = c;
+  }
+  void *p = (char *) c + c->used;
+  c->used += bytes;
+  return p;
+}
+
+static void arena_reset(arena *a) {
+  while (a->chunks) {
+    arena_chunk *c = a->chunks;
+    a->chunks = c->next;
+    page_free(c,c->size);
+  }
+}
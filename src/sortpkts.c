@@ -12,6 +12,38 @@ const char *usage =
   "  -s  Sort by packet size\n"
   "\n"
   "  -p  Sort files in parallel (fork for each argument)\n"
+  "  -j <integer>  Number of threads sorting each file\n"
+  "      Default: one per processor, shared among files with -p\n"
+  "  -m, --memory <bytes>[K|M|G]\n"
+  "      Sort files larger than this out of core (see below)\n"
+  "  -x  Write an offset index of each file sorted by flow or\n"
+  "      time to the file's name with .fidx or .tidx appended\n"
+  "  -D  Packet sizes are signed (see parse -D)\n"
+  "  -2  Packet files have version 2 records (see parse -2)\n"
+  "\n"
+  "Notes:\n"
+  "  - Files with headers (see parse -H) give their record version and\n"
+  "    whether sizes are signed themselves. Their headers record the sort\n"
+  "    order, and files already sorted as asked are left alone.\n"
+  "  - A flow offset index gives the first packet and packet count of\n"
+  "    every flow, so unpack, stats and enumerate can go straight to a\n"
+  "    flow's packets (see their -X options). It stays valid for the\n"
+  "    file block-compressed with zpack.\n"
+  "  - Files are radix sorted, which needs memory for a second copy of\n"
+  "    the records: within the -m budget, or else half of physical\n"
+  "    memory. Without it they're sorted in place, more slowly.\n"
+  "  - Packets in time order with flows numbered from zero, as parse\n"
+  "    writes them, are sorted by flow then time in linear time by\n"
+  "    dealing them out to their flows, and the flow offset index comes\n"
+  "    for free.\n"
+  "  - Files larger than the -m budget are sorted in runs that fit in it,\n"
+  "    written one after another to a temporary file (the file's name\n"
+  "    with .runs appended, unlinked once open), and then merged into a\n"
+  "    new file (.sorting appended) which replaces the original. The\n"
+  "    files are read and written sequentially, and with -p every file\n"
+  "    gets the whole budget.\n"
+  "  - A time offset index gives the number of every 4096th packet and\n"
+  "    its time, so unpack -S and -E go straight to a time range.\n"
 ;
 
 #include <sys/stat.h>
@@ -19,6 +51,8 @@ const char *usage =
 
 #include "common.h"
 #include "smoothsort.c"
+#include "radixsort.c"
+#include "losertree.c"
 
 void swap_packets(void *m, size_t a, size_t b) {
   packet_record *p = (packet_record *) m;
@@ -27,6 +61,18 @@ void swap_packets(void *m, size_t a, size_t b) {
   p[b] = t;
 }
 
+void swap_packets_v2(void *m, size_t a, size_t b) {
+  packet_record_v2 *p = (packet_record_v2 *) m;
+  packet_record_v2 t = p[a];
+  p[a] = p[b];
+  p[b] = t;
+}
+
+// sizes compare as signed numbers in duplex mode
+
+static u_int16_t size_bias = 0;
+#define size_key(s) (htons(s) ^ size_bias)
+
 #define cmp(a,b,c1,f1,c2,f2,c3,f3,c4,f4)     \
   c1(a.f1) <  c1(b.f1) ||  \
   c1(a.f1) == c1(b.f1) &&( \
@@ -36,23 +82,284 @@ void swap_packets(void *m, size_t a, size_t b) {
   c3(a.f3) == c3(b.f3) &&  \
   c4(a.f4) <  c4(b.f4) ));
 
-#define declare_sorter(name,c1,f1,c2,f2,c3,f3,c4,f4) \
+#define declare_sorter(name,type,c1,f1,c2,f2,c3,f3,c4,f4) \
   int name(void *m, size_t a, size_t b) { \
-    struct packet_record *p = (struct packet_record *) m; \
+    type *p = (type *) m; \
     return cmp(p[a],p[b],c1,f1,c2,f2,c3,f3,c4,f4); \
   }
 
-declare_sorter(lt_flow_time,htonl,flow,htonl,sec ,htonl,usec,htons,size)
-declare_sorter(lt_flow_size,htonl,flow,htons,size,htonl,sec ,htonl,usec)
-declare_sorter(lt_time_flow,htonl,sec ,htonl,usec,htonl,flow,htons,size)
-declare_sorter(lt_time_size,htonl,sec ,htonl,usec,htons,size,htonl,flow)
-declare_sorter(lt_size_flow,htons,size,htonl,flow,htonl,sec ,htonl,usec)
-declare_sorter(lt_size_time,htons,size,htonl,sec ,htonl,usec,htonl,flow)
+declare_sorter(lt_flow_time,packet_record,htonl,flow,htonl,sec ,htonl,usec,size_key,size)
+declare_sorter(lt_flow_size,packet_record,htonl,flow,size_key,size,htonl,sec ,htonl,usec)
+declare_sorter(lt_time_flow,packet_record,htonl,sec ,htonl,usec,htonl,flow,size_key,size)
+declare_sorter(lt_time_size,packet_record,htonl,sec ,htonl,usec,size_key,size,htonl,flow)
+declare_sorter(lt_size_flow,packet_record,size_key,size,htonl,flow,htonl,sec ,htonl,usec)
+declare_sorter(lt_size_time,packet_record,size_key,size,htonl,sec ,htonl,usec,htonl,flow)
+
+// version 2 records have one time field, so the last is repeated
+
+#define be64 GUINT64_FROM_BE
+
+declare_sorter(lt2_flow_time,packet_record_v2,be64,flow,be64,time,size_key,size,size_key,size)
+declare_sorter(lt2_flow_size,packet_record_v2,be64,flow,size_key,size,be64,time,be64,time)
+declare_sorter(lt2_time_flow,packet_record_v2,be64,time,be64,flow,size_key,size,size_key,size)
+declare_sorter(lt2_time_size,packet_record_v2,be64,time,size_key,size,be64,flow,be64,flow)
+declare_sorter(lt2_size_flow,packet_record_v2,size_key,size,be64,flow,be64,time,be64,time)
+declare_sorter(lt2_size_time,packet_record_v2,size_key,size,be64,time,be64,flow,be64,flow)
+
+// radix sort digits: each field's bytes in the record, least significant
+// last, with the sign bit of duplex sizes flipped
+
+static const int field_at[2][SORT_SIZE+1] = {
+  { 0, 0, 4, 12 }, // version 1: flow, seconds and microseconds, size
+  { 0, 0, 8, 16 }, // version 2: flow, time, size
+};
+static const int field_len[2][SORT_SIZE+1] = {
+  { 0, 4, 8, 2 },
+  { 0, 8, 8, 2 },
+};
+
+static int radix_digits(int version, int duplex, const int *fields,
+                        int *pos, u_char *flip) {
+  int f, j, n = 0;
+  for (f = 0; f < 3; f++)
+    for (j = 0; j < field_len[version-1][fields[f]]; j++) {
+      pos[n] = field_at[version-1][fields[f]] + j;
+      flip[n++] = duplex && fields[f] == SORT_SIZE && !j ? 0x80 : 0;
+    }
+  return n;
+}
+
+static int key_pos[18];
+static u_char key_flip[18];
+static int key_digits;
+
+static int key_lt(const u_char *a, const u_char *b) {
+  int j;
+  for (j = 0; j < key_digits; j++) {
+    u_char x = a[key_pos[j]] ^ key_flip[j], y = b[key_pos[j]] ^ key_flip[j];
+    if (x != y)
+      return x < y;
+  }
+  return 0;
+}
+
+static int (*lt)(void *m, size_t a, size_t b), (*lt_v2)(void *m, size_t a, size_t b);
+
+// whether a copy of the records fits in the -m budget or, without one,
+// beside them in physical memory: malloc can succeed well beyond that
+// under overcommit, and the sort then swaps or is killed
+
+static int room_to_copy(size_t bytes, size_t memory) {
+  if (memory)
+    return bytes <= memory;
+  long pages = sysconf(_SC_PHYS_PAGES), page = sysconf(_SC_PAGESIZE);
+  return pages <= 0 || page <= 0 || bytes <= (u_int64_t) pages * page / 2;
+}
+
+// sort records in memory, radix sorting if there's room
+
+static void sort_records(const char *path, char *packets, size_t n, int v,
+                         size_t memory, int threads) {
+  if (room_to_copy(n*packet_record_size(v),memory) &&
+      radix_sort(packets,n,packet_record_size(v),
+                 key_pos,key_flip,key_digits,threads))
+    return;
+  warn("%s: not enough memory to radix sort, sorting in place.\n",path);
+  if (v == 2)
+    su_smoothsort(packets,0,n,lt_v2,swap_packets_v2);
+  else
+    su_smoothsort(packets,0,n,lt,swap_packets);
+}
+
+// packets as parse writes them are in time order, with flows numbered
+// from zero, so sorting them by flow then time only takes dealing them
+// out to their flows in order; an insertion sort then puts packets of a
+// flow at the same time in size order. Returns the first packet of each
+// flow and the number of packets, or NULL if the packets aren't like that.
+
+static u_int64_t *sort_flows_of_time_sorted(char *packets, size_t n, int v,
+                                            size_t memory, u_int64_t *flows) {
+  size_t size = packet_record_size(v), i;
+  packet_data a, b;
+  *flows = 0;
+  for (i = 0; i < n; i++) {
+    packet_decode(v,packets + i*size,&b);
+    if ((i && b.time < a.time) || b.flow >= n)
+      return NULL;
+    if (*flows <= b.flow)
+      *flows = b.flow + 1;
+    a = b;
+  }
+  if (!room_to_copy(n*size,memory))
+    return NULL;
+  u_int64_t *first = calloc(*flows + 1,sizeof(u_int64_t)), f;
+  char *buf = malloc(n*size), *p;
+  if (!first || !buf) {
+    free(first);
+    free(buf);
+    return NULL;
+  }
+
+  // count, add up, deal out: first[f] ends up at the end of flow f
+  for (i = 0, p = packets; i < n; i++, p += size) {
+    packet_decode(v,p,&b);
+    first[b.flow+1]++;
+  }
+  for (f = 1; f <= *flows; f++)
+    first[f] += first[f-1];
+  for (i = 0, p = packets; i < n; i++, p += size) {
+    packet_decode(v,p,&b);
+    memcpy(buf + first[b.flow]++ * size,p,size);
+  }
+  memmove(first+1,first,*flows * sizeof(u_int64_t));
+  first[0] = 0;
+
+  char t[sizeof(packet_record_v2)];
+  for (i = 1, p = buf + size; i < n; i++, p += size) {
+    char *q = p;
+    if (!key_lt((u_char *) q,(u_char *) q - size))
+      continue;
+    memcpy(t,p,size);
+    do {
+      memcpy(q,q - size,size);
+      q -= size;
+    } while (q > buf && key_lt((u_char *) t,(u_char *) q - size));
+    memcpy(q,t,size);
+  }
+  memcpy(packets,buf,n*size);
+  free(buf);
+  return first;
+}
+
+// out of core sorting: sorted runs go one after another into a run file,
+// whose runs are then merged into a new file replacing the original
+
+typedef struct {
+  int    fd;
+  off_t  next, end; // the rest of the run in the run file
+  char  *buf;
+  size_t size, have, at;
+} run;
+
+static void run_fill(run *r) {
+  size_t n = MIN(r->size,r->end - r->next), got = 0;
+  while (got < n) {
+    ssize_t x = pread(r->fd,r->buf + got,n - got,r->next + got);
+    if (x <= 0)
+      die("pread: %s\n",x ? errstr : "unexpected end of run file");
+    got += x;
+  }
+  r->next += n;
+  r->have = n;
+  r->at = 0;
+}
+
+static int run_lt(void *ctx, int a, int b) {
+  run *r = ctx;
+  if (r[a].at == r[a].have) return 0;
+  if (r[b].at == r[b].have) return 1;
+  return key_lt((u_char *) r[a].buf + r[a].at,(u_char *) r[b].buf + r[b].at);
+}
+
+static void put_records(record_writer *w, const char *data, size_t n) {
+  while (n) {
+    size_t c = MIN(n,WRITER_BUFFER_SIZE);
+    writer_put(w,data,c);
+    data += c;
+    n -= c;
+  }
+}
+
+static void sort_out_of_core(const char *path, const file_header *h,
+                             const char *packets, size_t n, int v,
+                             size_t memory, int threads, mode_t mode) {
+  size_t size = packet_record_size(v);
+  size_t per_run = MAX(1,memory / 2 / size), i;
+  int k = (n + per_run - 1) / per_run, j;
+
+  char *runs = malloc(strlen(path)+9), *sorting = malloc(strlen(path)+9);
+  sprintf(runs,"%s.runs",path);
+  sprintf(sorting,"%s.sorting",path);
+
+  char *buf = malloc(per_run*size);
+  if (!buf)
+    die("malloc: %s\n",errstr);
+
+  // the run file is read back through its own descriptor, and unlinked
+  // at once so that nothing is left behind if sorting dies
+  record_writer *w = writer_open(runs,0);
+  int fd = open(runs,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",runs,errstr);
+  unlink(runs);
+  for (i = 0; i < n; i += per_run) {
+    size_t m = MIN(per_run,n - i);
+    memcpy(buf,packets + i*size,m*size);
+    sort_records(path,buf,m,v,memory,threads);
+    put_records(w,buf,m*size);
+  }
+  writer_close(w);
+  free(buf);
+
+  // each run gets an equal share of the budget to read ahead with
+  size_t share = MAX(1 << 16,memory / k) / size * size;
+  run *r = calloc(k,sizeof(run));
+  if (!r)
+    die("calloc: %s\n",errstr);
+  for (j = 0; j < k; j++) {
+    r[j].fd = fd;
+    r[j].next = (off_t) j*per_run*size;
+    r[j].end = (off_t) MIN((u_int64_t) (j+1)*per_run,n)*size;
+    r[j].size = share;
+    if (!(r[j].buf = malloc(share)))
+      die("malloc: %s\n",errstr);
+    run_fill(&r[j]);
+  }
+
+  w = writer_open(sorting,0);
+  if (h->size)
+    write_file_header(w,h);
+  loser_tree t;
+  loser_tree_init(&t,k,run_lt,r);
+  for (i = 0; i < n; i++) {
+    run *top = &r[loser_tree_top(&t)];
+    writer_put(w,top->buf + top->at,size);
+    if ((top->at += size) == top->have)
+      run_fill(top);
+    loser_tree_replay(&t);
+  }
+  loser_tree_free(&t);
+  writer_flush(w);
+  if (fchmod(w->fd,mode) || fsync(w->fd))
+    die("%s: %s\n",sorting,errstr);
+  writer_close(w);
+  if (rename(sorting,path))
+    die("rename(\"%s\",\"%s\"): %s\n",sorting,path,errstr);
+
+  close(fd);
+  for (j = 0; j < k; j++)
+    free(r[j].buf);
+  free(r);
+  free(runs);
+  free(sorting);
+}
+
+// sizes like 512M; a bare number is bytes
+
+static size_t parse_memory(const char *arg) {
+  char *end;
+  double x = strtod(arg,&end);
+  switch (*end) {
+    case 'G': case 'g': x *= 1024;
+    case 'M': case 'm': x *= 1024;
+    case 'K': case 'k': x *= 1024; end++;
+  }
+  if (end == arg || *end || x < 1)
+    die("Bad memory size: `%s'.\n",arg);
+  return x;
+}
 
-#define SORT_NONE 0
-#define SORT_FLOW 1
-#define SORT_TIME 2
-#define SORT_SIZE 3
+#define sorters(order) lt = lt_##order, lt_v2 = lt2_##order
 
 #define SORT_ORDER(major,minor) ((SORT_SIZE+1)*major+minor)
 
@@ -70,9 +377,19 @@ int main(int argc, char ** argv) {
   int major = SORT_FLOW;
   int minor = SORT_NONE;
   int parallel = 0;
+  int offsets = 0;
+  int version = 1;
+  int duplex = 0;
+  int threads = 0;
+  size_t memory = 0;
+
+  static struct option longopts[] = {
+    { "memory", required_argument, 0, 'm' },
+    { 0, 0, 0, 0 }
+  };
 
   int i;
-  while ((i = getopt(argc,argv,"ftsph")) != -1) {
+  while ((i = getopt_long(argc,argv,"ftspj:m:xD2h",longopts,0)) != -1) {
     switch (i) {
 
       case 'f': SET_SORT(m--,SORT_FLOW); break;
@@ -80,6 +397,15 @@ int main(int argc, char ** argv) {
       case 's': SET_SORT(m--,SORT_SIZE); break;
 
       case 'p': parallel = 1; break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 0)
+          die("Number of threads must be non-negative.\n");
+        break;
+      case 'm': memory = parse_memory(optarg); break;
+      case 'x': offsets = 1; break;
+      case 'D': duplex = 1; break;
+      case '2': version = 2; break;
 
       case 'h':
         printf("%s",usage);
@@ -97,33 +423,40 @@ int main(int argc, char ** argv) {
     die("Major and minor sort fields must differ.\n");
   if (minor == SORT_NONE)
     minor = (major != SORT_FLOW) ? SORT_FLOW : SORT_TIME;
+  if (offsets && major == SORT_SIZE)
+    die("Offset indexes need files sorted by flow or time.\n");
+  if (!threads) {
+    threads = g_get_num_processors();
+    if (parallel && argc - optind > 1)
+      threads = MAX(1,threads / (argc - optind));
+  }
+  int fields[3] = { major, minor, SORT_FLOW + SORT_TIME + SORT_SIZE - major - minor };
 
   char *desc;
-  int (*lt)(void *m, size_t a, size_t b);
   switch (SORT_ORDER(major,minor)) {
     case SORT_ORDER(SORT_FLOW,SORT_TIME):
       desc = "flow, time then size";
-      lt = lt_flow_time;
+      sorters(flow_time);
       break;
     case SORT_ORDER(SORT_FLOW,SORT_SIZE):
       desc = "flow, size then time";
-      lt = lt_flow_size;
+      sorters(flow_size);
       break;
     case SORT_ORDER(SORT_TIME,SORT_FLOW):
       desc = "time, flow then size";
-      lt = lt_time_flow;
+      sorters(time_flow);
       break;
     case SORT_ORDER(SORT_TIME,SORT_SIZE):
       desc = "time, size then flow";
-      lt = lt_time_size;
+      sorters(time_size);
       break;
     case SORT_ORDER(SORT_SIZE,SORT_FLOW):
       desc = "size, flow then time";
-      lt = lt_size_flow;
+      sorters(size_flow);
       break;
     case SORT_ORDER(SORT_SIZE,SORT_TIME):
       desc = "size, time then flow";
-      lt = lt_size_time;
+      sorters(size_time);
       break;
   }
 
@@ -138,9 +471,8 @@ int main(int argc, char ** argv) {
       die("fopen(\"%s\",\"r\"): %s\n",argv[i],errstr);
     struct stat fs;
     fstat(fileno(file),&fs);
-    u_int32_t n = fs.st_size / sizeof(packet_record);
 
-    packet_record *packets = mmap(
+    char *map = mmap(
       0,
       fs.st_size,
       PROT_READ | PROT_WRITE,
@@ -149,9 +481,68 @@ int main(int argc, char ** argv) {
       0
     );
 
-    su_smoothsort(packets,0,n,lt,swap_packets);
+    // file headers override -2 and -D, and record the sort order
+    file_header h;
+    char *packets = map + file_header_parse(map,fs.st_size,&h);
+    int v = version, d = duplex;
+    if (h.size) {
+      if (h.type != FILE_PACKETS)
+        die("%s: not a packet file.\n",argv[i]);
+      v = h.version;
+      d = h.flags & FILE_DUPLEX ? 1 : 0;
+    }
+    size_t n = (fs.st_size - h.size) / packet_record_size(v);
+    size_bias = d ? 0x8000 : 0;
+    key_digits = radix_digits(v,d,fields,key_pos,key_flip);
+    u_int64_t *first = NULL, flows;
+
+    if (h.size && h.sort_major == major && h.sort_minor == minor) {
+      fprintf(stderr,"%s is already sorted by %s.\n",argv[i],desc);
+    } else if (memory && n*packet_record_size(v) > memory) {
+      // a partial record at the end wouldn't survive the new file
+      if ((fs.st_size - h.size) % packet_record_size(v))
+        die("%s: truncated packet file.\n",argv[i]);
+      h.sort_major = major;
+      h.sort_minor = minor;
+      madvise(map,fs.st_size,MADV_SEQUENTIAL);
+      sort_out_of_core(argv[i],&h,packets,n,v,memory,threads,fs.st_mode & 07777);
+      // carry on with the sorted file
+      munmap(map,fs.st_size);
+      fclose(file);
+      if (!(file = fopen(argv[i],"r")))
+        die("fopen(\"%s\",\"r\"): %s\n",argv[i],errstr);
+      map = mmap(0,fs.st_size,PROT_READ,MAP_SHARED,fileno(file),0);
+      if (map == MAP_FAILED)
+        die("mmap(\"%s\"): %s\n",argv[i],errstr);
+      packets = map + h.size;
+    } else {
+      if (!(major == SORT_FLOW && minor == SORT_TIME &&
+            (first = sort_flows_of_time_sorted(packets,n,v,memory,&flows))))
+        sort_records(argv[i],packets,n,v,memory,threads);
+      if (h.size) {
+        h.sort_major = major;
+        h.sort_minor = minor;
+        file_header_encode(&h,map);
+      }
+    }
+
+    if (offsets) {
+      char *path = malloc(strlen(argv[i])+6);
+      if (major == SORT_FLOW) {
+        sprintf(path,"%s.fidx",argv[i]);
+        if (first)
+          write_flow_offset_table(path,first,flows);
+        else
+          write_flow_offsets(path,packets,n,v);
+      } else {
+        sprintf(path,"%s.tidx",argv[i]);
+        write_time_offsets(path,packets,n,v);
+      }
+      free(path);
+    }
 
-    munmap(packets,fs.st_size);
+    free(first);
+    munmap(map,fs.st_size);
     fclose(file);
     if (parallel) {
       fprintf(stderr,"done [%s].\n",argv[i]);
@@ -7,7 +7,8 @@ const char *usage =
   "\n"
   "Options:\n"
   "  -Z            Splice in packet sizes.\n"
-  "  -V            Splice in inter-packet intervals.\n"
+  "  -V            Splice in inter-packet intervals (not with -Z).\n"
+  "  -2, --v2      Packet file has version 2 records.\n"
   "\n"
 ;
 
@@ -18,18 +19,20 @@ const char *usage =
 
 int sizes = 0;
 int intervals = 0;
+int version = 1;
 
 void parse_opts(int argc, char **argv) {
 
   static struct option longopts[] = {
     { "sizes",     optional_argument, 0, 'Z' },
     { "intervals", optional_argument, 0, 'V' },
+    { "v2",        no_argument,       0, '2' },
     { "help",      no_argument,       0, 'h' },
     { 0, 0, 0, 0 }
   };
 
   int c;
-  while ((c = getopt_long(argc,argv,"ZVh",longopts,0)) != -1) {
+  while ((c = getopt_long(argc,argv,"ZV2h",longopts,0)) != -1) {
     switch (c) {
 
       case 'Z':
@@ -38,6 +41,9 @@ void parse_opts(int argc, char **argv) {
       case 'V':
         intervals = 1;
         break;
+      case '2':
+        version = 2;
+        break;
 
       case 'h':
         printf("%s",usage);
@@ -74,9 +80,7 @@ int main(int argc, char **argv) {
     die("fopen(\"%s\",\"r\"): %s\n",packets_file,errstr);
   struct stat fs;
   fstat(fileno(file),&fs);
-  u_int32_t n = fs.st_size / sizeof(packet_record);
-
-  packet_record *packets = mmap(
+  char *map = mmap(
     0,
     fs.st_size,
     PROT_READ | PROT_WRITE,
@@ -84,7 +88,18 @@ int main(int argc, char **argv) {
     fileno(file),
     0
   );
+  file_header h;
+  char *packets = map + file_header_parse(map,fs.st_size,&h);
+  if (h.size) {
+    if (h.type != FILE_PACKETS)
+      die("%s: not a packet file.\n",packets_file);
+    version = h.version;
+  }
+  size_t record_size = packet_record_size(version);
+  u_int64_t n = (fs.st_size - h.size) / record_size;
   long long p = 0;
+  packet_data packet;
+#define record(p) (packets + (p)*record_size)
 
   while (i < argc) {
     FILE *values = open_arg(argv[i++]);
@@ -100,44 +115,56 @@ int main(int argc, char **argv) {
             die("Invalid packet size: %f\n",z);
 
           if (p >= n) goto too_many_values;
-          packets[p++].size = htons((u_int16_t) z);
+          packet_decode(version,record(p),&packet);
+          packet.size = (u_int16_t) z;
+          packet_encode(version,&packet,record(p++));
         }
       }
     }
     if (intervals) {
       long long flow = -1;
-      long long time_usec;
+      u_int64_t time;
       while (line = get_line(values,&buffer,&length)) {
         for (;;) {
-          if (flow != packets[p].flow) {
-            u_int32_t sec  = ntohl(packets[p].sec);
-            u_int32_t usec = ntohl(packets[p].usec);
-            time_usec = sec*1000000L + usec;
-            flow = packets[p].flow;
-            p++;
+          if (p < n) {
+            packet_decode(version,record(p),&packet);
+            if (flow != packet.flow) {
+              time = packet.time;
+              flow = packet.flow;
+              p++;
+            }
           }
 
           line += strcspn(line,"+-0123456789.\n");
           if (*line == '\n' || *line == '\0') break;
           double v = strtod(line,&line);
-          time_usec += llround(v*1e6);
-          u_int32_t sec  = (u_int32_t) (time_usec / 1000000L);
-          u_int32_t usec = (u_int32_t) (time_usec % 1000000L);
+          // intervals are added to the last time in integer nanoseconds;
+          // version 1 records round them to microseconds
+          time += version == 2 ? llround(v*1e9) : llround(v*1e6)*1000;
 
           if (p >= n) goto too_many_values;
-          packets[p].sec  = htonl(sec);
-          packets[p].usec = htonl(usec);
-          p++;
+          packet_decode(version,record(p),&packet);
+          packet.time = time;
+          packet_encode(version,&packet,record(p++));
         }
       }
     }
     fclose(values);
-    wait(NULL);
   }
   if (p < n)
     die("Too few splice values.\n");
 
-  munmap(packets,fs.st_size);
+  // spliced values invalidate what the header says about them
+  if (h.size) {
+    if ((sizes && (h.sort_major == SORT_SIZE || h.sort_minor == SORT_SIZE)) ||
+        (intervals && (h.sort_major == SORT_TIME || h.sort_minor == SORT_TIME)))
+      h.sort_major = h.sort_minor = SORT_NONE;
+    if (intervals)
+      h.flags &= ~FILE_TIMES;
+    file_header_encode(&h,map);
+  }
+
+  munmap(map,fs.st_size);
   fclose(file);
   return 0;
 
@@ -11,8 +11,16 @@ const char *usage =
   "  -Z <integer>   Maximum size powersum (default: 2).\n"
   "  -V <integer>   Maximum interval powersum (default: 2).\n"
   "  -N <integer>   Shortcut for -Z<N> -V<N>.\n"
+  "  -D             Packet sizes are signed (see parse -D); size\n"
+  "                 powersums are of their magnitudes.\n"
+  "  -2, --v2       Packet files have version 2 records.\n"
+  "                 (Files with headers say so themselves.)\n"
   "\n"
   "  -m <integer>   Only output flows with minimum packets.\n"
+  "  -X <file>      Flow offset index of the packet file (see\n"
+  "                 sortpkts -x): flows with fewer packets than\n"
+  "                 the minimum aren't read.\n"
+  "  -L <file>      Only output flows in this list (needs -X).\n"
   "\n"
   "  -I             Print flow indices.\n"
   "  -R             Reindex flows (imples -I).\n"
@@ -22,6 +30,10 @@ const char *usage =
   "  -t             Tab-delimited output.\n"
   "  -d <string>    Custom-delimited output.\n"
   "\n"
+  "Notes:\n"
+  "  - With -X, the packet file may be block-compressed (see zpack),\n"
+  "    and only its blocks holding flows to output are decompressed.\n"
+  "  - Flow lists are white-space text, as for unpack -L.\n"
 ;
 
 #include "common.h"
@@ -30,6 +42,11 @@ int size_ps_max = 2;
 int ival_ps_max = 2;
 
 int min_packets = 1;
+int duplex = 0;
+int version = 1;
+
+char *flow_index = NULL;
+char *flow_list = NULL;
 
 int indices = 0;
 int reindex = 0;
@@ -48,7 +65,11 @@ void parse_opts(int argc, char **argv) {
     { "sizes",       required_argument, 0, 'Z' },
     { "intervals",   required_argument, 0, 'V' },
     { "number",      required_argument, 0, 'N' },
+    { "duplex",      no_argument,       0, 'D' },
+    { "v2",          no_argument,       0, '2' },
     { "min-packets", required_argument, 0, 'm' },
+    { "offsets",     required_argument, 0, 'X' },
+    { "list",        required_argument, 0, 'L' },
     { "indices",     no_argument,       0, 'I' },
     { "reindex",     no_argument,       0, 'R' },
     { "offset",      required_argument, 0, 'o' },
@@ -60,7 +81,7 @@ void parse_opts(int argc, char **argv) {
   };
 
   int c;
-  while ((c = getopt_long(argc,argv,"Z:V:N:m:IRo:ctd:h",longopts,0)) != -1) {
+  while ((c = getopt_long(argc,argv,"Z:V:N:D2m:X:L:IRo:ctd:h",longopts,0)) != -1) {
     switch (c) {
       case 'Z':
         size_ps_max = atoi(optarg);
@@ -71,10 +92,22 @@ void parse_opts(int argc, char **argv) {
       case 'N':
         size_ps_max = ival_ps_max = atoi(optarg);
         break;
+      case 'D':
+        duplex = 1;
+        break;
+      case '2':
+        version = 2;
+        break;
 
       case 'm':
         min_packets = atoi(optarg);
         break;
+      case 'X':
+        flow_index = optarg;
+        break;
+      case 'L':
+        flow_list = optarg;
+        break;
 
       case 'I':
         indices = 1;
@@ -111,12 +144,15 @@ void parse_opts(int argc, char **argv) {
         die("ERROR: getopt badness.\n");
     }
   }
+  if (flow_list && !flow_index)
+    die("Flow lists need a flow offset index (-X).\n");
+  if (flow_index && argc - optind != 1)
+    die("A flow offset index goes with a single packet file.\n");
 }
 
-packet_record packet;
-double packet_time;
+packet_data packet;
 long long last_flow = -1;
-double last_time = -INFINITY;
+u_int64_t last_time;
 
 long long packets, flow;
 long double *size_ps;
@@ -125,10 +161,11 @@ long double *ival_ps;
 void update() {
   int i;
   packets++;
+  int size = duplex ? abs((int16_t) packet.size) : packet.size;
   for (i = 0; i < size_ps_max; i++)
-    size_ps[i] += powl(packet.size,i+1);
+    size_ps[i] += powl(size,i+1);
   if (packet.flow != last_flow) return;
-  double interval = packet_time - last_time;
+  long double interval = (int64_t) (packet.time - last_time) * 1e-9L;
   for (i = 0; i < ival_ps_max; i++)
     ival_ps[i] += powl(interval,i+1);
 }
@@ -140,7 +177,7 @@ void flush() {
     if (packets >= min_packets) {
       int i;
       if (indices)
-        printf("%lld%s",offset + (reindex ? flow++ : packet.flow),delim(1));
+        printf("%lld%s",offset + (reindex ? flow++ : last_flow),delim(1));
       printf("%llu%s",packets,delim(size_ps_max || ival_ps_max));
       for (i = 0; i < size_ps_max; i++)
         printf("%Le%s",size_ps[i],delim(i+1 < size_ps_max || ival_ps_max));
@@ -157,24 +194,91 @@ void flush() {
   packets = 0;
 }
 
+// with a flow offset index, flows are read straight from their records,
+// and ones with too few packets aren't read at all
+
+void indexed(const char *name) {
+  record_file *f = record_file_open(name);
+  if (!f)
+    die("%s: -X needs a plain or block-compressed file.\n",name);
+  if (f->h.size) {
+    if (f->h.type != FILE_PACKETS)
+      die("%s: -X needs packet records.\n",name);
+    version = f->h.version;
+    duplex = f->h.flags & FILE_DUPLEX ? 1 : 0;
+  }
+  size_t size = packet_record_size(version);
+  flow_offsets *o = flow_offsets_open(flow_index,record_count(f,size));
+  FILE *list = flow_list ? open_arg(flow_list) : NULL;
+  u_int64_t index = 0, first, count, k;
+  for (;; index++) {
+    if (list) {
+      unsigned long long x;
+      int r = fscanf(list,"%llu",&x);
+      if (r == EOF) break;
+      if (r != 1)
+        die("Bad flow index encountered.\n");
+      index = x;
+    } else if (index >= o->flows) {
+      break;
+    }
+    flow_offsets_get(o,index,&first,&count);
+    if (!count || count < min_packets)
+      continue;
+    flush();
+    last_flow = -1;
+    for (k = first; k < first + count; k++) {
+      packet_decode(version,record_get(f,k,size),&packet);
+      update();
+      last_flow = packet.flow;
+      last_time = packet.time;
+    }
+  }
+  flush();
+  if (list)
+    fclose(list);
+  flow_offsets_close(o);
+  record_file_close(f);
+}
+
 int main(int argc, char **argv) {
   int i;
   parse_opts(argc,argv);
+  if (flow_index) {
+    indexed(argv[optind]);
+    return 0;
+  }
+  int opt_version = version, opt_duplex = duplex;
   if (optind == argc) argc++;
   for (i = optind; i < argc; i++) {
     FILE *file = open_arg(argv[i]);
 
-    while (read_packet(file,&packet)) {
-      ntoh_packet(&packet);
-      packet_time = packet.sec + packet.usec*1e-6;
+    // file headers override -2 and -D
+    file_header h;
+    version = opt_version;
+    duplex = opt_duplex;
+    if (read_file_header(file,&h)) {
+      if (h.type == FILE_FLOWS)
+        die("%s: not a packet file.\n",argv[i]);
+      if (h.sort_major != SORT_NONE && h.sort_major != SORT_FLOW)
+        warn("Warning: %s is not sorted by flow.\n",argv[i]);
+      version = h.version;
+      duplex = h.flags & FILE_DUPLEX ? 1 : 0;
+    }
+
+    // only the columns used are decoded from columnar files
+    packet_reader r;
+    packet_reader_init(&r,file,&h,version,COLUMN_FLOW |
+      (size_ps_max ? COLUMN_SIZE : 0) | (ival_ps_max ? COLUMN_TIME : 0));
+    while (packet_read(&r,&packet)) {
       if (packet.flow != last_flow) flush();
       update();
       last_flow = packet.flow;
-      last_time = packet_time;
+      last_time = packet.time;
     }
     flush();
+    packet_reader_free(&r);
     fclose(file);
-    wait(NULL);
   }
   return 0;
 }
@@ -0,0 +1,496 @@
+// Trace file reading for parse.
+//
+// Classic pcap files, at microsecond or nanosecond resolution, and
+// pcapng files are parsed natively. Uncompressed files are mapped into
+// memory and their records are walked in place, so packet data is
+// never copied; compressed files and stdin are read into a buffer a
+// record or block at a time. pcapng files may have several interfaces,
+// each with its own link type and timestamp resolution.
+//
+// Timestamps are kept at nanosecond precision: trace_next returns
+// nanoseconds in info->ts.tv_usec, as libpcap does for handles opened
+// with PCAP_TSTAMP_PRECISION_NANO.
+//
+// A followed trace is a file that is still being written: instead of
+// ending at the end of the file, reading polls the file for growth and
+// maps it again, calling an idle function between polls which decides
+// whether to keep waiting.
+
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define PCAP_MAGIC          0xa1b2c3d4
+#define PCAP_MAGIC_NANO     0xa1b23c4d
+#define PCAP_MAGIC_MODIFIED 0xa1b2cd34 // Kuznetzov's patched format
+
+#define PCAP_FILE_HEADER    24
+#define PCAP_RECORD_HEADER  16
+#define PCAP_MAX_RECORD     (1 << 18)
+
+#define PCAPNG_SHB          0x0a0d0d0a
+#define PCAPNG_BOM          0x1a2b3c4d
+#define PCAPNG_IDB          1
+#define PCAPNG_PB           2 // obsolete packet block
+#define PCAPNG_SPB          3
+#define PCAPNG_EPB          6
+#define PCAPNG_MAX_BLOCK    (1 << 24)
+
+#define PCAPNG_OPT_TSRESOL  9
+#define PCAPNG_OPT_TSOFFSET 14
+
+// decoding reads a little beyond the captured bytes of truncated
+// packets; packets this close to the end of the mapping are copied
+#define TRACE_SLACK 128
+
+#define TRACE_POLL 100000 // microseconds between polls of followed traces
+
+enum { TRACE_PCAP, TRACE_PCAPNG };
+
+typedef int (*trace_idle)(void); // returns zero to stop following
+
+typedef struct {
+  int linktype;
+  u_int64_t units;   // timestamp units per second
+  int64_t offset;    // seconds added to timestamps
+  int filtered;
+  pcap_t *dead;
+  struct bpf_program program;
+} trace_iface;
+
+typedef struct {
+  const char *name;
+  const char *filter;
+  int format;
+  int linktype;           // of the packet last returned
+
+  // input: either a mapping or a stream
+  const u_char *map;
+  size_t size;
+  size_t pos;
+  FILE *file;
+  u_char *buf;
+  size_t buf_size;
+  int fd;                 // kept open while following
+  trace_idle idle;        // only for followed traces
+
+  int swapped;
+  size_t record_header;   // classic pcap only
+  u_int32_t frac_ns;      // nanoseconds per timestamp fraction unit
+  trace_iface *ifaces;
+  int n_ifaces;
+  trace_iface *iface;     // of the packet last returned
+  int warned_spb;
+  u_int64_t rejected;     // packets rejected by the filter
+} trace;
+
+static inline u_int32_t trace_u32(trace *t, const u_char *p) {
+  u_int32_t x;
+  memcpy(&x,p,sizeof(x));
+  return t->swapped ? GUINT32_SWAP_LE_BE(x) : x;
+}
+
+static inline u_int16_t trace_u16(trace *t, const u_char *p) {
+  u_int16_t x;
+  memcpy(&x,p,sizeof(x));
+  return t->swapped ? GUINT16_SWAP_LE_BE(x) : x;
+}
+
+static int pcap_magic(u_int32_t magic) {
+  switch (magic) {
+    case PCAP_MAGIC:          case 0xd4c3b2a1:
+    case PCAP_MAGIC_NANO:     case 0x4d3cb2a1:
+    case PCAP_MAGIC_MODIFIED: case 0x34cdb2a1:
+      return 1;
+  }
+  return 0;
+}
+
+// pcap files store LINKTYPE_ values, which mostly equal the DLT_ values
+// libpcap uses; the exception decoding cares about is raw IP
+
+#define LINKTYPE_RAW 101
+
+static int trace_dlt(u_int32_t linktype) {
+  linktype &= 0x03ffffff; // drop FCS length bits
+  return linktype == LINKTYPE_RAW ? DLT_RAW : linktype;
+}
+
+// filters are compiled per interface, possibly while other threads
+// are decoding; pcap_compile is not thread-safe
+
+static GMutex compile_lock;
+
+static void trace_add_iface(trace *t, u_int32_t linktype, u_int32_t snaplen,
+                            u_int64_t units, int64_t offset) {
+  t->ifaces = realloc(t->ifaces,(t->n_ifaces+1)*sizeof(trace_iface));
+  if (!t->ifaces)
+    die("realloc: %s\n",errstr);
+  trace_iface *i = &t->ifaces[t->n_ifaces++];
+  memset(i,0,sizeof(*i));
+  i->linktype = trace_dlt(linktype);
+  i->units = units;
+  i->offset = offset;
+  if (t->filter) {
+    g_mutex_lock(&compile_lock);
+    i->dead = pcap_open_dead(i->linktype,snaplen ? snaplen : PCAP_MAX_RECORD);
+    int ret = pcap_compile(
+      i->dead,      // the pcap "object"
+      &i->program,  // filter program
+      t->filter,    // the program argument
+      1,            // do optimization
+      0             // netmask (unused)
+    );
+    if (ret == -1) die("pcap_compile: %s\n",pcap_geterr(i->dead));
+    g_mutex_unlock(&compile_lock);
+    i->filtered = 1;
+  }
+}
+
+static void trace_free_ifaces(trace *t) {
+  int i;
+  for (i = 0; i < t->n_ifaces; i++) {
+    if (t->ifaces[i].filtered) {
+      pcap_freecode(&t->ifaces[i].program);
+      pcap_close(t->ifaces[i].dead);
+    }
+  }
+  free(t->ifaces);
+  t->ifaces = NULL;
+  t->n_ifaces = 0;
+  t->iface = NULL;
+}
+
+// input primitives
+
+static u_char *trace_buffer(trace *t, size_t n) {
+  if (t->buf_size < n + TRACE_SLACK) {
+    t->buf_size = n + TRACE_SLACK;
+    if (!(t->buf = realloc(t->buf,t->buf_size)))
+      die("realloc: %s\n",errstr);
+  }
+  return t->buf;
+}
+
+// wait for a followed trace to grow to at least the given size and
+// map all of it; returns zero if told to stop first
+
+static int trace_grow(trace *t, size_t size) {
+  struct stat fs;
+  for (;;) {
+    if (fstat(t->fd,&fs))
+      die("fstat(\"%s\"): %s\n",t->name,errstr);
+    if (fs.st_size < t->size) {
+      warn("%s: file was truncated; no longer following it.\n",t->name);
+      return 0;
+    }
+    if (fs.st_size >= size) break;
+    if (!t->idle()) return 0;
+    usleep(TRACE_POLL);
+  }
+  if (t->map)
+    munmap((void *) t->map,t->size);
+  void *map = mmap(0,fs.st_size,PROT_READ,MAP_PRIVATE,t->fd,0);
+  if (map == MAP_FAILED)
+    die("mmap(\"%s\"): %s\n",t->name,errstr);
+  t->map = map;
+  t->size = fs.st_size;
+  return 1;
+}
+
+// get the next n bytes of input; returns NULL at the end of the trace,
+// warning unless the end was expected there. Pointers returned before
+// are invalid after this for followed traces, which may be remapped.
+
+static const u_char *trace_read(trace *t, size_t n, int may_end) {
+  if (t->idle && t->size - t->pos < n && !trace_grow(t,t->pos + n)) {
+    if (!may_end || t->pos < t->size)
+      warn("%s: truncated record at end of file.\n",t->name);
+    return NULL;
+  }
+  if (t->map) {
+    if (t->size - t->pos >= n) {
+      const u_char *p = t->map + t->pos;
+      t->pos += n;
+      return p;
+    }
+    if (!may_end || t->pos < t->size)
+      warn("%s: truncated record at end of file.\n",t->name);
+    t->pos = t->size;
+    return NULL;
+  }
+  u_char *p = trace_buffer(t,n);
+  size_t r = fread(p,1,n,t->file);
+  if (r < n) {
+    if (ferror(t->file))
+      die("%s: read error: %s\n",t->name,errstr);
+    if (!may_end || r)
+      warn("%s: truncated record at end of file.\n",t->name);
+    return NULL;
+  }
+  memset(p + n,0,TRACE_SLACK);
+  return p;
+}
+
+// make sure that packet data is followed by readable bytes
+
+static const u_char *trace_slack(trace *t, const u_char *pkt, size_t caplen) {
+  if (!t->map || t->map + t->size - (pkt + caplen) >= TRACE_SLACK)
+    return pkt;
+  u_char *p = trace_buffer(t,caplen);
+  memcpy(p,pkt,caplen);
+  memset(p + caplen,0,TRACE_SLACK);
+  return p;
+}
+
+// classic pcap
+
+static void pcap_header(trace *t, u_int32_t magic) {
+  const u_char *h = trace_read(t,PCAP_FILE_HEADER-4,0);
+  if (!h)
+    die("%s: truncated pcap file header.\n",t->name);
+  t->swapped = magic != PCAP_MAGIC && magic != PCAP_MAGIC_NANO &&
+               magic != PCAP_MAGIC_MODIFIED;
+  if (t->swapped) magic = GUINT32_SWAP_LE_BE(magic);
+  t->format = TRACE_PCAP;
+  t->frac_ns = magic == PCAP_MAGIC_NANO ? 1 : 1000;
+  t->record_header = PCAP_RECORD_HEADER + (magic == PCAP_MAGIC_MODIFIED ? 8 : 0);
+  trace_add_iface(t,trace_u32(t,h+16),trace_u32(t,h+12),
+                  magic == PCAP_MAGIC_NANO ? 1000000000 : 1000000,0);
+  t->iface = &t->ifaces[0];
+}
+
+static const u_char *pcap_record(trace *t, struct pcap_pkthdr *info) {
+  const u_char *h = trace_read(t,t->record_header,1);
+  if (!h) return NULL;
+  // out-of-range fractions carry into seconds rather than overflowing
+  u_int64_t ns = (u_int64_t) trace_u32(t,h+4) * t->frac_ns;
+  info->ts.tv_sec  = trace_u32(t,h+0) + ns / 1000000000;
+  info->ts.tv_usec = ns % 1000000000;
+  info->caplen     = trace_u32(t,h+8);
+  info->len        = trace_u32(t,h+12);
+  if (info->caplen > PCAP_MAX_RECORD)
+    die("%s: bad pcap record length %u.\n",t->name,info->caplen);
+  const u_char *pkt = trace_read(t,info->caplen,0);
+  return pkt ? trace_slack(t,pkt,info->caplen) : NULL;
+}
+
+// pcapng: a file is a sequence of sections, each starting with a
+// section header block that sets the byte order of the section,
+// followed by interface descriptions and packet blocks
+
+static void pcapng_section(trace *t, u_int32_t raw_len) {
+  const u_char *p = trace_read(t,4,0);
+  if (!p)
+    die("%s: truncated pcapng section header.\n",t->name);
+  u_int32_t bom;
+  memcpy(&bom,p,sizeof(bom));
+  if (bom == PCAPNG_BOM)
+    t->swapped = 0;
+  else if (bom == GUINT32_SWAP_LE_BE(PCAPNG_BOM))
+    t->swapped = 1;
+  else
+    die("%s: bad pcapng byte-order magic.\n",t->name);
+  u_int32_t len = t->swapped ? GUINT32_SWAP_LE_BE(raw_len) : raw_len;
+  if (len < 28 || len % 4 || len > PCAPNG_MAX_BLOCK)
+    die("%s: bad pcapng section header length %u.\n",t->name,len);
+  if (!trace_read(t,len-12,0))
+    die("%s: truncated pcapng section header.\n",t->name);
+  trace_free_ifaces(t);
+  t->format = TRACE_PCAPNG;
+}
+
+static void pcapng_iface(trace *t, const u_char *body, size_t n) {
+  if (n < 12)
+    die("%s: bad pcapng interface description.\n",t->name);
+  u_int64_t units = 1000000;
+  int64_t offset = 0;
+  const u_char *o = body + 8, *end = body + n - 4;
+  while (end - o >= 4) {
+    u_int16_t code = trace_u16(t,o), len = trace_u16(t,o+2);
+    o += 4;
+    if (!code || end - o < len) break;
+    if (code == PCAPNG_OPT_TSRESOL && len >= 1) {
+      int e = o[0] & 0x7f;
+      if (o[0] & 0x80 ? e > 63 : e > 19)
+        die("%s: unsupported timestamp resolution.\n",t->name);
+      if (o[0] & 0x80)
+        units = 1ULL << e;
+      else
+        for (units = 1; e; e--) units *= 10;
+    } else if (code == PCAPNG_OPT_TSOFFSET && len >= 8) {
+      u_int64_t x;
+      memcpy(&x,o,sizeof(x));
+      offset = t->swapped ? GUINT64_SWAP_LE_BE(x) : x;
+    }
+    o += (len + 3) & ~3;
+  }
+  trace_add_iface(t,trace_u16(t,body),trace_u32(t,body+4),units,offset);
+}
+
+static void pcapng_time(trace_iface *i, u_int64_t ts, struct pcap_pkthdr *info) {
+  info->ts.tv_sec  = ts / i->units + i->offset;
+  info->ts.tv_usec = (unsigned __int128) (ts % i->units) * 1000000000 / i->units;
+}
+
+static const u_char *pcapng_block(trace *t, struct pcap_pkthdr *info) {
+  for (;;) {
+    const u_char *h = trace_read(t,8,1);
+    if (!h) return NULL;
+    u_int32_t type = trace_u32(t,h), raw_len;
+    memcpy(&raw_len,h+4,sizeof(raw_len));
+    if (type == PCAPNG_SHB) {
+      pcapng_section(t,raw_len);
+      continue;
+    }
+    u_int32_t len = trace_u32(t,h+4);
+    if (len < 12 || len % 4 || len > PCAPNG_MAX_BLOCK)
+      die("%s: bad pcapng block length %u.\n",t->name,len);
+    const u_char *b = trace_read(t,len-8,0);
+    if (!b) return NULL;
+    size_t n = len-8;
+
+    u_int32_t iface;
+    switch (type) {
+      case PCAPNG_IDB:
+        pcapng_iface(t,b,n);
+        continue;
+      case PCAPNG_EPB:
+        iface = n >= 4 ? trace_u32(t,b) : 0;
+        break;
+      case PCAPNG_PB:
+        iface = n >= 2 ? trace_u16(t,b) : 0;
+        break;
+      case PCAPNG_SPB:
+        if (!t->warned_spb)
+          warn("%s: ignoring simple packet blocks (no timestamps).\n",t->name);
+        t->warned_spb = 1;
+        continue;
+      default:
+        continue;
+    }
+    // both packet block types have 20-byte headers
+    if (n < 24)
+      die("%s: bad pcapng packet block.\n",t->name);
+    if (iface >= t->n_ifaces)
+      die("%s: packet for undescribed interface %u.\n",t->name,iface);
+    t->iface = &t->ifaces[iface];
+    info->caplen = trace_u32(t,b+12);
+    info->len    = trace_u32(t,b+16);
+    if (info->caplen > n - 24)
+      die("%s: bad pcapng packet length %u.\n",t->name,info->caplen);
+    pcapng_time(t->iface,(u_int64_t) trace_u32(t,b+4) << 32 | trace_u32(t,b+8),info);
+    return trace_slack(t,b + 20,info->caplen);
+  }
+}
+
+// open a trace, mapping it if it's a regular uncompressed file; traces
+// to follow must be, and are waited for until they have been created
+// and written to. Returns NULL if told to stop following before that.
+
+static void trace_close(trace *t);
+
+static int trace_map(trace *t, const char *arg) {
+  if (!arg || !strcmp(arg,"-")) return 0;
+  int fd = open(arg,O_RDONLY);
+  if (fd < 0)
+    die("open(\"%s\"): %s\n",arg,errstr);
+  struct stat fs;
+  if (fstat(fd,&fs))
+    die("fstat(\"%s\"): %s\n",arg,errstr);
+  if (!S_ISREG(fs.st_mode) || fs.st_size < PCAP_FILE_HEADER) {
+    close(fd);
+    return 0;
+  }
+  void *map = mmap(0,fs.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if (map == MAP_FAILED)
+    die("mmap(\"%s\"): %s\n",arg,errstr);
+  close(fd);
+
+  u_int32_t magic;
+  memcpy(&magic,map,sizeof(magic));
+  if (!pcap_magic(magic) && magic != PCAPNG_SHB) {
+    munmap(map,fs.st_size);
+    return 0;
+  }
+#ifdef POSIX_MADV_SEQUENTIAL
+  posix_madvise(map,fs.st_size,POSIX_MADV_SEQUENTIAL);
+  posix_madvise(map,fs.st_size,POSIX_MADV_WILLNEED);
+#endif
+  t->map = map;
+  t->size = fs.st_size;
+  return 1;
+}
+
+static trace *trace_open(const char *arg, const char *filter, trace_idle idle) {
+  trace *t = calloc(1,sizeof(trace));
+  if (!t)
+    die("calloc: %s\n",errstr);
+  t->name = arg ? arg : "-";
+  t->filter = filter;
+  if (idle) {
+    if (!arg || !strcmp(arg,"-"))
+      die("Can't follow standard input.\n");
+    t->idle = idle;
+    while ((t->fd = open(arg,O_RDONLY)) < 0) {
+      if (errno != ENOENT)
+        die("open(\"%s\"): %s\n",arg,errstr);
+      if (!idle()) {
+        free(t);
+        return NULL;
+      }
+      usleep(TRACE_POLL);
+    }
+  } else if (!trace_map(t,arg)) {
+    t->file = open_arg(arg);
+  }
+
+  const u_char *p = trace_read(t,4,1);
+  u_int32_t magic;
+  if (p)
+    memcpy(&magic,p,sizeof(magic));
+  if (p && pcap_magic(magic)) {
+    pcap_header(t,magic);
+  } else if (p && magic == PCAPNG_SHB) {
+    if (!(p = trace_read(t,4,0)))
+      die("%s: truncated pcapng section header.\n",t->name);
+    memcpy(&magic,p,sizeof(magic));
+    pcapng_section(t,magic);
+  } else if (p || !t->idle) {
+    die("%s: not a%s pcap or pcapng file.\n",t->name,
+      t->idle ? "n uncompressed" : "");
+  } else { // stopped following before anything was written
+    trace_close(t);
+    return NULL;
+  }
+  return t;
+}
+
+// get the next packet passing the filter; returns NULL at the end of
+// the trace. t->linktype is the data link type of the returned packet.
+
+static const u_char *trace_next(trace *t, struct pcap_pkthdr *info) {
+  for (;;) {
+    const u_char *pkt = t->format == TRACE_PCAPNG ?
+      pcapng_block(t,info) : pcap_record(t,info);
+    if (!pkt) return NULL;
+    t->linktype = t->iface->linktype;
+    if (t->iface->filtered &&
+        !pcap_offline_filter(&t->iface->program,info,pkt)) {
+      t->rejected++;
+      continue;
+    }
+    return pkt;
+  }
+}
+
+static void trace_close(trace *t) {
+  if (t->map)
+    munmap((void *) t->map,t->size);
+  if (t->file)
+    fclose(t->file);
+  if (t->idle)
+    close(t->fd);
+  trace_free_ifaces(t);
+  free(t->buf);
+  free(t);
+}
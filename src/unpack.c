@@ -15,30 +15,57 @@ const char *usage =
   "\n"
   "  -P <string>   String to prefix every output line with\n"
   "  -u <string>   String to use for unknown type descriptions\n"
+  "  -a <file>     Address file to resolve flow addresses with\n"
   "  -o <integer>  Offset for flow indices; zero-based flow\n"
   "                indices are added to this (default: 0)\n"
   "\n"
   "  -H <integer>  Number of head lines to output\n"
   "  -T <integer>  Number of tail lines to output\n"
   "  -L <file>     File with indices of flows to output\n"
+  "  -S, --from <time>  Output packets from this time on\n"
+  "  -E, --to <time>    Output packets before this time\n"
+  "  -X <file>     Offset index of the packet file: a flow offset\n"
+  "                index for -L, or a time offset index for -S and\n"
+  "                -E (see sortpkts -x)\n"
   "  -R            Reindex the flows\n"
+  "  -D            Packet sizes are signed (see parse -D)\n"
+  "  -2, --v2      Packet files have version 2 records (see parse -2)\n"
   "\n"
   "Notes:\n"
   "  - You cannot mix flow and packet files in one invocation.\n"
   "  - If neither -f nor -p is given, unpack will try to detect\n"
   "    the correct mode from the format of the input steam.\n"
-  "  - Binary output without other options is identical to input.\n"
+  "  - Files with headers (see parse -H) give their type, record version\n"
+  "    and whether sizes are signed, so -f, -p, -2 and -D aren't needed.\n"
+  "    Binary output of such files has a header without counts.\n"
+  "  - Columnar packet files (see convpkts -c) are output as version 2\n"
+  "    records; -T and -L don't work on them.\n"
+  "  - Block-compressed files (see zpack) are read through their index\n"
+  "    with -T and -L, decompressing only the blocks needed.\n"
+  "  - Binary output without other options is identical to input\n"
+  "    unless it has a header.\n"
   "    Thus, this mode is primarily useful for filtering data.\n"
   "  - The format of the flow index list is white-space text.\n"
-  "  - Packet files must be sorted by flow in packet list mode.\n"
+  "  - Packet files must be sorted by flow in packet list mode. With a\n"
+  "    flow offset index, a flow's packets are found without searching.\n"
   "  - Flow reindexing is primarily so that you can filter flow\n"
   "    and packet files and keep the outputs in sync.\n"
   "  - Flow reindexing does not work in packet tail mode.\n"
-  "  - Head, tail and list modes are mutually exclusive.\n"
+  "  - Head, tail, list and time range modes are mutually exclusive.\n"
+  "  - Times are seconds since the epoch, with up to nine decimals.\n"
+  "    Packet files sorted by time -- indexed, or with headers that say\n"
+  "    so -- are searched for the first packet of the range, and read\n"
+  "    only up to its end; others are read through.\n"
+  "  - Custom packet formats are given the prefix, flow index, seconds,\n"
+  "    microseconds and size as unsigned, unsigned, unsigned, unsigned\n"
+  "    and int; with -2, the flow index, seconds and nanoseconds in place\n"
+  "    of microseconds are unsigned long long.\n"
+  "  - Flows parsed with an address file (see parse -a) need the same\n"
+  "    file given with -a to print their IPv6 addresses; otherwise their\n"
+  "    address references are printed as 240.0.0.0/4 addresses.\n"
 ;
 
-#include <sys/stat.h>
-#include <sys/mman.h>
+#include <ctype.h>
 
 #include "common.h"
 #include "flow_desc.h"
@@ -64,17 +91,60 @@ static char *prefix = NULL;
 static char *format = NULL;
 static char *unknown = "";
 
+static record_writer *out = NULL; // binary output
+
+static int duplex = 0;
+static int version = 1; // of packet records
+
 static u_int32_t offset = 0;
 static u_int32_t head = 0;
 static u_int32_t tail = 0;
 
+static u_char (*addresses)[16] = NULL; // address file contents
+static u_int32_t n_addresses = 0;
+
+static void load_addresses(const char *arg) {
+  FILE *file = open_arg(arg);
+  size_t cap = 1024, r;
+  if (!(addresses = malloc(cap*sizeof(*addresses))))
+    die("malloc: %s\n",errstr);
+  while (r = fread(addresses[n_addresses],sizeof(*addresses),cap-n_addresses,file)) {
+    n_addresses += r;
+    if (n_addresses == cap) {
+      cap *= 2;
+      if (!(addresses = realloc(addresses,cap*sizeof(*addresses))))
+        die("realloc: %s\n",errstr);
+    }
+  }
+  if (ferror(file))
+    die("fread(%s): %s\n",arg,errstr);
+  fclose(file);
+}
+
+// format a flow address, resolving references into the address file
+
+static void format_addr(u_int32_t ip, char *buf, size_t len) {
+  if (!addresses || !IS_ADDR_REF(ip)) {
+    inet_ntop(AF_INET,&ip,buf,len);
+    return;
+  }
+  u_int32_t n = ADDR_REF_INDEX(ip);
+  if (n >= n_addresses)
+    die(n_addresses ? "Address index too large: %u, but only %u addresses.\n" :
+        "Address index %u, but no address file (see -a).\n",n,n_addresses);
+  if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *) addresses[n]))
+    inet_ntop(AF_INET,addresses[n]+12,buf,len);
+  else
+    inet_ntop(AF_INET6,addresses[n],buf,len);
+}
+
 static void print_flow(u_int32_t index, flow_record flow) {
   if (binary)
-    return write_flow(stdout,&flow);
+    return write_flow(out,&flow);
   ntoh_flow(&flow);
-  char src[MAX_IP_LENGTH+1], dst[MAX_IP_LENGTH+1];
-  inet_ntop(AF_INET,&flow.src_ip,src,sizeof(src));
-  inet_ntop(AF_INET,&flow.dst_ip,dst,sizeof(dst));
+  char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+  format_addr(flow.src_ip,src,sizeof(src));
+  format_addr(flow.dst_ip,dst,sizeof(dst));
   char *proto_str = proto_name(flow.proto);
   char *desc = NULL;
   switch (flow.proto) {
@@ -101,20 +171,80 @@ static void print_flow(u_int32_t index, flow_record flow) {
   );
 }
 
-static void print_packet(packet_record packet, u_int32_t flow) {
-  if (binary) {
-    if (flow != -1)
-      packet.flow = htonl(flow);
-    return write_packet(stdout,&packet);
+static void print_packet(packet_data packet, u_int64_t flow) {
+  if (flow != -1)
+    packet.flow = flow;
+  if (binary)
+    return write_packet_data(out,version,&packet);
+  int size = duplex ? (int16_t) packet.size : packet.size;
+  if (version == 2)
+    printf(format,
+      prefix ? prefix : "",
+      (unsigned long long) (offset + packet.flow),
+      (unsigned long long) (packet.time / NSEC_PER_SEC),
+      (unsigned long long) (packet.time % NSEC_PER_SEC),
+      size
+    );
+  else
+    printf(format,
+      prefix ? prefix : "",
+      (u_int32_t) (offset + packet.flow),
+      (u_int32_t) (packet.time / NSEC_PER_SEC),
+      (u_int32_t) (packet.time % NSEC_PER_SEC / 1000),
+      size
+    );
+}
+
+// flow index and time of the i-th packet record of a file
+
+static inline u_int64_t record_flow(record_file *f, u_int64_t i) {
+  packet_data packet;
+  packet_decode(version,record_get(f,i,packet_record_size(version)),&packet);
+  return packet.flow;
+}
+
+static inline u_int64_t record_time(record_file *f, u_int64_t i) {
+  packet_data packet;
+  packet_decode(version,record_get(f,i,packet_record_size(version)),&packet);
+  return packet.time;
+}
+
+// the first of n packets at or after a time in a file sorted by time,
+// searching between index entries, or within the first block that can
+// hold it if the file has blocks
+
+static u_int64_t time_search(record_file *f, time_offsets *o, u_int64_t n,
+                             u_int64_t time) {
+  u_int64_t lo = 0, hi = n;
+  if (o) {
+    time_offsets_find(o,time,&lo,&hi);
+  } else if (f->blocks) {
+    u_int64_t b = block_find_time(f->blocks,time);
+    if (b == f->blocks->n_blocks)
+      return n;
+    lo = f->blocks->index[b].first;
+    hi = lo + f->blocks->index[b].records;
   }
-  ntoh_packet(&packet);
-  printf(format,
-    prefix ? prefix : "",
-    offset + (flow == -1 ? packet.flow : flow),
-    packet.sec,
-    packet.usec,
-    packet.size
-  );
+  while (lo < hi) {
+    u_int64_t mid = lo + (hi - lo) / 2;
+    if (record_time(f,mid) < time) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+// seconds since the epoch, in nanoseconds
+
+static u_int64_t parse_time(const char *arg) {
+  char *end;
+  u_int64_t time = strtoull(arg,&end,10) * NSEC_PER_SEC, unit = NSEC_PER_SEC;
+  if (*end == '.')
+    for (end++; isdigit(*end) && unit > 1; end++)
+      time += (*end - '0') * (unit /= 10);
+  while (isdigit(*end))
+    end++;
+  if (end == arg || *end)
+    die("Bad time: `%s'.\n",arg);
+  return time;
 }
 
 // main processing loop
@@ -123,11 +253,22 @@ int main(int argc, char ** argv) {
 
   // option variables
   char *flow_list = NULL;
+  char *index_file = NULL;
+  int ranged = 0;
+  u_int64_t from = 0, to = -1;
+  char *address_file = NULL;
   int reindex = 0;
 
+  static struct option longopts[] = {
+    { "from", required_argument, 0, 'S' },
+    { "to",   required_argument, 0, 'E' },
+    { "v2",   no_argument,       0, '2' },
+    { 0, 0, 0, 0 }
+  };
+
   // parse options, leave arguments
   int i;
-  while ((i = getopt(argc,argv,"fptcbF:P:u:o:H:T:L:Rh")) != -1) {
+  while ((i = getopt_long(argc,argv,"fptcbF:P:u:a:o:H:T:L:S:E:X:RD2h",longopts,0)) != -1) {
     switch (i) {
 
       case 'f':
@@ -158,6 +299,9 @@ int main(int argc, char ** argv) {
       case 'u':
         unknown = optarg;
         break;
+      case 'a':
+        address_file = optarg;
+        break;
 
       case 'o':
         offset = atoi(optarg);
@@ -176,9 +320,26 @@ int main(int argc, char ** argv) {
       case 'L':
         flow_list = optarg;
         break;
+      case 'S':
+        from = parse_time(optarg);
+        ranged = 1;
+        break;
+      case 'E':
+        to = parse_time(optarg);
+        ranged = 1;
+        break;
+      case 'X':
+        index_file = optarg;
+        break;
       case 'R':
         reindex = 1;
         break;
+      case 'D':
+        duplex = 1;
+        break;
+      case '2':
+        version = 2;
+        break;
 
       case 'h':
         printf("%s",usage);
@@ -196,6 +357,8 @@ int main(int argc, char ** argv) {
     die("You cannot use -H and -T together.\n");
   if ((head || tail) && flow_list)
     die("You cannot use -L with -H or -T.\n");
+  if (ranged && (head || tail || flow_list))
+    die("You cannot use -S or -E with -H, -T or -L.\n");
 
   if (format) {
     format = strdup(format);
@@ -211,13 +374,69 @@ int main(int argc, char ** argv) {
     prefix[len+1] = '\0';
   }
 
+  if (address_file)
+    load_addresses(address_file);
+  if (binary)
+    out = writer_fd(fileno(stdout));
+
   if (optind == argc) argc++;
   for (i = optind; i < argc; i++) {
-    FILE *file = open_arg(argv[i]);
-    if (input == INPUT_UNKNOWN) {
-      char c = fgetc(file);
-      input = c ? INPUT_FLOWS : INPUT_PACKETS;
-      ungetc(c,file);
+    // tail, list and time range modes read records by number, through
+    // the block index of block-compressed files; time ranges of other
+    // files are read through
+    FILE *file = NULL;
+    record_file *records = NULL;
+    file_header h;
+    if (tail || flow_list || ranged)
+      records = record_file_open(argv[i]);
+    if (records && ranged && records->h.type == FILE_COLUMNS) {
+      record_file_close(records);
+      records = NULL;
+    }
+    if (records) {
+      h = records->h;
+    } else if (tail || flow_list) {
+      die("%s: -T and -L need a plain or block-compressed file.\n",
+        argv[i] ? argv[i] : "-");
+    } else {
+      file = open_arg(argv[i]);
+      read_file_header(file,&h);
+    }
+    if (h.size) {
+      int type = h.type == FILE_FLOWS ? INPUT_FLOWS : INPUT_PACKETS;
+      if (input != INPUT_UNKNOWN && input != type)
+        die("%s: not a %s file.\n",argv[i],
+          input == INPUT_FLOWS ? "flow" : "packet");
+      // columnar packets are output as version 2 records
+      int v = h.type == FILE_COLUMNS ? 2 : h.version;
+      if (i > optind && version != v)
+        die("You cannot mix packet record versions.\n");
+      if (h.type == FILE_COLUMNS && (tail || flow_list))
+        die("%s: -T and -L need packet records, not columns.\n",argv[i]);
+      input = type;
+      version = v;
+      if (h.flags & FILE_DUPLEX)
+        duplex = 1;
+      if (binary && i == optind) {
+        // records are filtered, so only the kind of file carries over
+        file_header oh;
+        file_header_init(&oh,type == INPUT_FLOWS ? FILE_FLOWS : FILE_PACKETS,v);
+        oh.flags = h.flags & FILE_DUPLEX;
+        if (argc - optind == 1) {
+          oh.sort_major = h.sort_major;
+          oh.sort_minor = h.sort_minor;
+        }
+        write_file_header(out,&oh);
+      }
+    } else if (input == INPUT_UNKNOWN) {
+      if (records) {
+        input = !records->bytes || records->records[0] ?
+          INPUT_FLOWS : INPUT_PACKETS;
+      } else {
+        char c = fgetc(file);
+        input = c ? INPUT_FLOWS : INPUT_PACKETS;
+        ungetc(c,file);
+      }
     }
     if (!format && !binary) {
       switch (input) {
@@ -227,31 +446,28 @@ int main(int argc, char ** argv) {
             output == OUTPUT_CSV ? "%s%u,%u,%s,%s,%u,%u,%s,%s\n" : NULL;
           break;
         case INPUT_PACKETS:
-          format =
-            output == OUTPUT_TAB ? "%s%u\t%u.%06u\t%u\n" :
-            output == OUTPUT_CSV ? "%s%u,%u.%06u,%u\n" : NULL;
+          if (version == 2)
+            format =
+              output == OUTPUT_TAB ? "%s%llu\t%llu.%09llu\t%d\n" :
+              output == OUTPUT_CSV ? "%s%llu,%llu.%09llu,%d\n" : NULL;
+          else
+            format =
+              output == OUTPUT_TAB ? "%s%u\t%u.%06u\t%d\n" :
+              output == OUTPUT_CSV ? "%s%u,%u.%06u,%d\n" : NULL;
           break;
       }
     }
     switch (input) {
       case INPUT_FLOWS: {
+        if (ranged)
+          die("-S and -E need packet files.\n");
         u_int32_t index = 0;
         flow_record flow;
         if (head) {
           for (; index < head && read_flow(file,&flow); index++)
             print_flow(index,flow);
         } else if (flow_list) {
-          struct stat fs;
-          fstat(fileno(file),&fs);
-          u_int32_t n = fs.st_size / sizeof(flow_record);
-          flow_record *flows = mmap(
-            0,
-            fs.st_size,
-            PROT_READ,
-            MAP_PRIVATE,
-            fileno(file),
-            0
-          );
+          u_int32_t n = record_count(records,sizeof(flow_record));
           FILE *indices = open_arg(flow_list);
           u_int32_t new_index = 0;
           for (;;) {
@@ -262,89 +478,125 @@ int main(int argc, char ** argv) {
             if (index >= n)
               die("Flow index too large: %u > %u.\n",index,n-1);
 
-            print_flow(reindex ? new_index++ : index, flows[index]);
+            print_flow(reindex ? new_index++ : index,
+              *(flow_record *) record_get(records,index,sizeof(flow_record)));
           }
+        } else if (tail) {
+          u_int32_t n = record_count(records,sizeof(flow_record));
+          for (index = n > tail ? n - tail : 0; index < n; index++)
+            print_flow(index,
+              *(flow_record *) record_get(records,index,sizeof(flow_record)));
         } else {
-          if (tail) {
-            struct stat fs;
-            fstat(fileno(file),&fs);
-            u_int32_t n = fs.st_size / sizeof(flow_record);
-            index = n - tail;
-            if (fseek(file,index * sizeof(flow_record),SEEK_SET))
-              die("fseek(%s): %s\n",argv[i],errstr);
-          }
           while (read_flow(file,&flow))
             print_flow(index++,flow);
         }
         break;
       }
       case INPUT_PACKETS: {
-        packet_record packet;
-        if (head) {
+        packet_data packet;
+        size_t record_size = packet_record_size(version);
+        if (head || !records) {
+          packet_reader r;
+          packet_reader_init(&r,file,&h,version,COLUMN_ALL);
           u_int32_t index = 0;
-          for (; index < head && read_packet(file,&packet); index++)
-            print_packet(packet,-1);
+          while ((!head || index++ < head) && packet_read(&r,&packet)) {
+            if (packet.time >= to && h.sort_major == SORT_TIME)
+              break;
+            if (packet.time >= from && packet.time < to)
+              print_packet(packet,-1);
+          }
+          packet_reader_free(&r);
+        } else if (ranged) {
+          u_int64_t n = record_count(records,record_size), k = 0;
+          time_offsets *offsets = index_file ?
+            time_offsets_open(index_file,n) : NULL;
+          int sorted = offsets || h.sort_major == SORT_TIME;
+          if (sorted)
+            k = time_search(records,offsets,n,from);
+          for (; k < n; k++) {
+            packet_decode(version,record_get(records,k,record_size),&packet);
+            if (packet.time >= to && sorted)
+              break;
+            if (packet.time >= from && packet.time < to)
+              print_packet(packet,-1);
+          }
+          if (offsets)
+            time_offsets_close(offsets);
         } else if (flow_list) {
-          struct stat fs;
-          fstat(fileno(file),&fs);
-          u_int32_t n = fs.st_size / sizeof(packet_record);
-          packet_record *packets = mmap(
-            0,
-            fs.st_size,
-            PROT_READ,
-            MAP_PRIVATE,
-            fileno(file),
-            0
-          );
-          // verify that packets are sorted by flow
-          for (i = 0; i < 1000 & i < n-2; i++)
-            if (ntohl(packets[i].flow) > ntohl(packets[i+1].flow))
-              die("Packet file must be sorted by flow when using -L.\n");
-
-          u_int32_t max_flow = ntohl(packets[n-1].flow);
+          u_int64_t n = record_count(records,record_size);
+          flow_offsets *offsets = index_file ?
+            flow_offsets_open(index_file,n) : NULL;
+          // verify that packets are sorted by flow, unless a header says so
+          u_int64_t k;
+          if (h.sort_major != SORT_FLOW && !offsets)
+            for (k = 0; k < 1000 && k+1 < n; k++)
+              if (record_flow(records,k) > record_flow(records,k+1))
+                die("Packet file must be sorted by flow when using -L.\n");
+
+          u_int64_t max_flow = offsets ? offsets->flows - 1 :
+            h.flags & FILE_MAX_FLOW ? h.max_flow : record_flow(records,n-1);
           FILE *flows = open_arg(flow_list);
-          u_int32_t new_index = -1;
+          u_int64_t new_index = -1;
           for (;;) {
-            u_int32_t flow;
-            int r = fscanf(flows,"%u",&flow);
+            unsigned long long flow;
+            int r = fscanf(flows,"%llu",&flow);
             if (r == EOF) break;
             if (r != 1)
               die("Bad flow index encountered.\n");
             if (flow > max_flow)
-              die("Flow index too large: %u > %u.\n",flow,max_flow);
-
-            // binary search for flow index in packet file
-            long long L = -1, R = n-1;
-            while (L < R-1) {
-              // TODO: smarter guess at location -- use proportion of flows
-              // based on index; assume that flows have equal packet count.
-              u_int32_t M = (L + R)/2;
-              if (ntohl(packets[M].flow) < flow) L = M; else R = M;
+              die("Flow index too large: %llu > %llu.\n",
+                flow,(unsigned long long) max_flow);
+
+            // the flow's packets are given by the offset index, or found
+            // by binary search, within the first block that can hold
+            // them if the file has blocks
+            u_int64_t first, count;
+            if (offsets) {
+              flow_offsets_get(offsets,flow,&first,&count);
+            } else {
+              long long L = -1, R = n-1;
+              if (records->blocks) {
+                block_file *b = records->blocks;
+                block_entry *e = &b->index[block_find_flow(b,flow)];
+                L = (long long) e->first - 1;
+                R = e->first + e->records - 1;
+              }
+              while (L < R-1) {
+                u_int64_t M = (L + R)/2;
+                if (record_flow(records,M) < flow) L = M; else R = M;
+              }
+              for (first = R, count = 0;
+                   R < n && record_flow(records,R) == flow; R++)
+                count++;
             }
-            if (reindex && packets[R].flow == htonl(flow))
+            if (reindex && count)
               new_index++;
-            while (packets[R].flow == htonl(flow))
-              print_packet(packets[R++],new_index);
+            for (k = first; k < first + count; k++) {
+              packet_decode(version,record_get(records,k,record_size),&packet);
+              print_packet(packet,new_index);
+            }
           }
+          if (offsets)
+            flow_offsets_close(offsets);
         } else {
-          if (tail) {
-            if (reindex)
-              die("Can't reindex flows in packet tail mode.\n");
-            struct stat fs;
-            fstat(fileno(file),&fs);
-            u_int32_t n = fs.st_size / sizeof(packet_record);
-            if (fseek(file,(n - tail) * sizeof(packet_record),SEEK_SET))
-              die("fseek(%s): %s\n",argv[i],errstr);
-          }
-          while (read_packet(file,&packet))
+          if (reindex)
+            die("Can't reindex flows in packet tail mode.\n");
+          u_int64_t n = record_count(records,record_size), k;
+          for (k = n > tail ? n - tail : 0; k < n; k++) {
+            packet_decode(version,record_get(records,k,record_size),&packet);
             print_packet(packet,-1);
+          }
         }
         break;
       }
     }
-    fclose(file);
-    wait(NULL);
+    if (records)
+      record_file_close(records);
+    else
+      fclose(file);
   }
+  if (binary)
+    writer_close(out);
 
   return 0;
 }
@@ -0,0 +1,136 @@
+const char *usage =
+  "Usage:\n"
+  "  zpack [options] [<flow or packet file>]\n"
+  "\n"
+  "  Compresses a flow or packet file into blocks of records with zstd,\n"
+  "  with an index of the blocks, writing the result to stdout.\n"
+  "\n"
+  "Options:\n"
+  "  -f             Input is a flow file\n"
+  "  -p             Input is a packet file\n"
+  "  -2, --v2       Packet records are version 2 (see parse -2)\n"
+  "  -D             Packet sizes are signed (see parse -D)\n"
+  "  -n <integer>   Records per block (default: 65536)\n"
+  "  -l <integer>   Compression level (default: 3)\n"
+  "\n"
+  "Notes:\n"
+  "  - The output is a zstd file that decompresses to the input with\n"
+  "    a header (see parse -H), so name it with a .zst suffix: all the\n"
+  "    tools read it like any zstd file, decompressing its blocks in\n"
+  "    parallel, and `zstd -d' gives back the input.\n"
+  "  - The index gives each block's first record number and, for\n"
+  "    packet files, its least and greatest flow index and time, so\n"
+  "    unpack -T and -L decompress only the blocks they need.\n"
+  "  - Inputs with headers give their own type, version and -D; for\n"
+  "    others, the type is detected as unpack does without -f or -p.\n"
+  "  - Columnar packet files (see convpkts -c) can't be block-compressed.\n"
+;
+
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+int type = 0;
+int version = 1;
+int duplex = 0;
+u_int32_t records = BLOCK_RECORDS;
+int level = 3;
+
+void parse_opts(int argc, char **argv) {
+
+  static struct option longopts[] = {
+    { "v2",   no_argument, 0, '2' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+
+  int c;
+  while ((c = getopt_long(argc,argv,"fp2Dn:l:h",longopts,0)) != -1) {
+    switch (c) {
+
+      case 'f':
+        type = FILE_FLOWS;
+        break;
+      case 'p':
+        type = FILE_PACKETS;
+        break;
+      case '2':
+        version = 2;
+        break;
+      case 'D':
+        duplex = 1;
+        break;
+      case 'n':
+        if (atoi(optarg) <= 0)
+          die("Records per block must be positive.\n");
+        records = atoi(optarg);
+        break;
+      case 'l':
+        level = atoi(optarg);
+        break;
+
+      case 'h':
+        printf("%s",usage);
+        exit(0);
+
+      case '?':
+        if (isprint(optopt))
+          die("Unknown option `-%c'.\n",optopt);
+        else
+          die("Strange option `\\x%x'.\n",optopt);
+
+      default:
+        die("ERROR: getopt badness.\n");
+    }
+  }
+  if (argc - optind > 1)
+    die("zpack takes a single input file.\n");
+}
+
+int main(int argc, char **argv) {
+  parse_opts(argc,argv);
+  FILE *file = open_arg(argv[optind]);
+  file_header h;
+  if (read_file_header(file,&h)) {
+    if (h.type == FILE_COLUMNS)
+      die("Columnar packet files can't be block-compressed.\n");
+    if (type && h.type != type)
+      die("Input is not a %s file.\n",type == FILE_FLOWS ? "flow" : "packet");
+  } else {
+    if (!type) {
+      int c = fgetc(file);
+      type = c ? FILE_FLOWS : FILE_PACKETS;
+      ungetc(c,file);
+    }
+    file_header_init(&h,type,type == FILE_FLOWS ? 1 : version);
+    if (duplex && type == FILE_PACKETS)
+      h.flags |= FILE_DUPLEX;
+  }
+  size_t record_size = h.type == FILE_FLOWS ?
+    sizeof(flow_record) : packet_record_size(h.version);
+
+  // the header goes first, so the count has to be known up front
+  struct stat fs;
+  if (!(h.flags & FILE_COUNT) &&
+      !fstat(fileno(file),&fs) && S_ISREG(fs.st_mode)) {
+    h.count = (fs.st_size - h.size) / record_size;
+    h.flags |= FILE_COUNT;
+  }
+  h.size = FILE_HEADER_SIZE;
+
+  record_writer *out = writer_fd(fileno(stdout));
+  block_writer *b = block_writer_open(out,&h,records,level);
+  char record[sizeof(packet_record_v2)];
+  size_t n;
+  while ((n = fread(record,1,record_size,file)) == record_size)
+    block_put(b,record);
+  if (ferror(file))
+    die("fread: %s\n",errstr);
+  if (n)
+    die("Truncated record at end of input.\n");
+  block_writer_close(b);
+  writer_close(out);
+  fclose(file);
+  return 0;
+}